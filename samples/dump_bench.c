@@ -0,0 +1,138 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// number of levels of alloc_path() that make the backtraces different, they
+// fill the default backtrace depth of 8 with malloc and the leaf.
+#define NR_LEVELS 6
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define CALL(n)                                                                                    \
+	case n:                                                                                    \
+		p = alloc_path(level - 1, path / 16);                                              \
+		break
+
+// Each case is a different call site, so each path has its own backtrace.
+__attribute__((noinline)) static void *alloc_path(int level, unsigned long path)
+{
+	void *p = NULL;
+
+	if (level == 0)
+		return malloc(16);
+
+	switch (path % 16) {
+		CALL(0); CALL(1); CALL(2); CALL(3); CALL(4); CALL(5); CALL(6); CALL(7);
+		CALL(8); CALL(9); CALL(10); CALL(11); CALL(12); CALL(13); CALL(14); CALL(15);
+	}
+	return p;
+}
+
+static long read_status_kb(const char *key)
+{
+	FILE *fp = fopen("/proc/self/status", "r");
+	char line[256];
+	long val = 0;
+
+	while (fp && fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, key, strlen(key)))
+			val = atol(line + strlen(key));
+	}
+	if (fp)
+		fclose(fp);
+	return val;
+}
+
+// resets the peak RSS (VmHWM) to the current RSS.
+static void reset_peak_rss(void)
+{
+	FILE *fp = fopen("/proc/self/clear_refs", "w");
+
+	if (fp) {
+		fputs("5", fp);
+		fclose(fp);
+	}
+}
+
+// requests a dump to heaptrace and returns the size of the output.
+static long request_dump(int top)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char buf[65536];
+	long total = 0;
+	ssize_t len;
+	int fd;
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/heaptrace.%d.ctl", getpid());
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "cannot connect to %s, run it with heaptrace\n", addr.sun_path);
+		exit(1);
+	}
+
+	len = snprintf(buf, sizeof(buf), "dump\ttop=%d\n", top);
+	if (write(fd, buf, len) != len) {
+		perror("write");
+		exit(1);
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		total += len;
+	close(fd);
+	return total;
+}
+
+/*
+ * Usage: dump_bench.out [<number of backtraces> [<top>]]
+ *
+ * Makes live objects with as many different backtraces under heaptrace, and
+ * then measures the time and the peak memory of a dump with <top> backtraces
+ * requested through the control socket.
+ */
+int main(int argc, char *argv[])
+{
+	long nr_stacks = argc > 1 ? atol(argv[1]) : 100000;
+	int top = argc > 2 ? atoi(argv[2]) : 10;
+	void **objs;
+	double begin, elapsed;
+	long rss, peak, size;
+	long i;
+
+	if (nr_stacks > (1L << (4 * NR_LEVELS)))
+		nr_stacks = 1L << (4 * NR_LEVELS);
+
+	objs = malloc(sizeof(*objs) * nr_stacks);
+	for (i = 0; i < nr_stacks; i++)
+		objs[i] = alloc_path(NR_LEVELS, i);
+
+	rss = read_status_kb("VmRSS:");
+	reset_peak_rss();
+
+	begin = now();
+	size = request_dump(top);
+	elapsed = now() - begin;
+
+	peak = read_status_kb("VmHWM:");
+
+	printf("stacks: %8ld  top: %6d  dump: %8.3f sec  output: %10ld bytes  peak RSS: +%ld KB\n",
+	       nr_stacks, top, elapsed, size, peak > rss ? peak - rss : 0);
+
+	for (i = 0; i < nr_stacks; i++)
+		free(objs[i]);
+	free(objs);
+
+	return 0;
+}
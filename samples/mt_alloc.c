@@ -0,0 +1,71 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NR_SLOTS 64
+
+static long nr_iters = 1000000;
+
+static void *worker(void *arg)
+{
+	void *slots[NR_SLOTS] = {};
+	long i;
+
+	for (i = 0; i < nr_iters; i++) {
+		int idx = i % NR_SLOTS;
+
+		free(slots[idx]);
+		slots[idx] = malloc(16 + idx * 8);
+	}
+	for (i = 0; i < NR_SLOTS; i++)
+		free(slots[i]);
+
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Usage: mt_alloc.out [<max threads> [<iterations per thread>]]
+ *
+ * Runs malloc/free loops with 1, 2, 4, ... threads up to <max threads> and
+ * prints the aggregated throughput to show how tracing scales.
+ */
+int main(int argc, char *argv[])
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	pthread_t *threads;
+	int nr, i;
+
+	if (argc > 2)
+		nr_iters = atol(argv[2]);
+
+	threads = malloc(sizeof(*threads) * max_threads);
+
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		double begin = now();
+		double elapsed;
+
+		for (i = 0; i < nr; i++)
+			pthread_create(&threads[i], NULL, worker, NULL);
+		for (i = 0; i < nr; i++)
+			pthread_join(threads[i], NULL);
+
+		elapsed = now() - begin;
+		fprintf(stderr, "threads: %3d  elapsed: %8.3f sec  %12.0f ops/sec\n", nr, elapsed,
+			nr * nr_iters / elapsed);
+	}
+
+	free(threads);
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long nr_iters = 1000000;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void alloc_loop(void)
+{
+	double begin = now();
+	long i;
+
+	for (i = 0; i < nr_iters; i++)
+		free(malloc(32));
+
+	fprintf(stderr, "%.1f ns per malloc/free\n", (now() - begin) * 1e9 / nr_iters);
+}
+
+// recurse to make the stack deeper than the backtrace depth.
+__attribute__((noinline)) static int recurse(int n)
+{
+	if (n == 0) {
+		alloc_loop();
+		return 0;
+	}
+	return recurse(n - 1) + 1;
+}
+
+/*
+ * Usage: unwind_bench.out [<stack depth> [<iterations>]]
+ *
+ * Compare the unwinders with a heaptrace built with DEPTH=8/16/32:
+ *   $ heaptrace --unwind=backtrace samples/unwind_bench.out 64
+ *   $ heaptrace --unwind=fp samples/unwind_bench.out 64
+ */
+int main(int argc, char *argv[])
+{
+	int depth = argc > 1 ? atoi(argv[1]) : 64;
+
+	if (argc > 2)
+		nr_iters = atol(argv[2]);
+
+	return recurse(depth);
+}
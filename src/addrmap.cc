@@ -0,0 +1,241 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "addrmap.h"
+#include "compiler.h"
+#include "utils.h"
+
+// initial number of entries of a table, it must be a power of 2.
+#define ADDRMAP_INIT_ENTRIES 256
+
+// number of old table slots visited by each insert/erase during a resize.
+// The table grows when it gets half full so the old table is entirely moved
+// before the new table gets half full as long as this is bigger than 2.
+#define ADDRMAP_MIGRATE_STEPS 8
+
+// number of counters in the address filter, it must be a power of 2.
+#define ADDR_FILTER_SIZE (1 << 18)
+
+static std::atomic<uint32_t> *addr_filter;
+
+static inline size_t home_slot(addr_t addr, size_t mask)
+{
+	return utils::hash_mix((uintptr_t)addr) & mask;
+}
+
+bool addrmap_t::table_alloc(table_t &table, size_t nr_entries)
+{
+	void *p = mmap(nullptr, nr_entries * sizeof(entry_t), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+
+	// anonymous mapping is zero filled so every entry is empty.
+	table.entries = static_cast<entry_t *>(p);
+	table.mask = nr_entries - 1;
+	table.count = 0;
+	return true;
+}
+
+void addrmap_t::table_free(table_t &table)
+{
+	if (table.entries)
+		munmap(table.entries, (table.mask + 1) * sizeof(entry_t));
+	table = {};
+}
+
+addrmap_t::entry_t *addrmap_t::table_find(const table_t &table, addr_t addr)
+{
+	if (!table.entries)
+		return nullptr;
+
+	size_t i = home_slot(addr, table.mask);
+	while (true) {
+		entry_t *entry = &table.entries[i];
+		if (entry->addr == addr)
+			return entry;
+		if (entry->addr == nullptr)
+			return nullptr;
+		i = (i + 1) & table.mask;
+	}
+}
+
+addrmap_t::entry_t *addrmap_t::table_insert(table_t &table, addr_t addr)
+{
+	size_t i = home_slot(addr, table.mask);
+	while (true) {
+		entry_t *entry = &table.entries[i];
+		if (entry->addr == addr)
+			return entry;
+		if (entry->addr == nullptr) {
+			entry->addr = addr;
+			table.count++;
+			return entry;
+		}
+		i = (i + 1) & table.mask;
+	}
+}
+
+// Backward shift deletion: move the following entries of the probe sequence
+// into the hole as long as it doesn't move them before their home slot.
+void addrmap_t::table_remove(table_t &table, entry_t *entry)
+{
+	size_t mask = table.mask;
+	size_t hole = entry - table.entries;
+	size_t i = hole;
+
+	while (true) {
+		i = (i + 1) & mask;
+
+		entry_t *next = &table.entries[i];
+		if (next->addr == nullptr)
+			break;
+
+		// distance from the home slot, the entry can move into the hole
+		// only if the hole is still within its probe sequence.
+		size_t home = home_slot(next->addr, mask);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table.entries[hole] = *next;
+			hole = i;
+		}
+	}
+	table.entries[hole].addr = nullptr;
+	table.entries[hole].info = {};
+	table.count--;
+}
+
+bool addrmap_t::grow(void)
+{
+	size_t nr_entries = cur.entries ? (cur.mask + 1) * 2 : ADDRMAP_INIT_ENTRIES;
+	table_t table;
+
+	// finish the previous resize in case it didn't catch up.
+	if (old.entries)
+		migrate(SIZE_MAX);
+
+	if (!table_alloc(table, nr_entries))
+		return false;
+
+	old = cur;
+	cur = table;
+	migrate_pos = 0;
+	return true;
+}
+
+void addrmap_t::migrate(size_t nr_steps)
+{
+	if (likely(!old.entries))
+		return;
+
+	while (nr_steps-- && migrate_pos <= old.mask) {
+		entry_t *entry = &old.entries[migrate_pos];
+
+		if (entry->addr == nullptr) {
+			migrate_pos++;
+			continue;
+		}
+
+		// the slot might be filled again by the backward shift, so
+		// don't move forward and check the same slot next time.
+		entry_t *moved = table_insert(cur, entry->addr);
+		moved->info = entry->info;
+		table_remove(old, entry);
+	}
+
+	if (migrate_pos > old.mask)
+		table_free(old);
+}
+
+object_info_t *addrmap_t::find(addr_t addr)
+{
+	entry_t *entry = table_find(cur, addr);
+
+	if (!entry && unlikely(old.entries))
+		entry = table_find(old, addr);
+	return entry ? &entry->info : nullptr;
+}
+
+object_info_t *addrmap_t::insert(addr_t addr)
+{
+	if (unlikely((size() + 1) * 2 > (cur.entries ? cur.mask + 1 : 0))) {
+		if (!grow())
+			return nullptr;
+	}
+
+	migrate(ADDRMAP_MIGRATE_STEPS);
+
+	entry_t *entry;
+	if (unlikely(old.entries) && (entry = table_find(old, addr))) {
+		object_info_t info = entry->info;
+
+		table_remove(old, entry);
+		entry = table_insert(cur, addr);
+		entry->info = info;
+		return &entry->info;
+	}
+
+	return &table_insert(cur, addr)->info;
+}
+
+bool addrmap_t::erase(addr_t addr, object_info_t *info)
+{
+	migrate(ADDRMAP_MIGRATE_STEPS);
+
+	table_t *table = &cur;
+	entry_t *entry = table_find(cur, addr);
+
+	if (!entry && unlikely(old.entries)) {
+		table = &old;
+		entry = table_find(old, addr);
+	}
+	if (!entry)
+		return false;
+
+	if (info)
+		*info = entry->info;
+	table_remove(*table, entry);
+	return true;
+}
+
+void addrmap_t::clear(void)
+{
+	table_free(old);
+	table_free(cur);
+	migrate_pos = 0;
+}
+
+static inline std::atomic<uint32_t> &filter_counter(addr_t addr)
+{
+	return addr_filter[utils::hash_mix((uintptr_t)addr) & (ADDR_FILTER_SIZE - 1)];
+}
+
+bool addr_filter_init(void)
+{
+	void *p = mmap(nullptr, ADDR_FILTER_SIZE * sizeof(*addr_filter), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+
+	addr_filter = static_cast<std::atomic<uint32_t> *>(p);
+	return true;
+}
+
+void addr_filter_add(addr_t addr)
+{
+	filter_counter(addr).fetch_add(1, std::memory_order_relaxed);
+}
+
+void addr_filter_remove(addr_t addr)
+{
+	filter_counter(addr).fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool addr_filter_test(addr_t addr)
+{
+	return filter_counter(addr).load(std::memory_order_relaxed) != 0;
+}
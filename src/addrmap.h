@@ -0,0 +1,101 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_ADDRMAP_H
+#define HEAPTRACE_ADDRMAP_H
+
+#include <cstddef>
+
+#include "stacktrace.h"
+
+// addrmap_t is a flat open-addressing hash table from an allocated address to
+// its object_info_t.  It uses linear probing with backward shift deletion so
+// it never leaves tombstones behind, and it grows incrementally: a resize
+// allocates a twice bigger table and then each following insert/erase moves
+// a few entries from the old table so that no single hook pays for rehashing
+// the whole table.  The tables are allocated with mmap() directly so that
+// tracing an allocation never allocates from the heap on its own.
+//
+// It is not thread safe and must be protected by its user.
+class addrmap_t {
+public:
+	constexpr addrmap_t()
+		: cur{}
+		, old{}
+		, migrate_pos(0)
+	{
+	}
+
+	object_info_t *find(addr_t addr);
+
+	// Returns the object_info_t for the addr, either the existing one or a
+	// newly added zero-filled one.  Returns nullptr if it runs out of memory.
+	// The returned pointer is valid only until the next insert() or erase().
+	object_info_t *insert(addr_t addr);
+
+	// Removes the addr and copies its object_info_t into info if given.
+	bool erase(addr_t addr, object_info_t *info = nullptr);
+
+	void clear(void);
+
+	size_t size(void) const
+	{
+		return cur.count + old.count;
+	}
+
+	bool empty(void) const
+	{
+		return size() == 0;
+	}
+
+	// Calls func(addr, info) for each object in no particular order.
+	template <typename Func>
+	void for_each(Func func) const
+	{
+		for (const table_t *table : { &cur, &old }) {
+			for (size_t i = 0; table->entries && i <= table->mask; i++) {
+				const entry_t &entry = table->entries[i];
+
+				if (entry.addr)
+					func(entry.addr, entry.info);
+			}
+		}
+	}
+
+private:
+	struct entry_t {
+		addr_t addr;
+		object_info_t info;
+	};
+
+	struct table_t {
+		entry_t *entries;
+		size_t mask;
+		size_t count;
+	};
+
+	static bool table_alloc(table_t &table, size_t nr_entries);
+	static void table_free(table_t &table);
+	static entry_t *table_find(const table_t &table, addr_t addr);
+	static entry_t *table_insert(table_t &table, addr_t addr);
+	static void table_remove(table_t &table, entry_t *entry);
+
+	bool grow(void);
+	void migrate(size_t nr_steps);
+
+	table_t cur;
+	// the previous table while a resize is in progress
+	table_t old;
+	size_t migrate_pos;
+};
+
+// A counting filter of the addresses in the addrmaps.  If addr_filter_test()
+// returns false then the address was never recorded and it doesn't have to be
+// looked up.  It might return true for an address not recorded.  This is used
+// when most of the freed addresses are not tracked, i.e. in sampling mode or
+// after attaching to a running process.
+bool addr_filter_init(void);
+void addr_filter_add(addr_t addr);
+void addr_filter_remove(addr_t addr);
+bool addr_filter_test(addr_t addr);
+
+#endif /* HEAPTRACE_ADDRMAP_H */
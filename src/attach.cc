@@ -0,0 +1,223 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <cstring>
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "attach.h"
+#include "heaptrace.h"
+
+#if defined(__x86_64__)
+#define R_JUMP_SLOT R_X86_64_JUMP_SLOT
+#define R_GLOB_DAT R_X86_64_GLOB_DAT
+#elif defined(__i386__)
+#define R_JUMP_SLOT R_386_JMP_SLOT
+#define R_GLOB_DAT R_386_GLOB_DAT
+#elif defined(__aarch64__)
+#define R_JUMP_SLOT R_AARCH64_JUMP_SLOT
+#define R_GLOB_DAT R_AARCH64_GLOB_DAT
+#elif defined(__arm__)
+#define R_JUMP_SLOT R_ARM_JUMP_SLOT
+#define R_GLOB_DAT R_ARM_GLOB_DAT
+#endif
+
+#if __WORDSIZE == 64
+#define REL_TYPE(info) ELF64_R_TYPE(info)
+#define REL_SYM(info) ELF64_R_SYM(info)
+#else
+#define REL_TYPE(info) ELF32_R_TYPE(info)
+#define REL_SYM(info) ELF32_R_SYM(info)
+#endif
+
+static const char *const hook_names[] = {
+	"malloc", "free",   "calloc", "realloc", "memalign", "posix_memalign", "aligned_alloc",
+	"pvalloc", "valloc", "reallocarray", "mmap", "mmap64", "munmap", "mremap",
+};
+
+#define NR_HOOKS (sizeof(hook_names) / sizeof(hook_names[0]))
+
+struct hook_table_t {
+	void *funcs[NR_HOOKS];
+	uintptr_t page_size;
+	size_t nr_patched;
+};
+
+// an object being patched
+struct patch_object_t {
+	ElfW(Addr) base;
+	const ElfW(Sym) *symtab;
+	const char *strtab;
+	// the GOT is read-only after relocation in this range with RELRO.
+	uintptr_t relro_start;
+	uintptr_t relro_end;
+};
+
+static bool is_self(struct dl_phdr_info *info)
+{
+	auto self = (uintptr_t)attach_hooks;
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+		if (phdr->p_type == PT_LOAD && start <= self && self < start + phdr->p_memsz)
+			return true;
+	}
+	return false;
+}
+
+static void patch_slot(const patch_object_t &obj, hook_table_t *table, uintptr_t slot,
+		       void *func)
+{
+	uintptr_t page = slot & ~(table->page_size - 1);
+	bool relro = obj.relro_start <= slot && slot < obj.relro_end;
+
+	if (*(void **)slot == func)
+		return;
+
+	if (relro && mprotect((void *)page, table->page_size, PROT_READ | PROT_WRITE) < 0)
+		return;
+
+	// other threads might call it at the same time, but a pointer store is atomic.
+	__atomic_store_n((void **)slot, func, __ATOMIC_RELEASE);
+	table->nr_patched++;
+
+	if (relro)
+		mprotect((void *)page, table->page_size, PROT_READ);
+}
+
+template <typename Rel>
+static void patch_relocs(const patch_object_t &obj, hook_table_t *table, const Rel *rels,
+			 size_t size)
+{
+	for (size_t i = 0; i < size / sizeof(Rel); i++) {
+		const Rel *rel = &rels[i];
+		unsigned long type = REL_TYPE(rel->r_info);
+
+		if (type != R_JUMP_SLOT && type != R_GLOB_DAT)
+			continue;
+
+		const char *name = obj.strtab + obj.symtab[REL_SYM(rel->r_info)].st_name;
+		for (size_t k = 0; k < NR_HOOKS; k++) {
+			if (table->funcs[k] && !strcmp(name, hook_names[k])) {
+				patch_slot(obj, table, obj.base + rel->r_offset, table->funcs[k]);
+				break;
+			}
+		}
+	}
+}
+
+static int patch_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	auto *table = static_cast<hook_table_t *>(data);
+	const ElfW(Dyn) *dyn = nullptr;
+	patch_object_t obj = {};
+
+	// the hooks themselves must call the allocator.
+	if (is_self(info))
+		return 0;
+
+	obj.base = info->dlpi_addr;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+
+		if (phdr->p_type == PT_DYNAMIC) {
+			dyn = (const ElfW(Dyn) *)(obj.base + phdr->p_vaddr);
+		}
+		else if (phdr->p_type == PT_GNU_RELRO) {
+			obj.relro_start = obj.base + phdr->p_vaddr;
+			obj.relro_end = obj.relro_start + phdr->p_memsz;
+		}
+	}
+	if (!dyn)
+		return 0;
+
+	ElfW(Addr) jmprel = 0, rela = 0, rel = 0;
+	size_t jmprel_size = 0, rela_size = 0, rel_size = 0;
+	ElfW(Sxword) pltrel = 0;
+
+	for (; dyn->d_tag != DT_NULL; dyn++) {
+		ElfW(Addr) ptr = dyn->d_un.d_ptr;
+
+		// the dynamic linker relocates them in place on most architectures.
+		if (ptr < obj.base)
+			ptr += obj.base;
+
+		switch (dyn->d_tag) {
+		case DT_SYMTAB:
+			obj.symtab = (const ElfW(Sym) *)ptr;
+			break;
+		case DT_STRTAB:
+			obj.strtab = (const char *)ptr;
+			break;
+		case DT_JMPREL:
+			jmprel = ptr;
+			break;
+		case DT_PLTRELSZ:
+			jmprel_size = dyn->d_un.d_val;
+			break;
+		case DT_PLTREL:
+			pltrel = dyn->d_un.d_val;
+			break;
+		case DT_RELA:
+			rela = ptr;
+			break;
+		case DT_RELASZ:
+			rela_size = dyn->d_un.d_val;
+			break;
+		case DT_REL:
+			rel = ptr;
+			break;
+		case DT_RELSZ:
+			rel_size = dyn->d_un.d_val;
+			break;
+		}
+	}
+	if (!obj.symtab || !obj.strtab)
+		return 0;
+
+	if (jmprel && pltrel == DT_RELA)
+		patch_relocs(obj, table, (const ElfW(Rela) *)jmprel, jmprel_size);
+	else if (jmprel)
+		patch_relocs(obj, table, (const ElfW(Rel) *)jmprel, jmprel_size);
+	if (rela)
+		patch_relocs(obj, table, (const ElfW(Rela) *)rela, rela_size);
+	if (rel)
+		patch_relocs(obj, table, (const ElfW(Rel) *)rel, rel_size);
+
+	return 0;
+}
+
+bool attach_hooks(void)
+{
+#ifdef R_JUMP_SLOT
+	hook_table_t table = {};
+	Dl_info dlip;
+
+	// lookup in our own handle finds the hooks rather than the allocator.
+	if (!dladdr((void *)attach_hooks, &dlip))
+		return false;
+
+	void *self = dlopen(dlip.dli_fname, RTLD_NOW | RTLD_NOLOAD);
+	if (!self)
+		return false;
+
+	for (size_t i = 0; i < NR_HOOKS; i++)
+		table.funcs[i] = dlsym(self, hook_names[i]);
+	dlclose(self);
+
+	table.page_size = sysconf(_SC_PAGESIZE);
+	dl_iterate_phdr(patch_object, &table);
+
+	pr_dbg("patched %zd GOT entries\n", table.nr_patched);
+	return table.nr_patched > 0;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,13 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_ATTACH_H
+#define HEAPTRACE_ATTACH_H
+
+// When libheaptrace.so is loaded into a running process by 'heaptrace --pid',
+// the objects already loaded have their allocation function symbols bound to
+// the allocator, so the hooks are never called.  This rewrites their GOT
+// entries of those functions to the hooks instead.  The objects loaded later
+// by dlopen() are not hooked.
+bool attach_hooks(void);
+
+#endif /* HEAPTRACE_ATTACH_H */
@@ -16,5 +16,6 @@
 #define __used __attribute__((used))
 #define __noreturn __attribute__((noreturn))
 #define __align(n) __attribute__((aligned(n)))
+#define __noinline __attribute__((noinline))
 
 #endif /* HEAPTRACE_COMPILER_H */
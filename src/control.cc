@@ -0,0 +1,405 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "control.h"
+#include "heaptrace.h"
+#include "stacktrace.h"
+#include "utils.h"
+
+#define NSEC_PER_SEC (1000 * 1000 * 1000LL)
+
+// max length of a request line
+#define CONTROL_REQUEST_MAX 4096
+
+// a client that doesn't read or write in time is dropped.
+#define CONTROL_TIMEOUT_SEC 5
+
+static int control_fd = -1;
+static std::atomic<unsigned int> control_requests;
+
+// listening socket for 'heaptrace ctl' and the pid that created it
+static int control_sock = -1;
+static long control_sock_pid;
+
+// held while the control thread handles requests
+static std::mutex control_lock;
+static bool control_stopped;
+
+std::atomic<bool> control_forked;
+
+static uint64_t timespec_ns(const struct timespec &ts)
+{
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(ts);
+}
+
+static void handle_requests(unsigned int requests, bool periodic)
+{
+	std::lock_guard<std::mutex> lock(control_lock);
+
+	if (control_stopped)
+		return;
+
+	if (requests & CONTROL_DUMP_SIZE)
+		dump_stackmap("size", opts.flamegraph);
+	if (requests & CONTROL_DUMP_COUNT)
+		dump_stackmap("count", opts.flamegraph);
+	if (requests & CONTROL_CLEAR)
+		clear_stackmap();
+
+	if (!periodic)
+		return;
+
+	if (opts.raw || opts.snapshot)
+		dump_stackmap(opts.sort_keys);
+	else
+		dump_stackmap_delta(opts.sort_keys, opts.flamegraph);
+}
+
+static std::string control_socket_path(long pid)
+{
+	return utils::asprintf(CONTROL_SOCKET_PATH, pid);
+}
+
+static int open_control_socket(void)
+{
+	struct sockaddr_un addr = {};
+	long pid = getpid();
+	std::string path = control_socket_path(pid);
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	// it might be left by a previous process with the same pid.
+	unlink(addr.sun_path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	control_sock_pid = pid;
+	return fd;
+}
+
+static void unlink_control_socket(void)
+{
+	// the child shouldn't remove the socket of its parent.
+	if (control_sock >= 0 && control_sock_pid == getpid())
+		unlink(control_socket_path(control_sock_pid).c_str());
+}
+
+static bool read_request(int conn, std::string &line)
+{
+	char buf[256];
+
+	while (line.size() < CONTROL_REQUEST_MAX) {
+		ssize_t len = read(conn, buf, sizeof(buf));
+		if (len <= 0)
+			return false;
+
+		line.append(buf, len);
+
+		size_t pos = line.find('\n');
+		if (pos != std::string::npos) {
+			line.resize(pos);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Runs a request of 'heaptrace ctl' with the output sent to the client.
+// The caller should hold control_lock.
+static void run_request(const std::string &line, FILE *fp)
+{
+	std::vector<std::string> words = utils::string_split(line, '\t');
+	std::string sort_keys = opts.sort_keys;
+	std::string filter;
+	bool flamegraph = opts.flamegraph;
+	FILE *saved_outfp = outfp;
+	int saved_top = opts.top;
+	char *saved_filter = opts.filter;
+
+	if (words.empty()) {
+		fprintf(fp, "[heaptrace] empty request\n");
+		return;
+	}
+
+	outfp = fp;
+	for (size_t i = 1; i < words.size(); i++) {
+		const std::string &word = words[i];
+		size_t pos = word.find('=');
+		std::string key = word.substr(0, pos);
+		std::string val = pos == std::string::npos ? "" : word.substr(pos + 1);
+
+		if (key == "top")
+			opts.top = std::strtol(val.c_str(), nullptr, 0);
+		else if (key == "sort")
+			sort_keys = val;
+		else if (key == "flamegraph")
+			flamegraph = val == "1";
+		else if (key == "filter")
+			filter = val;
+		else
+			pr_out("[heaptrace] unknown argument: %s\n", word.c_str());
+	}
+	if (!filter.empty())
+		opts.filter = &filter[0];
+
+	const std::string &cmd = words[0];
+	if (cmd == "dump")
+		dump_stackmap(sort_keys.c_str(), flamegraph);
+	else if (cmd == "stats")
+		dump_stackmap_summary();
+	else if (cmd == "leaks")
+		dump_leaks();
+	else if (cmd == "clear") {
+		clear_stackmap();
+		pr_out("[heaptrace] cleared\n");
+	}
+	else
+		pr_out("[heaptrace] unknown command: %s\n", cmd.c_str());
+
+	fflush(fp);
+	outfp = saved_outfp;
+	opts.top = saved_top;
+	opts.filter = saved_filter;
+}
+
+static void handle_client(void)
+{
+	struct timeval tv = { CONTROL_TIMEOUT_SEC, 0 };
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	std::string line;
+
+	int conn = accept4(control_sock, nullptr, nullptr, SOCK_CLOEXEC);
+	if (conn < 0)
+		return;
+
+	// only the same user (or root) can control it.
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	    (cred.uid != geteuid() && cred.uid != 0)) {
+		close(conn);
+		return;
+	}
+
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	FILE *fp;
+	if (!read_request(conn, line) || !(fp = fdopen(conn, "w"))) {
+		close(conn);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(control_lock);
+
+		if (!control_stopped)
+			run_request(line, fp);
+	}
+	fclose(fp);
+}
+
+static void *control_worker(void *arg)
+{
+	auto *tfs = &thread_flags;
+	auto period = (uint64_t)(opts.interval * NSEC_PER_SEC);
+	uint64_t next = monotonic_ns() + period;
+	struct pollfd pfds[2] = {
+		{ control_fd, POLLIN, 0 },
+		{ control_sock, POLLIN, 0 },
+	};
+	sigset_t sigset;
+
+	// the worker never records its own allocations.
+	tfs->hook_guard = true;
+
+	// let the program threads handle the signals.
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+	while (true) {
+		struct timespec timeout;
+		struct timespec *ptimeout = nullptr;
+		bool periodic = false;
+		uint64_t count;
+
+		if (period) {
+			// wait until absolute deadlines not to drift by the dump time.
+			uint64_t now = monotonic_ns();
+			uint64_t left = next > now ? next - now : 0;
+
+			timeout.tv_sec = left / NSEC_PER_SEC;
+			timeout.tv_nsec = left % NSEC_PER_SEC;
+			ptimeout = &timeout;
+		}
+
+		// a negative fd is ignored if the socket is not available.
+		if (ppoll(pfds, 2, ptimeout, nullptr) > 0) {
+			// reset the counter, the requests are in control_requests.
+			if ((pfds[0].revents & POLLIN) && read(control_fd, &count, sizeof(count)) < 0)
+				pr_dbg("failed to read the control eventfd\n");
+			if (pfds[1].revents & POLLIN)
+				handle_client();
+		}
+
+		if (period && monotonic_ns() >= next) {
+			next += period;
+			periodic = true;
+		}
+
+		handle_requests(control_requests.exchange(0), periodic);
+	}
+	return nullptr;
+}
+
+static bool control_start_worker(void)
+{
+	pthread_t worker;
+
+	if (pthread_create(&worker, nullptr, control_worker, nullptr) != 0)
+		return false;
+
+	pthread_setname_np(worker, "heaptrace-ctl");
+	pthread_detach(worker);
+	return true;
+}
+
+static void control_atfork_prepare(void)
+{
+	control_lock.lock();
+}
+
+static void control_atfork_parent(void)
+{
+	control_lock.unlock();
+}
+
+static void control_atfork_child(void)
+{
+	control_lock.unlock();
+
+	// Don't share the counter and the socket with the parent.  The new ones
+	// and the worker are created by control_start_child() later, as it's
+	// not safe here and the child might just exec.
+	if (control_fd >= 0)
+		close(control_fd);
+	control_fd = -1;
+	control_requests.store(0);
+
+	if (control_sock >= 0)
+		close(control_sock);
+	control_sock = -1;
+
+	control_forked.store(true);
+}
+
+void control_start_child(void)
+{
+	uint64_t one = 1;
+
+	if (!control_forked.exchange(false))
+		return;
+
+	control_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (control_fd < 0)
+		return;
+
+	control_sock = open_control_socket();
+	if (control_sock < 0)
+		pr_dbg("failed to open the control socket\n");
+
+	// handle the requests from the signals until now.
+	if (control_requests.load() && write(control_fd, &one, sizeof(one)) < 0)
+		pr_dbg("failed to write the control eventfd\n");
+
+	control_start_worker();
+}
+
+bool control_init(void)
+{
+	control_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (control_fd < 0)
+		return false;
+
+	// it still works with the signals without the socket.
+	control_sock = open_control_socket();
+	if (control_sock < 0)
+		pr_dbg("failed to open the control socket\n");
+
+	pthread_atfork(control_atfork_prepare, control_atfork_parent, control_atfork_child);
+
+	return control_start_worker();
+}
+
+void control_request(unsigned int requests)
+{
+	int saved_errno = errno;
+	uint64_t one = 1;
+
+	control_requests.fetch_or(requests);
+
+	// it fails only if the counter is full, then the worker is awake anyway.
+	ssize_t ret = write(control_fd, &one, sizeof(one));
+	(void)ret;
+
+	errno = saved_errno;
+}
+
+void control_stop(void)
+{
+	std::lock_guard<std::mutex> lock(control_lock);
+
+	control_stopped = true;
+
+	// the worker might be polling it, so just remove the name.
+	unlink_control_socket();
+}
+
+bool control_output_lock(void)
+{
+	control_lock.lock();
+
+	if (control_stopped) {
+		control_lock.unlock();
+		return false;
+	}
+	return true;
+}
+
+void control_output_unlock(void)
+{
+	control_lock.unlock();
+}
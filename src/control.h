@@ -0,0 +1,52 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_CONTROL_H
+#define HEAPTRACE_CONTROL_H
+
+#include <atomic>
+
+#include "compiler.h"
+
+// The dumps and the clear are done by a control thread instead of the
+// signal handlers, which only set the request bits and wake it up through
+// an eventfd.  It also takes the periodic dumps every opts.interval seconds
+// and serves the requests of 'heaptrace ctl'.  With --raw or --snapshot the
+// periodic dumps are full dumps for 'heaptrace report'.
+
+// 'heaptrace ctl' talks to the control thread through this Unix socket.  A
+// request is a line of tab separated words, the command followed by its
+// key=value arguments, and the output is sent back until it's closed.
+#define CONTROL_SOCKET_PATH "/tmp/heaptrace.%ld.ctl"
+
+#define CONTROL_DUMP_SIZE (1U << 0)
+#define CONTROL_DUMP_COUNT (1U << 1)
+#define CONTROL_CLEAR (1U << 2)
+
+bool control_init(void);
+
+// A forked child starts its control thread and socket on the first
+// allocation rather than in the fork handler, so that the children that just
+// exec don't leave the sockets.
+extern std::atomic<bool> control_forked;
+void control_start_child(void);
+
+static inline void control_check_fork(void)
+{
+	if (unlikely(control_forked.load(std::memory_order_relaxed)))
+		control_start_child();
+}
+
+// This is async-signal-safe.
+void control_request(unsigned int requests);
+
+// Waits for the running request and ignores the later ones, so that the
+// final dump can be done safely at exit.  It also removes the socket.
+void control_stop(void);
+
+// Lets another thread print to outfp between the requests, as outfp is the
+// connection of 'heaptrace ctl' during one.  It returns false after
+// control_stop().
+bool control_output_lock(void);
+void control_output_unlock(void);
+
+#endif /* HEAPTRACE_CONTROL_H */
@@ -0,0 +1,93 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "control.h"
+#include "heaptrace.h"
+#include "utils.h"
+
+static bool write_all(int fd, const std::string &str)
+{
+	size_t done = 0;
+
+	while (done < str.size()) {
+		ssize_t len = write(fd, str.data() + done, str.size() - done);
+		if (len < 0)
+			return false;
+		done += len;
+	}
+	return true;
+}
+
+int command_ctl(struct opts *opts, const char *cmd)
+{
+	struct sockaddr_un addr = {};
+	long pid = std::strtol(opts->exename, nullptr, 10);
+	std::string path = utils::asprintf(CONTROL_SOCKET_PATH, pid);
+	std::string request = cmd;
+	char buf[4096];
+	ssize_t len;
+
+	if (pid <= 0 || path.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "heaptrace: invalid pid: %s\n", opts->exename);
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("heaptrace: socket");
+		return -1;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "heaptrace: cannot connect to %s: %s\n", path.c_str(),
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// the process uses its own options for what's not given.
+	if (opts->top)
+		request += utils::asprintf("\ttop=%d", opts->top);
+	if (opts->flamegraph)
+		request += "\tflamegraph=1";
+	if (opts->sort_keys)
+		request += utils::asprintf("\tsort=%s", opts->sort_keys);
+	if (opts->filter)
+		request += utils::asprintf("\tfilter=%s", opts->filter);
+	request += "\n";
+
+	if (!write_all(fd, request)) {
+		perror("heaptrace: write");
+		close(fd);
+		return -1;
+	}
+	shutdown(fd, SHUT_WR);
+
+	if (opts->outfile) {
+		outfp = fopen(opts->outfile, "w");
+		if (!outfp) {
+			perror(opts->outfile);
+			close(fd);
+			return -1;
+		}
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, len, outfp);
+
+	if (opts->outfile)
+		fclose(outfp);
+	close(fd);
+	return len < 0 ? -1 : 0;
+}
@@ -0,0 +1,829 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "dump.h"
+#include "heaptrace.h"
+#include "ignore.h"
+#include "outbuf.h"
+#include "utils.h"
+
+static bool contains(const char *text, size_t len, const char *str, size_t str_len)
+{
+	return memmem(text, len, str, str_len) != nullptr;
+}
+
+// checks the text of a backtrace in the output buffer.
+static bool is_ignored(const char *text, size_t len)
+{
+	// show only the backtraces with the filter string if given.
+	if (opts.filter && !contains(text, len, opts.filter, strlen(opts.filter)))
+		return true;
+
+	return match_ignore_rules(text, len);
+}
+
+static void print_backtrace(outbuf_t &ob, int count, void *addr, symbolizer_t symbolize)
+{
+	const symbol_t &sym = symbolize(addr);
+
+	ob.printf("%d [0x%0*lx] ", count, 4 + __SIZEOF_LONG__, (unsigned long)addr);
+	if (!sym.found) {
+		ob.printf("?\n");
+		return;
+	}
+
+	if (!sym.name.empty())
+		ob.printf("%s +0x%x ", sym.name.c_str(), sym.offset);
+	ob.printf("(%s +0x%x)\n", sym.fname.c_str(), sym.file_offset);
+}
+
+static void print_backtrace_flamegraph(outbuf_t &ob, void *addr, const char *semicolon,
+				       symbolizer_t symbolize)
+{
+	const symbol_t &sym = symbolize(addr);
+
+	if (!sym.name.empty())
+		ob.printf("%s%s+0x%x", semicolon, sym.name.c_str(), sym.offset);
+	else if (sym.found)
+		ob.printf("%s%s0x%lx", semicolon, sym.fname.c_str(), (unsigned long)addr);
+	else
+		ob.printf("%s?0x%lx", semicolon, (unsigned long)addr);
+}
+
+void init_dump_stacks(dump_stacks_t &stacks, stack_reader_t read, const void *arg)
+{
+	stacks.keys.clear();
+	stacks.read = read;
+	stacks.arg = arg;
+	stacks.nr_live = 0;
+	stacks.total_size = 0;
+	stacks.waste = 0;
+	memset(stacks.size_class, 0, sizeof(stacks.size_class));
+	stacks.nr_allocs = 0;
+	stacks.nr_frees = 0;
+	stacks.churn = 0;
+}
+
+void add_dump_stack(dump_stacks_t &stacks, uint32_t id, const stack_info_t &info, bool key)
+{
+	stacks.total_size += info.total_size;
+	stacks.waste += info.waste;
+	for (int i = 0; i < NR_SIZE_CLASSES; i++)
+		stacks.size_class[i] += info.size_class[i];
+	stacks.nr_allocs += info.nr_allocs;
+	stacks.nr_frees += info.nr_frees;
+	stacks.churn += info.free_bytes;
+	// the stacks without live objects are given for the cumulative sort keys.
+	stacks.nr_live += info.count != 0;
+
+	if (key) {
+		stacks.keys.push_back({ id, info.total_size, info.count, info.nr_allocs,
+					info.alloc_bytes, info.nr_frees, info.free_bytes });
+	}
+}
+
+static bool read_vector_stack(uint32_t id, const void *arg, dump_stack_t &stack)
+{
+	const auto *vec = static_cast<const std::vector<dump_stack_t> *>(arg);
+
+	stack = (*vec)[id];
+	return true;
+}
+
+void make_dump_stacks(const std::vector<dump_stack_t> &vec, dump_stacks_t &stacks)
+{
+	init_dump_stacks(stacks, read_vector_stack, &vec);
+
+	stacks.keys.reserve(vec.size());
+	for (size_t i = 0; i < vec.size(); i++)
+		add_dump_stack(stacks, i, vec[i].second);
+}
+
+static const char *lifetime_labels[NR_LIFETIME_BUCKETS] = {
+	"<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", "<100s", ">=100s",
+};
+
+static const char *format_size_class_limit(char *buf, uint64_t limit)
+{
+	if (limit >= 1024)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRIu64 "KB", limit / 1024);
+	else
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRIu64, limit);
+	return buf;
+}
+
+// prints the non-empty buckets of the lifetime histogram.
+static void print_lifetime(outbuf_t &ob, const uint64_t *lifetime)
+{
+	const char *sep = "";
+
+	for (int i = 0; i < NR_LIFETIME_BUCKETS; i++) {
+		if (lifetime[i] == 0)
+			continue;
+		ob.printf("%s%s %" PRIu64, sep, lifetime_labels[i], lifetime[i]);
+		sep = " | ";
+	}
+}
+
+// prints the non-empty size classes like "<=32 120 | >256KB 1".
+static void print_size_class(outbuf_t &ob, const uint64_t *size_class)
+{
+	const char *sep = "";
+	uint64_t limit = MIN_SIZE_CLASS;
+	char buf[UNIT_BUF_SIZE];
+
+	for (int i = 0; i < NR_SIZE_CLASSES; i++, limit *= 2) {
+		if (size_class[i] == 0)
+			continue;
+		if (i == NR_SIZE_CLASSES - 1)
+			ob.printf("%s>%s", sep, format_size_class_limit(buf, limit / 2));
+		else
+			ob.printf("%s<=%s", sep, format_size_class_limit(buf, limit));
+		ob.printf(" %" PRIu64, size_class[i]);
+		sep = " | ";
+	}
+}
+
+static bool has_any(const uint64_t *values, int n)
+{
+	return std::any_of(values, values + n, [](uint64_t v) { return v != 0; });
+}
+
+// number of allocations per second since the start of tracing
+static uint64_t get_alloc_rate(const stack_info_t &info, const dump_info_t &dinfo)
+{
+	using std::chrono::microseconds;
+	auto elapsed = std::chrono::duration_cast<microseconds>(dinfo.time - dinfo.start);
+
+	if (elapsed.count() <= 0)
+		return 0;
+	return info.nr_allocs * 1000000.0 / elapsed.count();
+}
+
+// prints the churn, lifetime and size class lines of a backtrace if any.
+static void print_stack_details(outbuf_t &ob, const stack_info_t &info, const dump_info_t &dinfo)
+{
+	char buf[UNIT_BUF_SIZE];
+
+	if (info.nr_frees)
+		ob.printf("[allocs/frees: %" PRIu64 "/%" PRIu64 "] [churn: %s] [rate: %" PRIu64
+			  "/s]\n",
+			  info.nr_allocs, info.nr_frees, format_byte_unit(buf, info.free_bytes),
+			  get_alloc_rate(info, dinfo));
+
+	if (has_any(info.lifetime, NR_LIFETIME_BUCKETS)) {
+		ob.printf("[lifetime: ");
+		print_lifetime(ob, info.lifetime);
+		ob.printf("]\n");
+	}
+	if (has_any(info.size_class, NR_SIZE_CLASSES)) {
+		ob.printf("[size class: ");
+		print_size_class(ob, info.size_class);
+		ob.printf("] [waste: %s]\n", format_byte_unit(buf, info.waste));
+	}
+}
+
+static void print_dump_stackmap_header(outbuf_t &ob, const char *sort_key, const dump_info_t &info)
+{
+	ob.printf("[heaptrace] dump allocation sorted by '%s' for /proc/%ld/maps (%s)\n", sort_key,
+		  info.pid, info.comm.c_str());
+}
+
+static void print_dump_mmap_header(outbuf_t &ob, const char *sort_key, const dump_info_t &info)
+{
+	ob.printf("[heaptrace] dump mmap sorted by '%s' for /proc/%ld/maps (%s)\n", sort_key,
+		  info.pid, info.comm.c_str());
+}
+
+static void print_dump_mmap_footer(outbuf_t &ob, const mmap_dump_t &mmaps)
+{
+	uint64_t total_size = 0;
+	char buf[UNIT_BUF_SIZE];
+	char prot[MMAP_STRING_SIZE];
+	char flags[MMAP_STRING_SIZE];
+
+	for (const auto &mc : mmaps.classes)
+		total_size += mc.size;
+
+	ob.printf("[heaptrace] mmap traced num of backtrace : %zd\n", mmaps.stacks.size());
+	ob.printf("[heaptrace] mmap traced mapping size     : %s\n",
+		  format_byte_unit(buf, total_size));
+
+	for (const auto &mc : mmaps.classes) {
+		ob.printf("[heaptrace]   %s %s : %" PRIu64 " maps, %s\n",
+			  utils::format_mmap_prot(prot, mc.prot),
+			  utils::format_mmap_flags(flags, mc.flags), mc.count,
+			  format_byte_unit(buf, mc.size));
+	}
+}
+
+static void print_dump_threads(outbuf_t &ob, const dump_info_t &info)
+{
+	std::vector<thread_dump_t> threads = info.threads;
+
+	std::sort(threads.begin(), threads.end(),
+		  [](const thread_dump_t &t1, const thread_dump_t &t2) {
+			  if (t1.total_size == t2.total_size)
+				  return t1.nr_allocs > t2.nr_allocs;
+			  return t1.total_size > t2.total_size;
+		  });
+
+	ob.printf("[heaptrace] dump threads sorted by 'size' for /proc/%ld/maps (%s)\n", info.pid,
+		  info.comm.c_str());
+	for (size_t i = 0; i < threads.size() && i < opts.top; i++) {
+		const thread_dump_t &td = threads[i];
+		char size[UNIT_BUF_SIZE];
+
+		ob.printf("=== thread %u (%s)%s === [count: %" PRIu64 "] [size: %s] "
+			  "[allocs/frees: %" PRIu64 "/%" PRIu64 "] "
+			  "[freed by others: %" PRIu64 "] [freed of others: %" PRIu64 "]\n",
+			  td.tid, td.comm.c_str(), td.exited ? " exited" : "", td.count,
+			  format_byte_unit(size, td.total_size), td.nr_allocs, td.nr_frees,
+			  td.remote_frees, td.foreign_frees);
+	}
+	ob.printf("\n");
+}
+
+static void print_dump_threads_footer(outbuf_t &ob, const dump_info_t &info)
+{
+	uint64_t nr_frees = 0;
+	uint64_t remote_frees = 0;
+
+	for (const auto &td : info.threads) {
+		nr_frees += td.nr_frees;
+		remote_frees += td.remote_frees;
+	}
+
+	ob.printf("[heaptrace] thread traced num of threads : %zd\n", info.threads.size());
+	if (nr_frees)
+		ob.printf("[heaptrace] thread cross-thread frees    : %" PRIu64 " / %" PRIu64
+			  " (%.1f%%)\n",
+			  remote_frees, nr_frees, remote_frees * 100.0 / nr_frees);
+}
+
+static void print_dump_stackmap_footer(outbuf_t &ob, const dump_stacks_t &stacks,
+				       const dump_info_t &info)
+{
+	char buf[3][UNIT_BUF_SIZE];
+
+	ob.printf("[heaptrace] heap traced num of backtrace : %zd\n", stacks.nr_live);
+
+	ob.printf("[heaptrace] heap traced allocation size  : %s\n",
+		  format_byte_unit(buf[0], stacks.total_size));
+
+	if (has_any(stacks.size_class, NR_SIZE_CLASSES)) {
+		ob.printf("[heaptrace] heap traced size classes     : ");
+		print_size_class(ob, stacks.size_class);
+		ob.printf("\n");
+	}
+
+	if (stacks.nr_frees)
+		ob.printf("[heaptrace] heap allocs/frees (churn)    : %" PRIu64 " / %" PRIu64
+			  " (%s)\n",
+			  stacks.nr_allocs, stacks.nr_frees, format_byte_unit(buf[0], stacks.churn));
+
+	if (has_any(info.lifetime, NR_LIFETIME_BUCKETS)) {
+		ob.printf("[heaptrace] heap freed object lifetime   : ");
+		print_lifetime(ob, info.lifetime);
+		ob.printf("\n");
+	}
+
+	ob.printf("[heaptrace] allocator info (virtual)     : %s\n",
+		  format_byte_unit(buf[0], info.alloc_virtual));
+	ob.printf("[heaptrace] allocator info (resident)    : %s\n",
+		  format_byte_unit(buf[0], info.alloc_resident));
+	if (stacks.waste)
+		ob.printf("[heaptrace] allocator info (waste)       : %s\n",
+			  format_byte_unit(buf[0], stacks.waste));
+
+	ob.printf("[heaptrace] statm info (VSS/RSS/shared)  : %s / %s / %s\n",
+		  format_byte_unit(buf[0], info.statm_vss), format_byte_unit(buf[1], info.statm_rss),
+		  format_byte_unit(buf[2], info.statm_shared));
+
+	if (info.async)
+		ob.printf("[heaptrace] async event buffer overflow  : %" PRIu64 "\n",
+			  info.nr_overflows);
+	if (info.sample_rate)
+		ob.printf("[heaptrace] allocation sampling rate     : %s\n",
+			  format_byte_unit(buf[0], info.sample_rate));
+}
+
+// returns true if s1 comes before s2 in the order of a sort key.
+typedef bool (*stack_order_t)(const dump_key_t &s1, const dump_key_t &s2);
+
+static bool order_by_size(const dump_key_t &s1, const dump_key_t &s2)
+{
+	if (s1.total_size == s2.total_size)
+		return s1.count > s2.count;
+	return s1.total_size > s2.total_size;
+}
+
+static bool order_by_count(const dump_key_t &s1, const dump_key_t &s2)
+{
+	if (s1.count == s2.count)
+		return s1.total_size > s2.total_size;
+	return s1.count > s2.count;
+}
+
+static bool order_by_alloc_rate(const dump_key_t &s1, const dump_key_t &s2)
+{
+	// the same period for all stacks, so sort by the number.
+	if (s1.nr_allocs == s2.nr_allocs)
+		return s1.alloc_bytes > s2.alloc_bytes;
+	return s1.nr_allocs > s2.nr_allocs;
+}
+
+static bool order_by_churn(const dump_key_t &s1, const dump_key_t &s2)
+{
+	if (s1.free_bytes == s2.free_bytes)
+		return s1.nr_frees > s2.nr_frees;
+	return s1.free_bytes > s2.free_bytes;
+}
+
+static stack_order_t get_stack_order(const std::string &key)
+{
+	if (key == "alloc-rate")
+		return order_by_alloc_rate;
+	if (key == "churn")
+		return order_by_churn;
+	if (key == "count")
+		return order_by_count;
+	// sort based on size for unknown sort order.
+	return order_by_size;
+}
+
+// Yields the indices of n items in the order of before() one by one.  The
+// indices are heapified in O(n) and each pop takes O(log n), so printing the
+// top k of n stacks takes O(n + k log n) instead of sorting all of them, and
+// the stacks skipped by the ignore rules just pop more.
+template <typename Before>
+class index_heap_t {
+public:
+	index_heap_t(size_t n, Before before)
+		: after{ before }
+		, idx(n)
+	{
+		for (size_t i = 0; i < n; i++)
+			idx[i] = i;
+		std::make_heap(idx.begin(), idx.end(), after);
+	}
+
+	bool empty(void) const
+	{
+		return idx.empty();
+	}
+
+	size_t pop(void)
+	{
+		std::pop_heap(idx.begin(), idx.end(), after);
+		size_t i = idx.back();
+		idx.pop_back();
+		return i;
+	}
+
+private:
+	// std::make_heap() keeps the greatest at the top, so reverse the order.
+	struct after_t {
+		Before before;
+		bool operator()(uint32_t a, uint32_t b) const
+		{
+			return before(b, a);
+		}
+	} after;
+	std::vector<uint32_t> idx;
+};
+
+struct stack_before_t {
+	const std::vector<dump_key_t> *keys;
+	stack_order_t order;
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return order((*keys)[a], (*keys)[b]);
+	}
+};
+
+using stack_heap_t = index_heap_t<stack_before_t>;
+
+static void print_dump_stackmap(outbuf_t &ob, const dump_stacks_t &stacks,
+				const std::string &order, const dump_info_t &dinfo,
+				symbolizer_t symbolize, bool live_only)
+{
+	stack_heap_t heap(stacks.keys.size(), { &stacks.keys, get_stack_order(order) });
+	dump_stack_t stack;
+	char size[UNIT_BUF_SIZE];
+	char peak[UNIT_BUF_SIZE];
+	char age[UNIT_BUF_SIZE];
+	int cnt = 1;
+	int top = opts.top;
+	int i = 0;
+
+	while (!heap.empty() && i < top) {
+		const dump_key_t &key = stacks.keys[heap.pop()];
+		const stack_info_t &info = stack.second;
+		const stack_trace_t &stack_trace = stack.first;
+
+		// they're sorted at the end, so the rest has nothing as well.
+		if (live_only && key.count == 0)
+			break;
+
+		if (!stacks.read(key.id, stacks.arg, stack)) {
+			++i;
+			++top;
+			continue;
+		}
+
+		ob.begin();
+		ob.printf("=== backtrace #%d === [count/peak: %zu/%zu] [size/peak: %s/%s] "
+			  "[age: %s]\n",
+			  cnt, info.count, info.peak_count, format_byte_unit(size, info.total_size),
+			  format_byte_unit(peak, info.peak_total_size),
+			  format_time_unit(age, (dinfo.time - info.birth_time).count()));
+		print_stack_details(ob, info, dinfo);
+
+		size_t bt = ob.pending_size();
+		for (int j = 0; j < info.stack_depth; j++)
+			print_backtrace(ob, j, stack_trace[j], symbolize);
+
+		if (is_ignored(ob.pending() + bt, ob.pending_size() - bt)) {
+			ob.rollback();
+			++top;
+		}
+		else {
+			ob.printf("\n");
+			ob.commit();
+			++cnt;
+		}
+		++i;
+	}
+}
+
+static void print_dump_stackmap_flamegraph(outbuf_t &ob, const dump_stacks_t &stacks,
+					   const std::string &order, symbolizer_t symbolize)
+{
+	stack_heap_t heap(stacks.keys.size(), { &stacks.keys, get_stack_order(order) });
+	dump_stack_t stack;
+	int i = 0;
+	int top = opts.top;
+
+	while (!heap.empty() && i < top) {
+		const dump_key_t &key = stacks.keys[heap.pop()];
+		const stack_info_t &info = stack.second;
+		const char *semicolon = "";
+		const stack_trace_t &stack_trace = stack.first;
+
+		// the flamegraph shows the live size only.
+		if (key.count == 0 || !stacks.read(key.id, stacks.arg, stack)) {
+			++i;
+			++top;
+			continue;
+		}
+		uint64_t size = info.total_size;
+
+		ob.begin();
+		for (size_t j = 0; j < info.stack_depth; ++j) {
+			print_backtrace_flamegraph(ob, stack_trace[info.stack_depth - 1 - j],
+						   semicolon, symbolize);
+			semicolon = ";";
+		}
+		if (is_ignored(ob.pending(), ob.pending_size())) {
+			ob.rollback();
+			++top;
+		}
+		else {
+			ob.printf(" %" PRIu64 "\n", size);
+			ob.commit();
+		}
+		++i;
+	}
+}
+
+static bool is_cumulative_sort_key(const std::string &key)
+{
+	return key == "alloc-rate" || key == "churn";
+}
+
+bool has_cumulative_sort_key(const char *sort_keys)
+{
+	std::vector<std::string> sort_key_vec = utils::string_split(sort_keys, ',');
+
+	return std::any_of(sort_key_vec.begin(), sort_key_vec.end(), is_cumulative_sort_key);
+}
+
+void print_dump(const dump_stacks_t &stacks, const char *sort_keys, bool flamegraph,
+		const dump_info_t &info, symbolizer_t symbolize, const mmap_dump_t *mmaps)
+{
+	std::vector<std::string> sort_key_vec = utils::string_split(sort_keys, ',');
+	outbuf_t ob(outfp);
+
+	if (sort_key_vec.empty())
+		sort_key_vec.push_back("size");
+
+	if (flamegraph) {
+		// use only the first sort order given by -s/--sort option.
+		print_dump_stackmap_flamegraph(ob, stacks, sort_key_vec.front(), symbolize);
+		return;
+	}
+
+	ob.printf("=================================================================\n");
+	for (const auto &sort_key : sort_key_vec) {
+		print_dump_stackmap_header(ob, sort_key.c_str(), info);
+		print_dump_stackmap(ob, stacks, sort_key, info, symbolize,
+				    !is_cumulative_sort_key(sort_key));
+	}
+	if (mmaps && !mmaps->stacks.empty()) {
+		dump_stacks_t mmap_stacks;
+
+		make_dump_stacks(mmaps->stacks, mmap_stacks);
+		for (const auto &sort_key : sort_key_vec) {
+			print_dump_mmap_header(ob, sort_key.c_str(), info);
+			print_dump_stackmap(ob, mmap_stacks, sort_key, info, symbolize, true);
+		}
+	}
+	// nothing interesting for a single thread
+	if (info.threads.size() > 1)
+		print_dump_threads(ob, info);
+	print_dump_stackmap_footer(ob, stacks, info);
+	if (mmaps && !mmaps->stacks.empty())
+		print_dump_mmap_footer(ob, *mmaps);
+	if (info.threads.size() > 1)
+		print_dump_threads_footer(ob, info);
+	ob.printf("=================================================================\n");
+}
+
+void print_dump_summary(const dump_stacks_t &stacks, const dump_info_t &info,
+			const mmap_dump_t *mmaps)
+{
+	outbuf_t ob(outfp);
+
+	ob.printf("=================================================================\n");
+	ob.printf("[heaptrace] dump summary for /proc/%ld/maps (%s)\n", info.pid, info.comm.c_str());
+	print_dump_stackmap_footer(ob, stacks, info);
+	if (mmaps && !mmaps->stacks.empty())
+		print_dump_mmap_footer(ob, *mmaps);
+	if (info.threads.size() > 1)
+		print_dump_threads_footer(ob, info);
+	ob.printf("=================================================================\n");
+}
+
+struct delta_before_t {
+	const std::vector<delta_stack_t> *stacks;
+	bool by_count;
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		const delta_stack_t &d1 = (*stacks)[a];
+		const delta_stack_t &d2 = (*stacks)[b];
+
+		if (by_count) {
+			if (d1.count_delta == d2.count_delta)
+				return d1.size_delta > d2.size_delta;
+			return d1.count_delta > d2.count_delta;
+		}
+		if (d1.size_delta == d2.size_delta)
+			return d1.count_delta > d2.count_delta;
+		return d1.size_delta > d2.size_delta;
+	}
+};
+
+static void print_delta_stackmap(outbuf_t &ob, const std::vector<delta_stack_t> &stacks,
+				 stack_reader_t read, const void *arg,
+				 const delta_before_t &before, const dump_info_t &dinfo,
+				 symbolizer_t symbolize)
+{
+	index_heap_t<delta_before_t> heap(stacks.size(), before);
+	dump_stack_t stack;
+	const stack_info_t &info = stack.second;
+	char size[UNIT_BUF_SIZE];
+	char peak[UNIT_BUF_SIZE];
+	char delta_size[UNIT_BUF_SIZE];
+	char age[UNIT_BUF_SIZE];
+	int cnt = 1;
+	int top = opts.top;
+	int i = 0;
+
+	while (!heap.empty() && i < top) {
+		const delta_stack_t &delta = stacks[heap.pop()];
+
+		if (!read(delta.id, arg, stack)) {
+			++i;
+			++top;
+			continue;
+		}
+
+		ob.begin();
+		ob.printf("=== backtrace #%d === [count/peak: %zu/%zu (%+" PRId64 ")] "
+			  "[size/peak: %s/%s (%s)] [age: %s]\n",
+			  cnt, info.count, info.peak_count, delta.count_delta,
+			  format_byte_unit(size, info.total_size),
+			  format_byte_unit(peak, info.peak_total_size),
+			  format_delta_byte_unit(delta_size, delta.size_delta),
+			  format_time_unit(age, (dinfo.time - info.birth_time).count()));
+		print_stack_details(ob, info, dinfo);
+
+		size_t bt = ob.pending_size();
+		for (int j = 0; j < info.stack_depth; j++)
+			print_backtrace(ob, j, stack.first[j], symbolize);
+
+		if (is_ignored(ob.pending() + bt, ob.pending_size() - bt)) {
+			ob.rollback();
+			++top;
+		}
+		else {
+			ob.printf("\n");
+			ob.commit();
+			++cnt;
+		}
+		++i;
+	}
+}
+
+static void print_delta_stackmap_flamegraph(outbuf_t &ob, const std::vector<delta_stack_t> &stacks,
+					    stack_reader_t read, const void *arg,
+					    const delta_before_t &before, symbolizer_t symbolize)
+{
+	index_heap_t<delta_before_t> heap(stacks.size(), before);
+	dump_stack_t stack;
+	int i = 0;
+	int top = opts.top;
+
+	while (!heap.empty() && i < top) {
+		const delta_stack_t &delta = stacks[heap.pop()];
+		const char *semicolon = "";
+
+		// a flamegraph can't show shrinking sizes.
+		if (delta.size_delta <= 0) {
+			++i;
+			continue;
+		}
+
+		if (!read(delta.id, arg, stack)) {
+			++i;
+			++top;
+			continue;
+		}
+
+		ob.begin();
+		for (size_t j = 0; j < stack.second.stack_depth; ++j) {
+			print_backtrace_flamegraph(ob, stack.first[stack.second.stack_depth - 1 - j],
+						   semicolon, symbolize);
+			semicolon = ";";
+		}
+		if (is_ignored(ob.pending(), ob.pending_size())) {
+			ob.rollback();
+			++top;
+		}
+		else {
+			ob.printf(" %" PRId64 "\n", delta.size_delta);
+			ob.commit();
+		}
+		++i;
+	}
+}
+
+void print_delta_dump(const std::vector<delta_stack_t> &stacks, stack_reader_t read,
+		      const void *arg, const char *sort_keys, bool flamegraph,
+		      const dump_info_t &info, std::chrono::nanoseconds period,
+		      symbolizer_t symbolize)
+{
+	std::vector<std::string> sort_key_vec = utils::string_split(sort_keys, ',');
+	std::string order = sort_key_vec.empty() ? "size" : sort_key_vec.front();
+	int64_t size_delta = 0;
+	char buf[3][UNIT_BUF_SIZE];
+	outbuf_t ob(outfp);
+
+	delta_before_t before = { &stacks, order == "count" };
+
+	if (flamegraph) {
+		print_delta_stackmap_flamegraph(ob, stacks, read, arg, before, symbolize);
+		return;
+	}
+
+	for (const auto &delta : stacks)
+		size_delta += delta.size_delta;
+
+	ob.printf("=================================================================\n");
+	ob.printf("[heaptrace] dump growth in %s sorted by '%s' for /proc/%ld/maps (%s)\n",
+		  format_time_unit(buf[0], period.count()), order.c_str(), info.pid,
+		  info.comm.c_str());
+	print_delta_stackmap(ob, stacks, read, arg, before, info, symbolize);
+
+	ob.printf("[heaptrace] grown num of backtrace       : %zd\n", stacks.size());
+	ob.printf("[heaptrace] grown allocation size        : %s\n",
+		  format_delta_byte_unit(buf[0], size_delta));
+	ob.printf("[heaptrace] statm info (VSS/RSS/shared)  : %s / %s / %s\n",
+		  format_byte_unit(buf[0], info.statm_vss), format_byte_unit(buf[1], info.statm_rss),
+		  format_byte_unit(buf[2], info.statm_shared));
+	ob.printf("=================================================================\n");
+}
+
+struct leak_before_t {
+	const std::vector<leak_stack_t> *stacks;
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		const leak_stack_t &l1 = (*stacks)[a];
+		const leak_stack_t &l2 = (*stacks)[b];
+
+		if (l1.definite_size == l2.definite_size)
+			return l1.possible_size > l2.possible_size;
+		return l1.definite_size > l2.definite_size;
+	}
+};
+
+static void print_leak_stackmap(outbuf_t &ob, const std::vector<leak_stack_t> &stacks,
+				stack_reader_t read, const void *arg, const dump_info_t &dinfo,
+				symbolizer_t symbolize)
+{
+	index_heap_t<leak_before_t> heap(stacks.size(), { &stacks });
+	char definite[UNIT_BUF_SIZE];
+	char possible[UNIT_BUF_SIZE];
+	char age[UNIT_BUF_SIZE];
+	int cnt = 1;
+	int top = opts.top;
+	int i = 0;
+	dump_stack_t stack;
+
+	while (!heap.empty() && i < top) {
+		const leak_stack_t &leak = stacks[heap.pop()];
+		const stack_info_t &info = stack.second;
+
+		if (!read(leak.id, arg, stack)) {
+			++i;
+			++top;
+			continue;
+		}
+
+		ob.begin();
+		ob.printf("=== leak #%d === [definite: %" PRIu64 "/%s] [possible: %" PRIu64 "/%s] "
+			  "[live: %zu] [age: %s]\n",
+			  cnt, leak.definite_count, format_byte_unit(definite, leak.definite_size),
+			  leak.possible_count, format_byte_unit(possible, leak.possible_size),
+			  info.count, format_time_unit(age, (dinfo.time - info.birth_time).count()));
+		print_stack_details(ob, info, dinfo);
+
+		size_t bt = ob.pending_size();
+		for (int j = 0; j < info.stack_depth; j++)
+			print_backtrace(ob, j, stack.first[j], symbolize);
+
+		if (is_ignored(ob.pending() + bt, ob.pending_size() - bt)) {
+			ob.rollback();
+			++top;
+		}
+		else {
+			ob.printf("\n");
+			ob.commit();
+			++cnt;
+		}
+		++i;
+	}
+}
+
+void print_leak_dump(const std::vector<leak_stack_t> &stacks, stack_reader_t read,
+		     const void *arg, const leak_info_t &linfo, const dump_info_t &info,
+		     symbolizer_t symbolize)
+{
+	uint64_t definite_count = 0;
+	uint64_t definite_size = 0;
+	uint64_t possible_count = 0;
+	uint64_t possible_size = 0;
+	char buf[2][UNIT_BUF_SIZE];
+	outbuf_t ob(outfp);
+
+	for (const auto &leak : stacks) {
+		definite_count += leak.definite_count;
+		definite_size += leak.definite_size;
+		possible_count += leak.possible_count;
+		possible_size += leak.possible_size;
+	}
+
+	ob.printf("=================================================================\n");
+	ob.printf("[heaptrace] dump %sleaks sorted by 'size' for /proc/%ld/maps (%s)\n",
+		  linfo.incremental ? "new " : "", info.pid, info.comm.c_str());
+	print_leak_stackmap(ob, stacks, read, arg, info, symbolize);
+
+	ob.printf("[heaptrace] leak scanned objects         : %" PRIu64 " (%s)\n", linfo.nr_objects,
+		  format_byte_unit(buf[0], linfo.total_size));
+	ob.printf("[heaptrace] leak definitely lost         : %" PRIu64 " (%s)\n", definite_count,
+		  format_byte_unit(buf[0], definite_size));
+	ob.printf("[heaptrace] leak possibly lost           : %" PRIu64 " (%s)\n", possible_count,
+		  format_byte_unit(buf[0], possible_size));
+	ob.printf("[heaptrace] leak scanned roots           : %" PRIu64 " ranges (%s)\n",
+		  linfo.nr_roots, format_byte_unit(buf[0], linfo.root_size));
+	if (linfo.incremental) {
+		ob.printf("[heaptrace] leak sampled threads (pause) : %u (%s at most, scan took %s)\n",
+			  linfo.nr_threads, format_time_unit(buf[0], linfo.pause.count()),
+			  format_time_unit(buf[1], linfo.elapsed.count()));
+	}
+	else {
+		ob.printf("[heaptrace] leak stopped threads (pause) : %u (%s with %u workers)\n",
+			  linfo.nr_threads, format_time_unit(buf[0], linfo.pause.count()),
+			  linfo.nr_workers);
+	}
+	ob.printf("=================================================================\n");
+}
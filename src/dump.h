@@ -0,0 +1,177 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_DUMP_H
+#define HEAPTRACE_DUMP_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stacktrace.h"
+#include "symbol.h"
+
+using dump_stack_t = std::pair<stack_trace_t, stack_info_t>;
+
+// The numbers to sort a stack by, which are all that a dump copies for every
+// stack.  The whole stack is read only when it's printed.
+struct dump_key_t {
+	uint32_t id;
+	uint64_t total_size;
+	uint64_t count;
+	uint64_t nr_allocs;
+	uint64_t alloc_bytes;
+	uint64_t nr_frees;
+	uint64_t free_bytes;
+};
+
+// Reads the stack of the id in a dump_key_t, returns false if it's gone.
+typedef bool (*stack_reader_t)(uint32_t id, const void *arg, dump_stack_t &stack);
+
+// the stacks of a dump and the sums of them for the footer
+struct dump_stacks_t {
+	std::vector<dump_key_t> keys;
+	stack_reader_t read;
+	const void *arg;
+
+	// the stacks that have live objects
+	size_t nr_live;
+	uint64_t total_size;
+	uint64_t waste;
+	uint64_t size_class[NR_SIZE_CLASSES];
+	uint64_t nr_allocs;
+	uint64_t nr_frees;
+	uint64_t churn;
+};
+
+// Initializes the stacks to be read by read() with arg.
+void init_dump_stacks(dump_stacks_t &stacks, stack_reader_t read, const void *arg);
+
+// Adds the stack to the sums, and its key too unless it's only for the summary.
+void add_dump_stack(dump_stacks_t &stacks, uint32_t id, const stack_info_t &info, bool key = true);
+
+// Makes the stacks in a vector, e.g. of a raw dump, into a dump_stacks_t
+// that reads them by the index.
+void make_dump_stacks(const std::vector<dump_stack_t> &vec, dump_stacks_t &stacks);
+
+// resolves a return address into its symbolic info
+typedef const symbol_t &(*symbolizer_t)(void *addr);
+
+// live objects and frees of the objects allocated by a thread
+struct thread_dump_t {
+	uint32_t tid;
+	std::string comm;
+	bool exited;
+	uint64_t total_size;
+	uint64_t count;
+	uint64_t nr_allocs;
+	uint64_t nr_frees;
+	// own objects freed by other threads
+	uint64_t remote_frees;
+	// objects of other threads freed by this thread
+	uint64_t foreign_frees;
+};
+
+// process wide info shown in the header and the footer of a dump
+struct dump_info_t {
+	long pid;
+	std::string comm;
+	// the time when the dump is taken, the age of stacks is based on it.
+	time_point_t time;
+	// the time when the tracing started or was cleared, for the rates.
+	time_point_t start;
+
+	uint64_t alloc_virtual;
+	uint64_t alloc_resident;
+	uint64_t statm_vss;
+	uint64_t statm_rss;
+	uint64_t statm_shared;
+
+	bool async;
+	uint64_t nr_overflows;
+	uint64_t sample_rate;
+
+	// lifetime of the objects freed so far, including the stacks that
+	// have no live objects.
+	uint64_t lifetime[NR_LIFETIME_BUCKETS];
+
+	// the threads that allocated any object.
+	std::vector<thread_dump_t> threads;
+};
+
+// mappings created by mmap() with the same prot and flags
+struct mmap_class_t {
+	int prot;
+	int flags;
+	uint64_t count;
+	uint64_t size;
+};
+
+struct mmap_dump_t {
+	std::vector<dump_stack_t> stacks;
+	std::vector<mmap_class_t> classes;
+};
+
+// Prints only the footers of print_dump().
+void print_dump_summary(const dump_stacks_t &stacks, const dump_info_t &info,
+			const mmap_dump_t *mmaps = nullptr);
+
+// a stack that grew since the previous periodic dump, read by its id
+struct delta_stack_t {
+	uint32_t id;
+	int64_t size_delta;
+	int64_t count_delta;
+};
+
+// Prints the stacks in the text format for each of the comma separated
+// sort_keys, or in the flamegraph format.  The mmap stacks are shown after
+// the heap stacks in the text format if given.  This is shared by libheaptrace.so
+// and the report command of heaptrace, which symbolizes offline.
+void print_dump(const dump_stacks_t &stacks, const char *sort_keys, bool flamegraph,
+		const dump_info_t &info, symbolizer_t symbolize, const mmap_dump_t *mmaps = nullptr);
+
+// returns true if any of the comma separated sort_keys sorts by the cumulative
+// numbers, which need the stacks without live objects as well.
+bool has_cumulative_sort_key(const char *sort_keys);
+
+// Prints the stacks that grew during the period like print_dump() does, but
+// sorted by the growth with only the first of sort_keys.
+void print_delta_dump(const std::vector<delta_stack_t> &stacks, stack_reader_t read,
+		      const void *arg, const char *sort_keys, bool flamegraph,
+		      const dump_info_t &info, std::chrono::nanoseconds period,
+		      symbolizer_t symbolize);
+
+// the unreachable objects of a stack found by a leak check
+struct leak_stack_t {
+	uint32_t id;
+	// no pointer to the objects at all
+	uint64_t definite_count;
+	uint64_t definite_size;
+	// only the pointers into the middle of the objects
+	uint64_t possible_count;
+	uint64_t possible_size;
+};
+
+// what a leak check scanned and how long the program was stopped
+struct leak_info_t {
+	uint64_t nr_objects;
+	uint64_t total_size;
+	uint64_t nr_roots;
+	uint64_t root_size;
+	uint32_t nr_threads;
+	uint32_t nr_workers;
+	// the whole pause, or the longest one of a thread in the incremental check
+	std::chrono::nanoseconds pause;
+	bool incremental;
+	std::chrono::nanoseconds elapsed;
+};
+
+// Prints the stacks of the leaked objects sorted by the size of the definite
+// leaks and then of the possible ones.  The incremental check shows only the
+// new ones.  The stacks are read with read and arg when they're printed.
+void print_leak_dump(const std::vector<leak_stack_t> &stacks, stack_reader_t read,
+		     const void *arg, const leak_info_t &linfo, const dump_info_t &info,
+		     symbolizer_t symbolize);
+
+#endif /* HEAPTRACE_DUMP_H */
@@ -0,0 +1,201 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "elffile.h"
+
+// Elf32_Nhdr and Elf64_Nhdr have the same layout.
+std::string elf_note_build_id(const void *note, size_t size)
+{
+	auto *data = static_cast<const char *>(note);
+	size_t pos = 0;
+
+	while (pos + sizeof(Elf64_Nhdr) <= size) {
+		auto *nhdr = reinterpret_cast<const Elf64_Nhdr *>(data + pos);
+		size_t name_pos = pos + sizeof(*nhdr);
+		size_t desc_pos = name_pos + ((nhdr->n_namesz + 3) & ~3);
+
+		pos = desc_pos + ((nhdr->n_descsz + 3) & ~3);
+		if (pos > size)
+			break;
+
+		if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+		    !memcmp(data + name_pos, "GNU", 4)) {
+			std::string build_id;
+			char hex[3];
+
+			for (size_t i = 0; i < nhdr->n_descsz; i++) {
+				snprintf(hex, sizeof(hex), "%02x", (unsigned char)data[desc_pos + i]);
+				build_id += hex;
+			}
+			return build_id;
+		}
+	}
+	return {};
+}
+
+template <typename Ehdr, typename Phdr, typename Shdr, typename Sym, typename Nhdr>
+bool elf_file_t::parse_elf(const char *data, size_t size, bool symbols_only)
+{
+	auto *ehdr = reinterpret_cast<const Ehdr *>(data);
+
+	if (size < sizeof(Ehdr))
+		return false;
+
+	if (!symbols_only && ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Phdr) <= size) {
+		auto *phdrs = reinterpret_cast<const Phdr *>(data + ehdr->e_phoff);
+
+		for (int i = 0; i < ehdr->e_phnum; i++) {
+			const Phdr *phdr = &phdrs[i];
+
+			if (phdr->p_type == PT_LOAD) {
+				segments.push_back({ phdr->p_vaddr, phdr->p_offset, phdr->p_filesz });
+			}
+			else if (phdr->p_type == PT_NOTE && build_id_.empty() &&
+				 phdr->p_offset + phdr->p_filesz <= size) {
+				build_id_ = elf_note_build_id(data + phdr->p_offset, phdr->p_filesz);
+			}
+		}
+	}
+
+	if (ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Shdr) > size)
+		return true;
+
+	// prefer .symtab as .dynsym has only the exported symbols.
+	auto *shdrs = reinterpret_cast<const Shdr *>(data + ehdr->e_shoff);
+	const Shdr *symtab = nullptr;
+
+	for (int i = 0; i < ehdr->e_shnum; i++) {
+		if (shdrs[i].sh_type == SHT_SYMTAB)
+			symtab = &shdrs[i];
+		else if (shdrs[i].sh_type == SHT_DYNSYM && !symtab)
+			symtab = &shdrs[i];
+	}
+	if (!symtab || symtab->sh_link >= ehdr->e_shnum)
+		return true;
+
+	const Shdr *strtab = &shdrs[symtab->sh_link];
+	if (symtab->sh_offset + symtab->sh_size > size || strtab->sh_offset + strtab->sh_size > size)
+		return true;
+
+	// keep the symbols of .dynsym in case the debug file has nothing.
+	if (symtab->sh_type == SHT_DYNSYM && symbols_only)
+		return true;
+
+	auto *syms = reinterpret_cast<const Sym *>(data + symtab->sh_offset);
+	size_t nr_syms = symtab->sh_size / sizeof(Sym);
+	const char *strs = data + strtab->sh_offset;
+
+	symbols.clear();
+	has_symtab = symtab->sh_type == SHT_SYMTAB;
+
+	for (size_t i = 0; i < nr_syms; i++) {
+		const Sym *sym = &syms[i];
+		int type = sym->st_info & 0xf;
+
+		if (type != STT_FUNC && type != STT_GNU_IFUNC)
+			continue;
+		if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0)
+			continue;
+		if (sym->st_name >= strtab->sh_size)
+			continue;
+
+		symbols.push_back({ sym->st_value, sym->st_size, strs + sym->st_name });
+	}
+
+	std::sort(symbols.begin(), symbols.end(),
+		  [](const elf_symbol_t &a, const elf_symbol_t &b) { return a.addr < b.addr; });
+	return true;
+}
+
+bool elf_file_t::parse(const std::string &path, bool symbols_only)
+{
+	struct stat st;
+	bool ret = false;
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < EI_NIDENT) {
+		close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	auto *data = static_cast<const char *>(p);
+	if (!memcmp(data, ELFMAG, SELFMAG)) {
+		if (data[EI_CLASS] == ELFCLASS64)
+			ret = parse_elf<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Sym, Elf64_Nhdr>(
+				data, st.st_size, symbols_only);
+		else if (data[EI_CLASS] == ELFCLASS32)
+			ret = parse_elf<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Sym, Elf32_Nhdr>(
+				data, st.st_size, symbols_only);
+	}
+
+	munmap(p, st.st_size);
+	return ret;
+}
+
+bool elf_file_t::load(const std::string &path)
+{
+	if (!parse(path, false))
+		return false;
+
+	// stripped files might have the symbols in a separate debug file.
+	if (!has_symtab && build_id_.size() > 2) {
+		std::string debug_path = "/usr/lib/debug/.build-id/" + build_id_.substr(0, 2) +
+					 "/" + build_id_.substr(2) + ".debug";
+		parse(debug_path, true);
+	}
+	return true;
+}
+
+bool elf_file_t::offset_to_vaddr(uint64_t offset, uint64_t *vaddr) const
+{
+	for (const auto &seg : segments) {
+		if (seg.offset <= offset && offset < seg.offset + seg.filesz) {
+			*vaddr = seg.vaddr + offset - seg.offset;
+			return true;
+		}
+	}
+	return false;
+}
+
+const elf_symbol_t *elf_file_t::find_symbol(uint64_t vaddr) const
+{
+	auto it = std::upper_bound(symbols.begin(), symbols.end(), vaddr,
+				   [](uint64_t addr, const elf_symbol_t &sym) { return addr < sym.addr; });
+	if (it == symbols.begin())
+		return nullptr;
+
+	const elf_symbol_t *sym = &*--it;
+
+	// a symbol without size covers up to the next symbol as dladdr() does.
+	if (sym->size && vaddr >= sym->addr + sym->size)
+		return nullptr;
+	return sym;
+}
+
+const elf_symbol_t *elf_file_t::lookup_symbol(const std::string &name) const
+{
+	for (const auto &sym : symbols) {
+		if (sym.name == name)
+			return &sym;
+	}
+	return nullptr;
+}
@@ -0,0 +1,62 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_ELFFILE_H
+#define HEAPTRACE_ELFFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Returns the GNU build-id in hex from the notes, or an empty string.
+std::string elf_note_build_id(const void *note, size_t size);
+
+struct elf_symbol_t {
+	uint64_t addr;
+	uint64_t size;
+	std::string name;
+};
+
+// elf_file_t reads the program headers, the build-id and the function
+// symbols of an ELF file to symbolize addresses offline.  Both 32-bit and
+// 64-bit files are supported regardless of the host.
+class elf_file_t {
+public:
+	// Loads the file.  If it has no .symtab, the symbols are read from the
+	// separate debug file under /usr/lib/debug/.build-id or .dynsym.
+	bool load(const std::string &path);
+
+	const std::string &build_id(void) const
+	{
+		return build_id_;
+	}
+
+	// Converts an offset in the file to the virtual address of the loaded
+	// segment that contains it.
+	bool offset_to_vaddr(uint64_t offset, uint64_t *vaddr) const;
+
+	// Returns the function symbol that contains the vaddr, or nullptr.
+	const elf_symbol_t *find_symbol(uint64_t vaddr) const;
+
+	// Returns the function symbol of the name, or nullptr.
+	const elf_symbol_t *lookup_symbol(const std::string &name) const;
+
+private:
+	struct segment_t {
+		uint64_t vaddr;
+		uint64_t offset;
+		uint64_t filesz;
+	};
+
+	bool parse(const std::string &path, bool symbols_only);
+
+	template <typename Ehdr, typename Phdr, typename Shdr, typename Sym, typename Nhdr>
+	bool parse_elf(const char *data, size_t size, bool symbols_only);
+
+	std::vector<segment_t> segments;
+	std::vector<elf_symbol_t> symbols;
+	bool has_symtab = false;
+	std::string build_id_;
+};
+
+#endif /* HEAPTRACE_ELFFILE_H */
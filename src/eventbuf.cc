@@ -0,0 +1,335 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "compiler.h"
+#include "eventbuf.h"
+#include "evlog.h"
+#include "heaptrace.h"
+#include "stacktrace.h"
+#include "utils.h"
+
+// number of events in a per-thread ring buffer, it must be a power of 2.
+#define EVENTBUF_NR_EVENTS 4096
+
+// the worker sleeps this long when there was nothing to do.
+#define EVENTBUF_IDLE_NSEC (1000 * 1000)
+
+enum event_type {
+	EVENT_ALLOC,
+	EVENT_FREE,
+};
+
+struct event_t {
+	event_origin_t origin;
+	void *addr;
+	uint64_t size;
+	uint64_t usable;
+	uint32_t type;
+	int32_t nptrs;
+	stack_trace_t stack_trace;
+};
+
+struct eventbuf_t {
+	// written by the consumer only
+	std::atomic<uint64_t> head __align(64);
+	// written by the producer only
+	std::atomic<uint64_t> tail __align(64);
+	std::atomic<uint64_t> nr_overflows;
+	std::atomic<bool> exited;
+
+	// the following fields are protected by registry_lock.
+	eventbuf_t *next;
+	uint64_t end;
+
+	event_t events[EVENTBUF_NR_EVENTS];
+};
+
+// All the buffers are linked in the registry.  A drain round holds the lock
+// so only one thread consumes the buffers at a time.
+static std::mutex registry_lock;
+static eventbuf_t *registry;
+
+// used by the threads that cannot have their own buffer, e.g. in the middle
+// of thread exit.  Producers are serialized by shared_lock.
+static eventbuf_t *shared_buf;
+static std::mutex shared_lock;
+
+// overflows of the buffers that were already released
+static std::atomic<uint64_t> retired_overflows;
+
+static pthread_key_t eventbuf_key;
+
+// set in a forked child, which starts its worker on the first event.
+static std::atomic<bool> worker_missing;
+
+static bool eventbuf_start_worker(void);
+
+static eventbuf_t *eventbuf_alloc(void)
+{
+	void *p = mmap(nullptr, sizeof(eventbuf_t), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+
+	// anonymous mapping is zero filled so all fields are initialized.
+	auto *buf = static_cast<eventbuf_t *>(p);
+
+	std::lock_guard<std::mutex> lock(registry_lock);
+	buf->next = registry;
+	registry = buf;
+	return buf;
+}
+
+static void eventbuf_thread_exit(void *arg)
+{
+	auto *buf = static_cast<eventbuf_t *>(arg);
+	auto *tfs = &thread_flags;
+
+	// the remaining events will be consumed and then the worker frees it.
+	buf->exited.store(true, std::memory_order_release);
+
+	// any later event of this thread goes to the shared buffer.
+	tfs->eventbuf = nullptr;
+	tfs->eventbuf_exited = true;
+}
+
+static eventbuf_t *get_eventbuf(void)
+{
+	auto *tfs = &thread_flags;
+
+	if (likely(tfs->eventbuf))
+		return tfs->eventbuf;
+	if (tfs->eventbuf_exited)
+		return nullptr;
+
+	tfs->eventbuf = eventbuf_alloc();
+	if (tfs->eventbuf)
+		pthread_setspecific(eventbuf_key, tfs->eventbuf);
+	else
+		tfs->eventbuf_exited = true;
+	return tfs->eventbuf;
+}
+
+static bool eventbuf_push(eventbuf_t *buf, uint32_t type, size_t size, size_t usable,
+			  void *addr, const stack_trace_t *stack_trace, int nptrs)
+{
+	uint64_t tail = buf->tail.load(std::memory_order_relaxed);
+
+	if (unlikely(tail - buf->head.load(std::memory_order_acquire) >= EVENTBUF_NR_EVENTS)) {
+		buf->nr_overflows.fetch_add(1, std::memory_order_relaxed);
+		while (tail - buf->head.load(std::memory_order_acquire) >= EVENTBUF_NR_EVENTS)
+			sched_yield();
+	}
+
+	event_t *event = &buf->events[tail & (EVENTBUF_NR_EVENTS - 1)];
+
+	// An alloc event is pushed after the allocation and a free event is
+	// pushed before the deallocation.  So if an event is causally related
+	// to another event of the same address in a different thread, the
+	// earlier event is already visible when the later gets its time.
+	event->origin = get_event_origin();
+	event->addr = addr;
+	event->size = size;
+	event->usable = usable;
+	event->type = type;
+	event->nptrs = nptrs;
+	if (stack_trace)
+		event->stack_trace = *stack_trace;
+
+	buf->tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+static bool push_event(uint32_t type, size_t size, size_t usable, void *addr,
+		       const stack_trace_t *stack_trace, int nptrs)
+{
+	eventbuf_t *buf = get_eventbuf();
+
+	if (unlikely(worker_missing.load(std::memory_order_relaxed)) && worker_missing.exchange(false))
+		eventbuf_start_worker();
+
+	if (likely(buf))
+		return eventbuf_push(buf, type, size, usable, addr, stack_trace, nptrs);
+
+	if (!shared_buf)
+		return false;
+
+	std::lock_guard<std::mutex> lock(shared_lock);
+	return eventbuf_push(shared_buf, type, size, usable, addr, stack_trace, nptrs);
+}
+
+bool eventbuf_push_alloc(size_t size, size_t usable, void *addr, const stack_trace_t &stack_trace,
+			 int nptrs)
+{
+	return push_event(EVENT_ALLOC, size, usable, addr, &stack_trace, nptrs);
+}
+
+bool eventbuf_push_free(void *addr)
+{
+	return push_event(EVENT_FREE, 0, 0, addr, nullptr, 0);
+}
+
+static void apply_event(const event_t *event)
+{
+	if (event->type == EVENT_ALLOC) {
+		stack_trace_t stack_trace = event->stack_trace;
+		do_record_backtrace(event->size, event->usable, event->addr, stack_trace,
+				    event->nptrs, event->origin);
+	}
+	else {
+		do_release_backtrace(event->addr, event->origin);
+	}
+
+	if (opts.event_log)
+		evlog_flush_pending();
+}
+
+// Applies the events that happened before now in timestamp order across all
+// the buffers.  An event with a later time is left for the next round as a
+// related event of other thread might not be visible yet.
+static size_t eventbuf_drain(void)
+{
+	typedef std::pair<uint64_t, eventbuf_t *> item_t;
+	std::vector<item_t> heap;
+	auto cmp = [](const item_t &a, const item_t &b) { return a.first > b.first; };
+	uint64_t now = utils::get_time_ns();
+	size_t nr_events = 0;
+
+	std::lock_guard<std::mutex> lock(registry_lock);
+
+	for (eventbuf_t *buf = registry; buf; buf = buf->next) {
+		uint64_t head = buf->head.load(std::memory_order_relaxed);
+
+		buf->end = buf->tail.load(std::memory_order_acquire);
+		if (head == buf->end)
+			continue;
+
+		const event_t *event = &buf->events[head & (EVENTBUF_NR_EVENTS - 1)];
+		if (event->origin.time < now)
+			heap.emplace_back(event->origin.time, buf);
+	}
+	std::make_heap(heap.begin(), heap.end(), cmp);
+
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), cmp);
+		eventbuf_t *buf = heap.back().second;
+		heap.pop_back();
+
+		uint64_t head = buf->head.load(std::memory_order_relaxed);
+		apply_event(&buf->events[head & (EVENTBUF_NR_EVENTS - 1)]);
+		buf->head.store(++head, std::memory_order_release);
+		nr_events++;
+
+		if (head == buf->end)
+			continue;
+
+		const event_t *event = &buf->events[head & (EVENTBUF_NR_EVENTS - 1)];
+		if (event->origin.time < now) {
+			heap.emplace_back(event->origin.time, buf);
+			std::push_heap(heap.begin(), heap.end(), cmp);
+		}
+	}
+
+	// release the buffers of exited threads once they're empty.
+	eventbuf_t **pprev = &registry;
+	while (eventbuf_t *buf = *pprev) {
+		if (buf->exited.load(std::memory_order_acquire) &&
+		    buf->head.load(std::memory_order_relaxed) ==
+			    buf->tail.load(std::memory_order_acquire)) {
+			*pprev = buf->next;
+			retired_overflows.fetch_add(buf->nr_overflows.load(std::memory_order_relaxed),
+						    std::memory_order_relaxed);
+			munmap(buf, sizeof(*buf));
+			continue;
+		}
+		pprev = &buf->next;
+	}
+
+	return nr_events;
+}
+
+static void *eventbuf_worker(void *arg)
+{
+	auto *tfs = &thread_flags;
+	struct timespec idle = { 0, EVENTBUF_IDLE_NSEC };
+
+	// the worker never records its own allocations.
+	tfs->hook_guard = true;
+
+	while (true) {
+		if (eventbuf_drain() == 0)
+			nanosleep(&idle, nullptr);
+	}
+	return nullptr;
+}
+
+static bool eventbuf_start_worker(void)
+{
+	pthread_t worker;
+
+	if (pthread_create(&worker, nullptr, eventbuf_worker, nullptr) != 0)
+		return false;
+
+	pthread_setname_np(worker, "heaptrace");
+	pthread_detach(worker);
+	return true;
+}
+
+static void eventbuf_atfork_prepare(void)
+{
+	registry_lock.lock();
+}
+
+static void eventbuf_atfork_parent(void)
+{
+	registry_lock.unlock();
+}
+
+static void eventbuf_atfork_child(void)
+{
+	registry_lock.unlock();
+
+	// The worker doesn't exist in the child.  A thread cannot be created
+	// safely here, so the first event starts a new one.
+	worker_missing.store(true);
+}
+
+bool eventbuf_init(void)
+{
+	if (pthread_key_create(&eventbuf_key, eventbuf_thread_exit) != 0)
+		return false;
+
+	shared_buf = eventbuf_alloc();
+	if (!shared_buf)
+		return false;
+
+	pthread_atfork(eventbuf_atfork_prepare, eventbuf_atfork_parent, eventbuf_atfork_child);
+
+	return eventbuf_start_worker();
+}
+
+void eventbuf_flush(void)
+{
+	// This applies every event pushed before the call.  Events pushed in the
+	// meantime might be left to the worker.
+	eventbuf_drain();
+}
+
+uint64_t eventbuf_overflows(void)
+{
+	uint64_t nr_overflows = retired_overflows.load(std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(registry_lock);
+	for (eventbuf_t *buf = registry; buf; buf = buf->next)
+		nr_overflows += buf->nr_overflows.load(std::memory_order_relaxed);
+	return nr_overflows;
+}
@@ -0,0 +1,28 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_EVENTBUF_H
+#define HEAPTRACE_EVENTBUF_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "stacktrace.h"
+
+// In async mode, the hooks only append fixed-size alloc/free events into a
+// per-thread ring buffer and a background worker thread applies them to the
+// stackmap/addrmap in timestamp order.
+
+bool eventbuf_init(void);
+
+// Returns false if the event cannot be queued and must be handled directly.
+bool eventbuf_push_alloc(size_t size, size_t usable, void *addr, const stack_trace_t &stack_trace,
+			 int nptrs);
+bool eventbuf_push_free(void *addr);
+
+// Applies every event queued so far in the calling thread.
+void eventbuf_flush(void);
+
+// Number of times the hooks found their buffer full and had to wait.
+uint64_t eventbuf_overflows(void);
+
+#endif /* HEAPTRACE_EVENTBUF_H */
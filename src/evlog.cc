@@ -0,0 +1,438 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "compiler.h"
+#include "evlog.h"
+#include "heaptrace.h"
+#include "raw.h"
+#include "utils.h"
+
+// size of a per-thread buffer, records are written to the file in this unit.
+#define EVLOG_BUF_SIZE (256 * 1024)
+
+// the records of a buffer, it's queued to be written when the buffer is full.
+struct evlog_chunk_t {
+	evlog_chunk_t *next;
+	size_t len;
+	char data[EVLOG_BUF_SIZE];
+};
+
+struct evlog_buf_t {
+	// the owner thread appends records while others can flush it.
+	std::mutex lock;
+	evlog_buf_t *next;
+	// false if the owner thread exited and it can be reused.
+	bool used;
+	evlog_chunk_t *chunk;
+};
+
+static int evlog_fd = -1;
+// not a std::string, evlog_init() runs before the constructors of this file.
+static const char *evlog_prefix;
+
+// protects the list of buffers and the writes to evlog_fd.
+static std::mutex evlog_lock;
+static evlog_buf_t *evlog_bufs;
+
+// The full chunks are written after the caller releases the addr shard lock,
+// see evlog_flush_pending().  The written ones are reused as spares.
+static std::mutex chunk_lock;
+static evlog_chunk_t *spare_chunks;
+static evlog_chunk_t *full_chunks;
+static evlog_chunk_t **full_tail = &full_chunks;
+std::atomic<bool> evlog_pending;
+
+std::atomic<bool> evlog_forked;
+
+// used by the threads that cannot have their own buffer.
+static evlog_buf_t *shared_buf;
+
+static pthread_key_t evlog_key;
+
+static bool write_all(int fd, const char *buf, size_t size)
+{
+	while (size) {
+		ssize_t ret = write(fd, buf, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+static evlog_chunk_t *evlog_chunk_alloc(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(chunk_lock);
+		evlog_chunk_t *chunk = spare_chunks;
+
+		if (chunk) {
+			spare_chunks = chunk->next;
+			chunk->len = 0;
+			return chunk;
+		}
+	}
+
+	void *p = mmap(nullptr, sizeof(evlog_chunk_t), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+
+	auto *chunk = static_cast<evlog_chunk_t *>(p);
+	chunk->len = 0;
+	return chunk;
+}
+
+// Queues the records of the buffer to be written and gives it a spare chunk.
+// The caller should hold the lock of the buffer.
+static void flush_buf(evlog_buf_t *buf)
+{
+	evlog_chunk_t *full = buf->chunk;
+
+	if (full->len == 0)
+		return;
+
+	evlog_chunk_t *spare = evlog_chunk_alloc();
+	if (unlikely(!spare)) {
+		// write it in place if there's no memory for a spare.
+		std::lock_guard<std::mutex> lock(evlog_lock);
+		if (!write_all(evlog_fd, full->data, full->len))
+			pr_dbg("failed to write the event log\n");
+		full->len = 0;
+		return;
+	}
+	buf->chunk = spare;
+
+	std::lock_guard<std::mutex> lock(chunk_lock);
+	full->next = nullptr;
+	*full_tail = full;
+	full_tail = &full->next;
+	evlog_pending.store(true, std::memory_order_relaxed);
+}
+
+void __evlog_flush_pending(void)
+{
+	// keep the order of the chunks across the writers.
+	std::lock_guard<std::mutex> lock(evlog_lock);
+	evlog_chunk_t *chunks;
+
+	{
+		std::lock_guard<std::mutex> clock(chunk_lock);
+		chunks = full_chunks;
+		full_chunks = nullptr;
+		full_tail = &full_chunks;
+		evlog_pending.store(false, std::memory_order_relaxed);
+	}
+	if (!chunks)
+		return;
+
+	evlog_chunk_t *last = chunks;
+	for (evlog_chunk_t *chunk = chunks; chunk; chunk = chunk->next) {
+		if (!write_all(evlog_fd, chunk->data, chunk->len))
+			pr_dbg("failed to write the event log\n");
+		last = chunk;
+	}
+
+	std::lock_guard<std::mutex> clock(chunk_lock);
+	last->next = spare_chunks;
+	spare_chunks = chunks;
+}
+
+static evlog_buf_t *evlog_buf_alloc(void)
+{
+	evlog_chunk_t *chunk = evlog_chunk_alloc();
+	if (!chunk)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(evlog_lock);
+
+	// reuse a buffer of an exited thread.
+	for (evlog_buf_t *buf = evlog_bufs; buf; buf = buf->next) {
+		if (!buf->used) {
+			buf->used = true;
+			std::lock_guard<std::mutex> clock(chunk_lock);
+			chunk->next = spare_chunks;
+			spare_chunks = chunk;
+			return buf;
+		}
+	}
+
+	void *p = mmap(nullptr, sizeof(evlog_buf_t), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		std::lock_guard<std::mutex> clock(chunk_lock);
+		chunk->next = spare_chunks;
+		spare_chunks = chunk;
+		return nullptr;
+	}
+
+	auto *buf = new (p) evlog_buf_t;
+	buf->used = true;
+	buf->chunk = chunk;
+	buf->next = evlog_bufs;
+	evlog_bufs = buf;
+	return buf;
+}
+
+static void evlog_thread_exit(void *arg)
+{
+	auto *buf = static_cast<evlog_buf_t *>(arg);
+	auto *tfs = &thread_flags;
+
+	{
+		std::lock_guard<std::mutex> lock(buf->lock);
+		flush_buf(buf);
+	}
+	__evlog_flush_pending();
+
+	{
+		std::lock_guard<std::mutex> lock(evlog_lock);
+		buf->used = false;
+	}
+
+	// any later record of this thread goes to the shared buffer.
+	tfs->evlog_buf = nullptr;
+	tfs->evlog_exited = true;
+}
+
+static evlog_buf_t *get_evlog_buf(void)
+{
+	auto *tfs = &thread_flags;
+
+	if (likely(tfs->evlog_buf))
+		return tfs->evlog_buf;
+	if (tfs->evlog_exited)
+		return shared_buf;
+
+	tfs->evlog_buf = evlog_buf_alloc();
+	if (tfs->evlog_buf) {
+		pthread_setspecific(evlog_key, tfs->evlog_buf);
+		return tfs->evlog_buf;
+	}
+
+	tfs->evlog_exited = true;
+	return shared_buf;
+}
+
+static void evlog_append(const void *rec1, size_t size1, const void *rec2 = nullptr,
+			 size_t size2 = 0)
+{
+	evlog_buf_t *buf = get_evlog_buf();
+
+	if (unlikely(!buf))
+		return;
+
+	std::lock_guard<std::mutex> lock(buf->lock);
+
+	// a record is never split across writes.
+	if (buf->chunk->len + size1 + size2 > EVLOG_BUF_SIZE)
+		flush_buf(buf);
+
+	evlog_chunk_t *chunk = buf->chunk;
+	memcpy(chunk->data + chunk->len, rec1, size1);
+	chunk->len += size1;
+	if (size2) {
+		memcpy(chunk->data + chunk->len, rec2, size2);
+		chunk->len += size2;
+	}
+}
+
+void evlog_stack(stack_id_t stack_id, const stack_trace_t &stack_trace, int depth)
+{
+	evlog_stack_t rec = { EVLOG_STACK, stack_id, (uint32_t)depth };
+	uint64_t addrs[DEPTH];
+
+	for (int i = 0; i < depth; i++)
+		addrs[i] = (uintptr_t)stack_trace[i];
+	evlog_append(&rec, sizeof(rec), addrs, depth * sizeof(uint64_t));
+}
+
+void evlog_event(uint32_t type, const event_origin_t &origin, void *addr, uint64_t size,
+		 stack_id_t stack_id)
+{
+	evlog_event_t rec;
+
+	rec.type = type;
+	rec.tid = origin.tid;
+	rec.time = origin.time;
+	rec.addr = (uintptr_t)addr;
+	rec.size = size;
+	rec.stack_id = stack_id;
+	rec.flags = origin.flags;
+	evlog_append(&rec, sizeof(rec));
+}
+
+static void flush_all_bufs(void)
+{
+	std::vector<evlog_buf_t *> bufs;
+
+	{
+		std::lock_guard<std::mutex> lock(evlog_lock);
+		for (evlog_buf_t *buf = evlog_bufs; buf; buf = buf->next)
+			bufs.push_back(buf);
+	}
+
+	// buffers are never freed so it's safe to flush them without evlog_lock.
+	for (evlog_buf_t *buf : bufs) {
+		std::lock_guard<std::mutex> lock(buf->lock);
+		flush_buf(buf);
+	}
+	__evlog_flush_pending();
+}
+
+static void write_maps(void)
+{
+	std::vector<raw_map_t> maps;
+	std::string data;
+
+	read_self_maps(maps);
+
+	evlog_mark_t mark = { EVLOG_MAPS, (uint32_t)maps.size(), utils::get_time_ns() };
+	data.append((const char *)&mark, sizeof(mark));
+
+	for (const auto &map : maps) {
+		evlog_map_t rec = { EVLOG_MAP };
+		size_t len = map.path.size() + map.build_id.size();
+
+		rec.path_len = map.path.size();
+		rec.build_id_len = map.build_id.size();
+		rec.start = map.start;
+		rec.end = map.end;
+		rec.offset = map.offset;
+
+		data.append((const char *)&rec, sizeof(rec));
+		data.append(map.path);
+		data.append(map.build_id);
+		data.append(((len + 7) & ~7) - len, '\0');
+	}
+
+	std::lock_guard<std::mutex> lock(evlog_lock);
+	write_all(evlog_fd, data.data(), data.size());
+}
+
+void evlog_sync(void)
+{
+	if (evlog_fd < 0)
+		return;
+
+	flush_all_bufs();
+	write_maps();
+}
+
+void evlog_clear(void)
+{
+	if (evlog_fd < 0)
+		return;
+
+	flush_all_bufs();
+
+	evlog_mark_t mark = { EVLOG_CLEAR, 0, utils::get_time_ns() };
+	std::lock_guard<std::mutex> lock(evlog_lock);
+	write_all(evlog_fd, (const char *)&mark, sizeof(mark));
+}
+
+static bool evlog_open(void)
+{
+	std::string comm = utils::get_comm_name();
+	std::string filename =
+		utils::asprintf("%s.%d.%s.evlog", evlog_prefix, getpid(), comm.c_str());
+	evlog_header_t hdr = {};
+
+	evlog_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (evlog_fd < 0)
+		return false;
+
+	memcpy(hdr.magic, EVLOG_MAGIC, EVLOG_MAGIC_LEN);
+	hdr.version = EVLOG_VERSION;
+	hdr.byte_order = EVLOG_BYTE_ORDER;
+	hdr.pid = getpid();
+	strncpy(hdr.comm, comm.c_str(), sizeof(hdr.comm) - 1);
+	return write_all(evlog_fd, (const char *)&hdr, sizeof(hdr));
+}
+
+void evlog_start_child(void)
+{
+	if (!evlog_forked.exchange(false))
+		return;
+
+	std::lock_guard<std::mutex> lock(evlog_lock);
+	if (!evlog_open()) {
+		if (evlog_fd >= 0)
+			close(evlog_fd);
+		evlog_fd = -1;
+	}
+}
+
+static void evlog_atfork_prepare(void)
+{
+	evlog_lock.lock();
+	chunk_lock.lock();
+}
+
+static void evlog_atfork_parent(void)
+{
+	chunk_lock.unlock();
+	evlog_lock.unlock();
+}
+
+static void evlog_atfork_child(void)
+{
+	auto *tfs = &thread_flags;
+
+	chunk_lock.unlock();
+	evlog_lock.unlock();
+
+	// records of the parent are not written to the log of the child.
+	for (evlog_buf_t *buf = evlog_bufs; buf; buf = buf->next) {
+		new (&buf->lock) std::mutex;
+		buf->chunk->len = 0;
+		if (buf != tfs->evlog_buf && buf != shared_buf)
+			buf->used = false;
+	}
+	if (full_chunks) {
+		*full_tail = spare_chunks;
+		spare_chunks = full_chunks;
+		full_chunks = nullptr;
+		full_tail = &full_chunks;
+	}
+	evlog_pending.store(false);
+	tfs->tid = 0;
+
+	// The child opens its own log on the first event, as it's not safe
+	// here and the child might just exec.
+	close(evlog_fd);
+	evlog_fd = -1;
+	evlog_forked.store(true);
+}
+
+bool evlog_init(const char *prefix)
+{
+	evlog_prefix = prefix;
+
+	if (pthread_key_create(&evlog_key, evlog_thread_exit) != 0)
+		return false;
+
+	shared_buf = evlog_buf_alloc();
+	if (!shared_buf || !evlog_open())
+		return false;
+
+	pthread_atfork(evlog_atfork_prepare, evlog_atfork_parent, evlog_atfork_child);
+	return true;
+}
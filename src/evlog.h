@@ -0,0 +1,146 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_EVLOG_H
+#define HEAPTRACE_EVLOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "raw.h"
+#include "stacktrace.h"
+
+// The event log keeps every alloc/free event with its time, thread and
+// stack id.  Records are collected in per-thread buffers and appended to the
+// file in large batches, so records of different threads are not in time
+// order in the file.  The only exception is EVLOG_CLEAR which is written
+// after all the buffers are flushed.
+//
+// Every record is a multiple of 8 bytes and starts with its type.  Numbers
+// are fixed size in the byte order of the writer so the log compresses well
+// with general purpose compressors.
+//
+//   evlog_header_t
+//   { evlog_event_t | evlog_stack_t | evlog_mark_t | evlog_map_t }...
+
+#define EVLOG_MAGIC "HTEVTLOG"
+#define EVLOG_MAGIC_LEN 8
+#define EVLOG_VERSION 1
+#define EVLOG_BYTE_ORDER 0x01020304
+
+struct evlog_header_t {
+	char magic[EVLOG_MAGIC_LEN];
+	uint32_t version;
+	uint32_t byte_order;
+	int64_t pid;
+	char comm[16];
+};
+
+enum evlog_type {
+	EVLOG_ALLOC = 1,
+	EVLOG_FREE,
+	EVLOG_STACK,
+	// stacks and objects before it are forgotten by SIGQUIT.
+	EVLOG_CLEAR,
+	// the following arg records are the whole file mappings.
+	EVLOG_MAPS,
+	EVLOG_MAP,
+};
+
+// EVLOG_ALLOC and EVLOG_FREE.  In sampling mode, only sampled objects are
+// logged and the size of EVLOG_FREE is the estimated size.
+struct evlog_event_t {
+	uint32_t type;
+	uint32_t tid;
+	uint64_t time;
+	uint64_t addr;
+	uint64_t size;
+	uint32_t stack_id;
+	// EVENT_REALLOC if it's a half of realloc()
+	uint32_t flags;
+};
+
+// EVLOG_STACK, followed by depth addresses of uint64_t.  It's written when
+// the stack id is assigned, but it can come after the events using the id.
+struct evlog_stack_t {
+	uint32_t type;
+	uint32_t stack_id;
+	uint32_t depth;
+	uint32_t reserved;
+};
+
+// EVLOG_CLEAR and EVLOG_MAPS
+struct evlog_mark_t {
+	uint32_t type;
+	uint32_t arg;
+	uint64_t time;
+};
+
+// EVLOG_MAP, followed by the path and the build-id padded to 8 bytes.
+struct evlog_map_t {
+	uint32_t type;
+	uint16_t path_len;
+	uint16_t build_id_len;
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+};
+
+// Opens <prefix>.<pid>.<comm>.evlog to write the events.
+bool evlog_init(const char *prefix);
+
+void evlog_stack(stack_id_t stack_id, const stack_trace_t &stack_trace, int depth);
+void evlog_event(uint32_t type, const event_origin_t &origin, void *addr, uint64_t size,
+		 stack_id_t stack_id);
+
+// The records above are called under the addr shard lock, so a full buffer is
+// only queued there.  It's written by this after the lock is released.
+extern std::atomic<bool> evlog_pending;
+void __evlog_flush_pending(void);
+
+static inline void evlog_flush_pending(void)
+{
+	if (unlikely(evlog_pending.load(std::memory_order_relaxed)))
+		__evlog_flush_pending();
+}
+
+// A forked child opens its own log on the first event, like the control
+// thread.
+extern std::atomic<bool> evlog_forked;
+void evlog_start_child(void);
+
+static inline void evlog_check_fork(void)
+{
+	if (unlikely(evlog_forked.load(std::memory_order_relaxed)))
+		evlog_start_child();
+}
+
+// Writes all the buffered records and the current file mappings.
+void evlog_sync(void);
+
+// Writes EVLOG_CLEAR.  It must be called while no event is being recorded.
+void evlog_clear(void);
+
+// a stack trace of the log, the stack id is the index in evlog_data_t.
+struct evlog_trace_t {
+	stack_trace_t stack_trace;
+	int depth;
+};
+
+struct evlog_data_t {
+	int64_t pid;
+	std::string comm;
+	// ALLOC, FREE and CLEAR events sorted by time.  The stack ids are
+	// replaced by the index of stacks.
+	std::vector<evlog_event_t> events;
+	std::vector<evlog_trace_t> stacks;
+	// the last file mappings in the log
+	std::vector<raw_map_t> maps;
+};
+
+bool is_evlog(const char *filename);
+bool read_evlog(const char *filename, evlog_data_t &data);
+
+#endif /* HEAPTRACE_EVLOG_H */
@@ -0,0 +1,172 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "evlog.h"
+
+bool is_evlog(const char *filename)
+{
+	char magic[EVLOG_MAGIC_LEN];
+	int fd = open(filename, O_RDONLY);
+	bool ret;
+
+	if (fd < 0)
+		return false;
+
+	ret = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	      !memcmp(magic, EVLOG_MAGIC, EVLOG_MAGIC_LEN);
+	close(fd);
+	return ret;
+}
+
+// Stack ids are valid until the next EVLOG_CLEAR, and the stack record can
+// come after the events using it.  So the ids are resolved at the end of
+// each segment between clears, then the events are sorted by time in it.
+static void finish_segment(evlog_data_t &data, size_t start,
+			   const std::unordered_map<uint32_t, uint32_t> &stack_ids)
+{
+	for (size_t i = start; i < data.events.size(); i++) {
+		auto it = stack_ids.find(data.events[i].stack_id);
+
+		data.events[i].stack_id = it != stack_ids.end() ? it->second : STACK_ID_NONE;
+	}
+
+	std::stable_sort(data.events.begin() + start, data.events.end(),
+			 [](const evlog_event_t &a, const evlog_event_t &b) {
+				 return a.time < b.time;
+			 });
+}
+
+static bool parse_evlog(const char *buf, size_t size, evlog_data_t &data)
+{
+	auto *hdr = reinterpret_cast<const evlog_header_t *>(buf);
+	std::unordered_map<uint32_t, uint32_t> stack_ids;
+	size_t segment = 0;
+	size_t pos = sizeof(*hdr);
+	uint32_t nr_maps = 0;
+
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, EVLOG_MAGIC, EVLOG_MAGIC_LEN) ||
+	    hdr->version != EVLOG_VERSION || hdr->byte_order != EVLOG_BYTE_ORDER)
+		return false;
+
+	data.pid = hdr->pid;
+	data.comm.assign(hdr->comm, strnlen(hdr->comm, sizeof(hdr->comm)));
+
+	// a truncated record at the end is ignored, e.g. the program crashed.
+	while (pos + sizeof(uint32_t) <= size) {
+		uint32_t type = *reinterpret_cast<const uint32_t *>(buf + pos);
+
+		if (type == EVLOG_ALLOC || type == EVLOG_FREE) {
+			if (pos + sizeof(evlog_event_t) > size)
+				break;
+			data.events.push_back(*reinterpret_cast<const evlog_event_t *>(buf + pos));
+			pos += sizeof(evlog_event_t);
+		}
+		else if (type == EVLOG_STACK) {
+			auto *rec = reinterpret_cast<const evlog_stack_t *>(buf + pos);
+			size_t len = sizeof(*rec) + rec->depth * sizeof(uint64_t);
+
+			if (pos + sizeof(*rec) > size || pos + len > size)
+				break;
+
+			auto *addrs = reinterpret_cast<const uint64_t *>(rec + 1);
+			evlog_trace_t trace = {};
+
+			// keep the innermost frames if it's built with a smaller DEPTH.
+			trace.depth = std::min<uint32_t>(rec->depth, DEPTH);
+			for (int i = 0; i < trace.depth; i++)
+				trace.stack_trace[i] = (void *)(uintptr_t)addrs[i];
+
+			stack_ids[rec->stack_id] = data.stacks.size();
+			data.stacks.push_back(trace);
+			pos += len;
+		}
+		else if (type == EVLOG_CLEAR || type == EVLOG_MAPS) {
+			auto *rec = reinterpret_cast<const evlog_mark_t *>(buf + pos);
+
+			if (pos + sizeof(*rec) > size)
+				break;
+			pos += sizeof(*rec);
+
+			if (type == EVLOG_MAPS) {
+				data.maps.clear();
+				nr_maps = rec->arg;
+				continue;
+			}
+
+			finish_segment(data, segment, stack_ids);
+			stack_ids.clear();
+
+			evlog_event_t clear = {};
+			clear.type = EVLOG_CLEAR;
+			clear.time = rec->time;
+			clear.stack_id = STACK_ID_NONE;
+			data.events.push_back(clear);
+			segment = data.events.size();
+		}
+		else if (type == EVLOG_MAP) {
+			auto *rec = reinterpret_cast<const evlog_map_t *>(buf + pos);
+			size_t len;
+
+			if (pos + sizeof(*rec) > size)
+				break;
+			len = rec->path_len + rec->build_id_len;
+			len = sizeof(*rec) + ((len + 7) & ~7);
+			if (pos + len > size)
+				break;
+
+			if (nr_maps) {
+				const char *str = reinterpret_cast<const char *>(rec + 1);
+				raw_map_t map;
+
+				map.start = rec->start;
+				map.end = rec->end;
+				map.offset = rec->offset;
+				map.path.assign(str, rec->path_len);
+				map.build_id.assign(str + rec->path_len, rec->build_id_len);
+				data.maps.push_back(map);
+				nr_maps--;
+			}
+			pos += len;
+		}
+		else {
+			// records cannot be skipped without knowing the size.
+			break;
+		}
+	}
+
+	finish_segment(data, segment, stack_ids);
+	return true;
+}
+
+bool read_evlog(const char *filename, evlog_data_t &data)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	bool ret = parse_evlog(static_cast<const char *>(p), st.st_size, data);
+
+	munmap(p, st.st_size);
+	return ret;
+}
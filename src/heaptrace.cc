@@ -1,6 +1,7 @@
 /* Copyright (c) 2022 LG Electronics Inc. */
 /* SPDX-License-Identifier: GPL-2.0 */
 #include <argp.h>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -15,6 +16,8 @@
 
 struct opts opts;
 
+FILE *outfp;
+
 // output of --version option (generated by argp runtime)
 const char *argp_program_version = "heaptrace " HEAPTRACE_VERSION;
 
@@ -27,15 +30,42 @@ enum options {
 	OPT_flamegraph,
 	OPT_outfile,
 	OPT_ignore,
+	OPT_async,
+	OPT_sample_rate,
+	OPT_unwind,
+	OPT_raw,
+	OPT_snapshot,
+	OPT_event_log,
+	OPT_allocator,
+	OPT_interval,
+	OPT_filter,
+	OPT_no_signals,
+	OPT_pid,
+	OPT_leak_check,
+	OPT_leak_interval,
 };
 
 static struct argp_option heaptrace_options[] = {
 	{ "help", 'h', nullptr, 0, "Give this help list" },
 	{ "top", OPT_top, "NUM", 0, "Set number of top backtraces to show (default 10)" },
-	{ "sort", 's', "KEYs", 0, "Sort backtraces based on KEYs (size or count)" },
+	{ "sort", 's', "KEYs", 0, "Sort backtraces based on KEYs (size, count, alloc-rate or churn)" },
 	{ "flame-graph", OPT_flamegraph, nullptr, 0, "Print heap trace info in flamegraph format" },
 	{ "outfile", OPT_outfile, "FILE", 0, "Save log messages to this file" },
 	{ "ignore", OPT_ignore, "FILE", 0, "Apply ignore rules from this file" },
+	{ "filter", OPT_filter, "STR", 0, "Show only backtraces including STR" },
+	{ "async", OPT_async, nullptr, 0, "Aggregate allocations in a background thread" },
+	{ "sample-rate", OPT_sample_rate, "BYTES", 0, "Sample one allocation per BYTES on average" },
+	{ "unwind", OPT_unwind, "TYPE", 0, "Unwind stacks with TYPE (backtrace or fp)" },
+	{ "raw", OPT_raw, nullptr, 0, "Dump unsymbolized stacks for 'heaptrace report'" },
+	{ "snapshot", OPT_snapshot, nullptr, 0, "Dump binary snapshots for 'heaptrace report'" },
+	{ "event-log", OPT_event_log, nullptr, 0, "Log every alloc/free event to a binary file" },
+	{ "allocator", OPT_allocator, "LIB", 0, "Preload LIB as the allocator of 'heaptrace replay'" },
+	{ "interval", OPT_interval, "SECONDS", 0, "Dump the stacks that grew every SECONDS" },
+	{ "no-signals", OPT_no_signals, nullptr, 0, "Don't handle signals, use 'heaptrace ctl' only" },
+	{ "pid", OPT_pid, "PID", 0, "Attach to the running process of PID" },
+	{ "leak-check", OPT_leak_check, nullptr, 0, "Report unreachable objects at exit" },
+	{ "leak-interval", OPT_leak_interval, "SECONDS", 0,
+	  "Check leaks in the background every SECONDS" },
 	{ nullptr }
 };
 
@@ -68,6 +98,69 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 		opts->ignore = arg;
 		break;
 
+	case OPT_filter:
+		opts->filter = arg;
+		break;
+
+	case OPT_no_signals:
+		opts->no_signals = true;
+		break;
+
+	case OPT_pid:
+		opts->pid = std::stol(arg);
+		if (opts->pid <= 0)
+			argp_error(state, "invalid pid: %s", arg);
+		break;
+
+	case OPT_leak_check:
+		opts->leak_check = true;
+		break;
+
+	case OPT_async:
+		opts->async = true;
+		break;
+
+	case OPT_sample_rate:
+		opts->sample_rate = std::stoull(arg);
+		break;
+
+	case OPT_unwind:
+		if (!strcmp(arg, "fp"))
+			opts->unwinder = UNWIND_FP;
+		else if (!strcmp(arg, "backtrace"))
+			opts->unwinder = UNWIND_BACKTRACE;
+		else
+			argp_error(state, "unknown unwinder: %s", arg);
+		break;
+
+	case OPT_raw:
+		opts->raw = true;
+		break;
+
+	case OPT_snapshot:
+		opts->snapshot = true;
+		break;
+
+	case OPT_event_log:
+		opts->event_log = true;
+		break;
+
+	case OPT_allocator:
+		opts->allocator = arg;
+		break;
+
+	case OPT_interval:
+		opts->interval = std::stod(arg);
+		if (opts->interval <= 0)
+			argp_error(state, "invalid interval: %s", arg);
+		break;
+
+	case OPT_leak_interval:
+		opts->leak_interval = std::stod(arg);
+		if (opts->leak_interval <= 0)
+			argp_error(state, "invalid leak interval: %s", arg);
+		break;
+
 	case ARGP_KEY_ARG:
 		if (state->arg_num)
 			return ARGP_ERR_UNKNOWN;
@@ -87,7 +180,8 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 
 	case ARGP_KEY_NO_ARGS:
 	case ARGP_KEY_END:
-		if (state->arg_num < 1)
+		// no program is needed to attach.
+		if (state->arg_num < 1 && !opts->pid)
 			argp_usage(state);
 		break;
 
@@ -102,14 +196,13 @@ static void init_options(int argc, char *argv[])
 	struct argp argp = {
 		heaptrace_options,
 		parse_option,
-		"[<program>]",
+		"[<program>]\n--pid=PID\nreport [<file>]\nreplay [<file>]\nctl <pid> [dump|stats|clear|leaks]",
 		"heaptrace -- collects and reports heap allocated memory",
 	};
 
-	// set default option values
-	// TODO: create constexpr variables instead of default magic values.
-	opts.top = 10;
-	opts.sort_keys = "size";
+	// 0 means --top is not given, so that the traced process can use its own
+	// for ctl and attach.
+	opts.top = 0;
 	opts.flamegraph = false;
 
 	argp_parse(&argp, argc, argv, ARGP_IN_ORDER, nullptr, &opts);
@@ -132,25 +225,99 @@ static void setup_child_environ(struct opts *opts, int argc, char *argv[])
 
 	// ----- additional option processing -----
 
-	snprintf(buf, sizeof(buf), "%d", opts->top);
-	setenv("HEAPTRACE_NUM_TOP_BACKTRACE", buf, 1);
+	// pass only the options given, libheaptrace.so has the same defaults.
+	if (opts->top) {
+		snprintf(buf, sizeof(buf), "%d", opts->top);
+		setenv("HEAPTRACE_NUM_TOP_BACKTRACE", buf, 1);
+	}
 
-	setenv("HEAPTRACE_SORT_KEYS", opts->sort_keys, 1);
+	if (opts->sort_keys)
+		setenv("HEAPTRACE_SORT_KEYS", opts->sort_keys, 1);
 
-	snprintf(buf, sizeof(buf), "%d", opts->flamegraph);
-	setenv("HEAPTRACE_FLAME_GRAPH", buf, 1);
+	if (opts->flamegraph)
+		setenv("HEAPTRACE_FLAME_GRAPH", "1", 1);
 
 	if (opts->outfile)
 		setenv("HEAPTRACE_OUTFILE", opts->outfile, 1);
 
 	if (opts->ignore)
 		setenv("HEAPTRACE_IGNORE", opts->ignore, 1);
+
+	if (opts->filter)
+		setenv("HEAPTRACE_FILTER", opts->filter, 1);
+
+	if (opts->no_signals)
+		setenv("HEAPTRACE_NO_SIGNALS", "1", 1);
+
+	if (opts->async)
+		setenv("HEAPTRACE_ASYNC", "1", 1);
+
+	if (opts->sample_rate) {
+		snprintf(buf, sizeof(buf), "%" PRIu64, opts->sample_rate);
+		setenv("HEAPTRACE_SAMPLE_RATE", buf, 1);
+	}
+
+	if (opts->unwinder == UNWIND_FP)
+		setenv("HEAPTRACE_UNWIND", "fp", 1);
+
+	if (opts->raw)
+		setenv("HEAPTRACE_RAW", "1", 1);
+
+	if (opts->snapshot)
+		setenv("HEAPTRACE_SNAPSHOT", "1", 1);
+
+	if (opts->event_log)
+		setenv("HEAPTRACE_EVENT_LOG", "1", 1);
+
+	if (opts->interval) {
+		snprintf(buf, sizeof(buf), "%g", opts->interval);
+		setenv("HEAPTRACE_INTERVAL", buf, 1);
+	}
+
+	if (opts->leak_check)
+		setenv("HEAPTRACE_LEAK_CHECK", "1", 1);
+
+	if (opts->leak_interval) {
+		snprintf(buf, sizeof(buf), "%g", opts->leak_interval);
+		setenv("HEAPTRACE_LEAK_INTERVAL", buf, 1);
+	}
 }
 
 int main(int argc, char *argv[])
 {
+	outfp = stdout;
+
+	// symbolize the raw dump given instead of running a program.
+	if (argc > 1 && !strcmp(argv[1], "report")) {
+		init_options(argc - 1, argv + 1);
+		if (!opts.top)
+			opts.top = DEFAULT_TOP_BACKTRACE;
+		return command_report(&opts);
+	}
+
+	// talk to a traced process.
+	if (argc > 1 && !strcmp(argv[1], "ctl")) {
+		init_options(argc - 1, argv + 1);
+
+		// the command follows the pid if given.
+		int idx = 1 + opts.idx + 1;
+		return command_ctl(&opts, idx < argc ? argv[idx] : "dump");
+	}
+
+	// run the allocations in the event log given.
+	if (argc > 1 && !strcmp(argv[1], "replay")) {
+		init_options(argc - 1, argv + 1);
+		return command_replay(&opts, argv);
+	}
+
 	init_options(argc, argv);
 
+	// trace the running process from now on.
+	if (opts.pid) {
+		setup_child_environ(&opts, 0, nullptr);
+		return command_attach(&opts);
+	}
+
 	// pass only non-heaptrace options to execv()
 	argc -= opts.idx;
 	argv += opts.idx;
@@ -3,6 +3,7 @@
 #ifndef HEAPTRACE_HEAPTRACE_H
 #define HEAPTRACE_HEAPTRACE_H
 
+#include <cstdint>
 #include <cstdio>
 
 extern FILE *outfp;
@@ -31,9 +32,39 @@ extern FILE *outfp;
 struct thread_flags_t {
 	// to protect unexpected recursive malloc calls
 	bool hook_guard;
+
+	// per-thread event buffer in async mode
+	struct eventbuf_t *eventbuf;
+	bool eventbuf_exited;
+
+	// for sampling mode
+	uint64_t bytes_until_sample;
+	uint64_t random_state;
+
+	// stack range for the frame pointer unwinder
+	uintptr_t stack_lo;
+	uintptr_t stack_hi;
+
+	// for the event log
+	uint32_t tid;
+	bool in_realloc;
+	struct evlog_buf_t *evlog_buf;
+	bool evlog_exited;
+
+	// the object being moved by realloc, which is not in the addrmap until
+	// it's recorded again.  The leak check scans it as a root.
+	void *realloc_ptr;
 };
 extern thread_local struct thread_flags_t thread_flags;
 
+// number of the top backtraces to show if --top is not given
+#define DEFAULT_TOP_BACKTRACE 10
+
+enum unwinder {
+	UNWIND_BACKTRACE,
+	UNWIND_FP,
+};
+
 struct opts {
 	int idx;
 	char *exename;
@@ -43,8 +74,35 @@ struct opts {
 	bool flamegraph;
 	char *outfile;
 	char *ignore;
+	char *filter;
+	bool no_signals;
+	bool async;
+	uint64_t sample_rate;
+	bool addr_filter;
+	enum unwinder unwinder;
+	bool raw;
+	bool snapshot;
+	bool event_log;
+	char *allocator;
+	double interval;
+	long pid;
+	bool attach;
+	bool leak_check;
+	double leak_interval;
 };
 
 extern opts opts;
 
+// symbolizes the raw dumps in opts->exename for 'heaptrace report'
+int command_report(struct opts *opts);
+
+// replays the event log in opts->exename for 'heaptrace replay'
+int command_replay(struct opts *opts, char *argv[]);
+
+// loads libheaptrace.so into the running process of opts->pid
+int command_attach(struct opts *opts);
+
+// sends a request to the traced process of pid in opts->exename
+int command_ctl(struct opts *opts, const char *cmd);
+
 #endif /* HEAPTRACE_HEAPTRACE_H */
@@ -0,0 +1,165 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstdint>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "heaptrace.h"
+#include "ignore.h"
+
+#define AC_NONE UINT32_MAX
+
+// Aho-Corasick automaton of the rules.  The node 0 is the root.
+class ignore_matcher_t {
+public:
+	explicit ignore_matcher_t(const char *filename);
+
+	const std::vector<std::string> &rules(void) const
+	{
+		return patterns;
+	}
+
+	bool match(const char *text, size_t len) const;
+
+private:
+	struct node_t {
+		// sorted by the character
+		std::vector<std::pair<unsigned char, uint32_t>> next;
+		uint32_t fail;
+		// any rule ends here or at one of its suffixes.
+		bool out;
+	};
+
+	uint32_t child(uint32_t n, unsigned char c) const;
+	void add(const std::string &pattern);
+	void build(void);
+
+	std::vector<std::string> patterns;
+	std::vector<node_t> nodes;
+};
+
+ignore_matcher_t::ignore_matcher_t(const char *filename)
+	: nodes(1, node_t{ {}, 0, false })
+{
+	if (!filename)
+		return;
+
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		pr_out("Failed to open file %s\n", filename);
+		return;
+	}
+
+	std::string line;
+	while (std::getline(file, line))
+		add(line);
+	build();
+}
+
+uint32_t ignore_matcher_t::child(uint32_t n, unsigned char c) const
+{
+	const auto &next = nodes[n].next;
+	auto it = std::lower_bound(
+		next.begin(), next.end(), c,
+		[](const std::pair<unsigned char, uint32_t> &e, unsigned char v) { return e.first < v; });
+
+	return (it != next.end() && it->first == c) ? it->second : AC_NONE;
+}
+
+void ignore_matcher_t::add(const std::string &pattern)
+{
+	uint32_t n = 0;
+
+	patterns.push_back(pattern);
+	for (unsigned char c : pattern) {
+		uint32_t next = child(n, c);
+
+		if (next == AC_NONE) {
+			next = nodes.size();
+			nodes.push_back(node_t{ {}, 0, false });
+
+			auto &edges = nodes[n].next;
+			auto pos = std::upper_bound(
+				edges.begin(), edges.end(), c,
+				[](unsigned char v, const std::pair<unsigned char, uint32_t> &e) {
+					return v < e.first;
+				});
+			edges.insert(pos, { c, next });
+		}
+		n = next;
+	}
+	// an empty rule matches any text like the substring search did.
+	nodes[n].out = true;
+}
+
+// sets the failure links in the breadth first order.
+void ignore_matcher_t::build(void)
+{
+	std::deque<uint32_t> queue;
+
+	for (const auto &e : nodes[0].next)
+		queue.push_back(e.second);
+
+	while (!queue.empty()) {
+		uint32_t n = queue.front();
+		queue.pop_front();
+
+		for (const auto &e : nodes[n].next) {
+			uint32_t f = nodes[n].fail;
+			uint32_t next;
+
+			while ((next = child(f, e.first)) == AC_NONE && f != 0)
+				f = nodes[f].fail;
+
+			nodes[e.second].fail = next != AC_NONE ? next : 0;
+			nodes[e.second].out |= nodes[nodes[e.second].fail].out;
+			queue.push_back(e.second);
+		}
+	}
+}
+
+bool ignore_matcher_t::match(const char *text, size_t len) const
+{
+	uint32_t n = 0;
+
+	if (patterns.empty())
+		return false;
+	if (nodes[0].out)
+		return true;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = text[i];
+		uint32_t next;
+
+		while ((next = child(n, c)) == AC_NONE && n != 0)
+			n = nodes[n].fail;
+
+		n = next != AC_NONE ? next : 0;
+		if (nodes[n].out)
+			return true;
+	}
+	return false;
+}
+
+static const ignore_matcher_t &get_ignore_matcher(void)
+{
+	// the rules don't change, and it's built only once even for many threads.
+	static const ignore_matcher_t matcher(opts.ignore);
+
+	return matcher;
+}
+
+const std::vector<std::string> &get_ignore_rules(void)
+{
+	return get_ignore_matcher().rules();
+}
+
+bool match_ignore_rules(const char *text, size_t len)
+{
+	return get_ignore_matcher().match(text, len);
+}
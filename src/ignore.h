@@ -0,0 +1,20 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_IGNORE_H
+#define HEAPTRACE_IGNORE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// The ignore rules are read from the file of opts.ignore, one per line.  A
+// backtrace is ignored if its text contains any of the rules.  All the rules
+// are matched at once with an Aho-Corasick automaton.
+
+// Returns the ignore rules, they're loaded at the first call.
+const std::vector<std::string> &get_ignore_rules(void);
+
+// Returns true if the text contains any of the ignore rules.
+bool match_ignore_rules(const char *text, size_t len);
+
+#endif /* HEAPTRACE_IGNORE_H */
@@ -0,0 +1,308 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <cerrno>
+#include <cstring>
+#include <elf.h>
+#include <link.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "compiler.h"
+#include "heaptrace.h"
+#include "ignore.h"
+#include "ignoremap.h"
+#include "symbol.h"
+#include "utils.h"
+
+#if __WORDSIZE == 64
+#define SYM_TYPE(info) ELF64_ST_TYPE(info)
+#else
+#define SYM_TYPE(info) ELF32_ST_TYPE(info)
+#endif
+
+// A frame out of the known objects, e.g. in JIT code, would count the loaded
+// objects on every allocation.  They're counted at most once in this period.
+#define IGNOREMAP_CHECK_NS (100 * 1000 * 1000)
+
+struct range_t {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+using range_vec_t = std::vector<range_t>;
+
+struct ignoremap_t {
+	// sorted and disjoint
+	range_vec_t ignored;
+	// the executable segments of the objects loaded at the build
+	range_vec_t objects;
+	unsigned long long dl_changes;
+};
+
+// The old maps are kept until fini as the hooks of other threads might be
+// using them, but they're rebuilt only when the loaded objects change.
+static std::atomic<const ignoremap_t *> ignoremap;
+static std::vector<const ignoremap_t *> retired_maps;
+static std::mutex ignoremap_lock;
+
+// when the loaded objects were counted last time
+static std::atomic<uint64_t> ignoremap_checked;
+
+struct ignoremap_ctx_t {
+	range_vec_t matched;
+	range_vec_t unmatched;
+	range_vec_t files;
+	range_vec_t objects;
+};
+
+// returns the number of the dynamic symbols from the GNU hash table.
+static size_t gnu_hash_nr_syms(const uint32_t *hash)
+{
+	uint32_t nbuckets = hash[0];
+	uint32_t symoffset = hash[1];
+	uint32_t bloom_size = hash[2];
+	const uint32_t *buckets = hash + 4 + bloom_size * (sizeof(ElfW(Addr)) / sizeof(uint32_t));
+	const uint32_t *chain = buckets + nbuckets;
+	uint32_t last = 0;
+
+	for (uint32_t i = 0; i < nbuckets; i++)
+		last = std::max(last, buckets[i]);
+	if (last < symoffset)
+		return symoffset;
+
+	// the last entry of each chain has the lowest bit set.
+	while (!(chain[last - symoffset] & 1))
+		last++;
+	return last + 1;
+}
+
+static int collect_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	auto *ctx = static_cast<ignoremap_ctx_t *>(data);
+	ElfW(Addr) base = info->dlpi_addr;
+	const ElfW(Dyn) *dyn = nullptr;
+
+	// dladdr() shows the name of the program as it's invoked.
+	const char *name = info->dlpi_name[0] ? info->dlpi_name : program_invocation_name;
+	bool file_matched = match_ignore_rules(name, strlen(name));
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+
+		if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+			range_t r = { base + phdr->p_vaddr, base + phdr->p_vaddr + phdr->p_memsz };
+
+			ctx->objects.push_back(r);
+			if (file_matched)
+				ctx->files.push_back(r);
+		}
+		else if (phdr->p_type == PT_DYNAMIC) {
+			dyn = (const ElfW(Dyn) *)(base + phdr->p_vaddr);
+		}
+	}
+	if (!dyn || file_matched)
+		return 0;
+
+	const ElfW(Sym) *symtab = nullptr;
+	const char *strtab = nullptr;
+	const uint32_t *hash = nullptr;
+	const uint32_t *gnu_hash = nullptr;
+
+	for (; dyn->d_tag != DT_NULL; dyn++) {
+		ElfW(Addr) ptr = dyn->d_un.d_ptr;
+
+		// the dynamic linker relocates them in place on most architectures.
+		if (ptr < base)
+			ptr += base;
+
+		switch (dyn->d_tag) {
+		case DT_SYMTAB:
+			symtab = (const ElfW(Sym) *)ptr;
+			break;
+		case DT_STRTAB:
+			strtab = (const char *)ptr;
+			break;
+		case DT_HASH:
+			hash = (const uint32_t *)ptr;
+			break;
+		case DT_GNU_HASH:
+			gnu_hash = (const uint32_t *)ptr;
+			break;
+		}
+	}
+	if (!symtab || !strtab || (!hash && !gnu_hash))
+		return 0;
+
+	size_t nr_syms = hash ? hash[1] : gnu_hash_nr_syms(gnu_hash);
+	for (size_t i = 1; i < nr_syms; i++) {
+		const ElfW(Sym) *sym = &symtab[i];
+
+		if (sym->st_shndx == SHN_UNDEF || sym->st_shndx == SHN_ABS || sym->st_size == 0 ||
+		    SYM_TYPE(sym->st_info) == STT_TLS)
+			continue;
+
+		// match the name as it's printed in the dump.
+		std::string sname = demangle_symbol(strtab + sym->st_name);
+		range_t r = { base + sym->st_value, base + sym->st_value + sym->st_size };
+
+		if (match_ignore_rules(sname.data(), sname.size()))
+			ctx->matched.push_back(r);
+		else
+			ctx->unmatched.push_back(r);
+	}
+	return 0;
+}
+
+// sorts the ranges and merges the overlapping ones.
+static void merge_ranges(range_vec_t &ranges)
+{
+	size_t n = 0;
+
+	std::sort(ranges.begin(), ranges.end(),
+		  [](const range_t &r1, const range_t &r2) { return r1.start < r2.start; });
+
+	for (const auto &r : ranges) {
+		if (n > 0 && r.start <= ranges[n - 1].end)
+			ranges[n - 1].end = std::max(ranges[n - 1].end, r.end);
+		else
+			ranges[n++] = r;
+	}
+	ranges.resize(n);
+}
+
+// returns the parts of a that are not in b, both are merged.
+static range_vec_t subtract_ranges(const range_vec_t &a, const range_vec_t &b)
+{
+	range_vec_t result;
+	size_t j = 0;
+
+	for (range_t r : a) {
+		while (j < b.size() && b[j].end <= r.start)
+			j++;
+
+		for (size_t k = j; k < b.size() && b[k].start < r.end; k++) {
+			if (b[k].start > r.start)
+				result.push_back({ r.start, b[k].start });
+			r.start = std::max(r.start, b[k].end);
+		}
+		if (r.start < r.end)
+			result.push_back(r);
+	}
+	return result;
+}
+
+static bool in_ranges(const range_vec_t &ranges, uintptr_t addr)
+{
+	auto it = std::upper_bound(ranges.begin(), ranges.end(), addr,
+				   [](uintptr_t a, const range_t &r) { return a < r.start; });
+
+	return it != ranges.begin() && addr < (--it)->end;
+}
+
+static const ignoremap_t *build_ignoremap(unsigned long long dl_changes)
+{
+	ignoremap_ctx_t ctx;
+	auto *map = new ignoremap_t;
+
+	dl_iterate_phdr(collect_object, &ctx);
+
+	merge_ranges(ctx.matched);
+	merge_ranges(ctx.unmatched);
+	merge_ranges(ctx.objects);
+
+	// dladdr() might show the other symbol where they overlap.
+	map->ignored = subtract_ranges(ctx.matched, ctx.unmatched);
+	map->ignored.insert(map->ignored.end(), ctx.files.begin(), ctx.files.end());
+	merge_ranges(map->ignored);
+
+	map->objects = std::move(ctx.objects);
+	map->dl_changes = dl_changes;
+
+	pr_dbg("ignore rules compiled into %zd ranges\n", map->ignored.size());
+	return map;
+}
+
+void ignoremap_init(void)
+{
+	if (get_ignore_rules().empty())
+		return;
+
+	ignoremap.store(build_ignoremap(count_dl_changes()), std::memory_order_release);
+}
+
+void ignoremap_fini(void)
+{
+	std::lock_guard<std::mutex> lock(ignoremap_lock);
+
+	for (const auto *map : retired_maps)
+		delete map;
+	retired_maps.clear();
+}
+
+// returns true if it's rebuilt.  Unless forced, the loaded objects are not
+// counted again until IGNOREMAP_CHECK_NS passes.
+static bool refresh_ignoremap(bool force)
+{
+	uint64_t now = utils::get_time_ns();
+
+	if (!force && now - ignoremap_checked.load(std::memory_order_relaxed) < IGNOREMAP_CHECK_NS)
+		return false;
+
+	// another thread is rebuilding it.
+	std::unique_lock<std::mutex> lock(ignoremap_lock, std::try_to_lock);
+	if (!lock.owns_lock())
+		return false;
+
+	const ignoremap_t *map = ignoremap.load(std::memory_order_acquire);
+	if (!map)
+		return false;
+
+	ignoremap_checked.store(now, std::memory_order_relaxed);
+
+	unsigned long long changes = count_dl_changes();
+	if (map->dl_changes == changes)
+		return false;
+
+	ignoremap.store(build_ignoremap(changes), std::memory_order_release);
+	retired_maps.push_back(map);
+	return true;
+}
+
+void ignoremap_sync(void)
+{
+	refresh_ignoremap(true);
+}
+
+bool ignoremap_match(const stack_trace_t &stack_trace, int nptrs)
+{
+	const ignoremap_t *map = ignoremap.load(std::memory_order_acquire);
+
+	if (likely(!map))
+		return false;
+
+	for (int retry = 0; retry < 2; retry++) {
+		bool unknown = false;
+
+		for (int i = 0; i < nptrs; i++) {
+			auto addr = (uintptr_t)stack_trace[i];
+
+			if (in_ranges(map->ignored, addr))
+				return true;
+			if (!in_ranges(map->objects, addr))
+				unknown = true;
+		}
+
+		// the frame might be in an object loaded later by dlopen().
+		if (likely(!unknown) || !refresh_ignoremap(false))
+			break;
+		map = ignoremap.load(std::memory_order_acquire);
+	}
+	return false;
+}
@@ -0,0 +1,30 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_IGNOREMAP_H
+#define HEAPTRACE_IGNOREMAP_H
+
+#include "stacktrace.h"
+
+// The ignore rules are compiled into the address ranges of the loaded objects
+// so that the allocations from the ignored backtraces are not even recorded.
+// A range is ignored if the name of the object or of every dynamic symbol that
+// covers it contains a rule, as the text of such a frame in a dump contains the
+// rule as well.  The other rules, e.g. the ones for the addresses, are still
+// checked when the backtraces are printed.
+//
+// The ranges are rebuilt when a frame is out of the objects known so far, or
+// before a dump if any object is loaded or unloaded.  The former checks the
+// loaded objects at most every 100ms.
+
+void ignoremap_init(void);
+
+// Frees the maps replaced by the rebuilds.
+void ignoremap_fini(void);
+
+// Returns true if any frame of the stack trace is in the ignored ranges.
+bool ignoremap_match(const stack_trace_t &stack_trace, int nptrs);
+
+// Rebuilds the ranges if any object is loaded or unloaded since the last build.
+void ignoremap_sync(void);
+
+#endif /* HEAPTRACE_IGNOREMAP_H */
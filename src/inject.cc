@@ -0,0 +1,274 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "elffile.h"
+#include "heaptrace.h"
+#include "utils.h"
+
+extern char **environ;
+
+// stack space left untouched below the stack pointer, bigger than the red zone.
+#define INJECT_STACK_GAP 4096
+
+// a mapping of the libc in the target
+struct libc_map_t {
+	uintptr_t start;
+	uint64_t offset;
+	std::string path;
+};
+
+// addresses of the libc functions called in the target
+struct libc_funcs_t {
+	uintptr_t dlopen;
+	uintptr_t setenv;
+	uintptr_t unsetenv;
+};
+
+static bool find_libc(long pid, libc_map_t &map)
+{
+	std::ifstream fs(utils::asprintf("/proc/%ld/maps", pid));
+	std::string line;
+
+	while (std::getline(fs, line)) {
+		unsigned long start, end, offset;
+		char perms[8];
+		int pos = 0;
+
+		if (sscanf(line.c_str(), "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offset,
+			   &pos) < 4 || pos == 0)
+			continue;
+
+		std::string path = line.substr(pos);
+		size_t base = path.rfind('/');
+		std::string name = path.substr(base == std::string::npos ? 0 : base + 1);
+
+		// libc.so.6 or libc-2.xx.so, the first mapping has the lowest offset.
+		if (name.compare(0, 7, "libc.so") && name.compare(0, 5, "libc-"))
+			continue;
+
+		map = { start, offset, path };
+		return true;
+	}
+	return false;
+}
+
+// Finds the address of a function of the libc in the target from the file.
+static uintptr_t find_libc_func(const libc_map_t &map, const elf_file_t &elf, const char *name)
+{
+	const elf_symbol_t *sym = elf.lookup_symbol(name);
+	uint64_t vaddr;
+
+	if (!sym || !elf.offset_to_vaddr(map.offset, &vaddr))
+		return 0;
+	return map.start - vaddr + sym->addr;
+}
+
+#if defined(__x86_64__)
+
+static bool get_regs(long pid, struct user_regs_struct &regs)
+{
+	return ptrace(PTRACE_GETREGS, pid, nullptr, &regs) == 0;
+}
+
+static bool set_regs(long pid, const struct user_regs_struct &regs)
+{
+	return ptrace(PTRACE_SETREGS, pid, nullptr, &regs) == 0;
+}
+
+static bool write_remote(long pid, uintptr_t addr, const void *data, size_t size)
+{
+	auto *src = static_cast<const char *>(data);
+
+	for (size_t i = 0; i < size; i += sizeof(long)) {
+		long word = 0;
+
+		// keep the bytes after the data in the last word.
+		if (size - i < sizeof(long)) {
+			errno = 0;
+			word = ptrace(PTRACE_PEEKDATA, pid, addr + i, nullptr);
+			if (errno)
+				return false;
+		}
+		memcpy(&word, src + i, std::min(sizeof(long), size - i));
+		if (ptrace(PTRACE_POKEDATA, pid, addr + i, word) < 0)
+			return false;
+	}
+	return true;
+}
+
+// Calls func(args...) in the stopped thread with the strings copied onto its
+// stack.  The function returns to address 0, which stops it with SIGSEGV.
+static bool call_remote(long pid, const struct user_regs_struct &saved, uintptr_t func,
+			const std::vector<std::string> &strs, long arg, long *ret)
+{
+	struct user_regs_struct regs = saved;
+	uintptr_t sp = saved.rsp - INJECT_STACK_GAP;
+	uintptr_t args[3] = {};
+	uintptr_t zero = 0;
+	int status;
+
+	for (size_t i = 0; i < strs.size() && i < 2; i++) {
+		sp -= strs[i].size() + 1;
+		if (!write_remote(pid, sp, strs[i].c_str(), strs[i].size() + 1))
+			return false;
+		args[i] = sp;
+	}
+	args[strs.size()] = arg;
+
+	// the stack should be aligned to 16 bytes at the call.
+	sp = (sp & ~15UL) - sizeof(zero);
+	if (!write_remote(pid, sp, &zero, sizeof(zero)))
+		return false;
+
+	regs.rsp = sp;
+	regs.rip = func;
+	regs.rdi = args[0];
+	regs.rsi = args[1];
+	regs.rdx = args[2];
+	regs.rax = 0;
+	// don't restart the interrupted system call.
+	regs.orig_rax = -1;
+
+	if (!set_regs(pid, regs) || ptrace(PTRACE_CONT, pid, nullptr, nullptr) < 0)
+		return false;
+
+	while (true) {
+		if (waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status))
+			return false;
+
+		if (WSTOPSIG(status) == SIGSEGV && get_regs(pid, regs) && regs.rip == 0)
+			break;
+
+		// deliver other signals to the program as usual.
+		int sig = WSTOPSIG(status) == SIGSTOP ? 0 : WSTOPSIG(status);
+		if (ptrace(PTRACE_CONT, pid, nullptr, sig) < 0)
+			return false;
+	}
+
+	*ret = regs.rax;
+	return true;
+}
+
+static bool inject(long pid, const libc_funcs_t &funcs, const std::vector<std::string> &envs,
+		   const std::string &libpath)
+{
+	struct user_regs_struct saved;
+	std::vector<std::string> names;
+	bool ok = true;
+	long ret;
+
+	if (!get_regs(pid, saved))
+		return false;
+
+	// pass the options with the environment as the launcher does.
+	for (const auto &env : envs) {
+		size_t pos = env.find('=');
+		std::vector<std::string> strs = { env.substr(0, pos), env.substr(pos + 1) };
+
+		if (!call_remote(pid, saved, funcs.setenv, strs, 1, &ret) || ret != 0) {
+			fprintf(stderr, "heaptrace: failed to set %s\n", strs[0].c_str());
+			ok = false;
+			break;
+		}
+		names.push_back(strs[0]);
+	}
+
+	if (ok && (!call_remote(pid, saved, funcs.dlopen, { libpath }, RTLD_NOW, &ret) || !ret)) {
+		fprintf(stderr, "heaptrace: failed to load %s\n", libpath.c_str());
+		ok = false;
+	}
+
+	// don't leave the options to the program and its children.
+	for (size_t i = 0; !ok && i < names.size(); i++) {
+		if (!call_remote(pid, saved, funcs.unsetenv, { names[i] }, 0, &ret) || ret != 0)
+			fprintf(stderr, "heaptrace: failed to unset %s\n", names[i].c_str());
+	}
+
+	return set_regs(pid, saved) && ok;
+}
+
+#else
+
+static bool inject(long pid, const libc_funcs_t &funcs, const std::vector<std::string> &envs,
+		   const std::string &libpath)
+{
+	fprintf(stderr, "heaptrace: --pid is not supported on this architecture\n");
+	return false;
+}
+
+#endif
+
+int command_attach(struct opts *opts)
+{
+	long pid = opts->pid;
+	std::vector<std::string> envs;
+	std::string libpath = "libheaptrace.so";
+	char path[PATH_MAX];
+	libc_map_t libc;
+	elf_file_t elf;
+	int status;
+
+	// the target has a different working directory.
+	if (!access("libheaptrace.so", X_OK) && realpath("libheaptrace.so", path))
+		libpath = path;
+
+	for (char **env = environ; *env; env++) {
+		if (!strncmp(*env, "HEAPTRACE_", 10))
+			envs.push_back(*env);
+	}
+	envs.push_back("HEAPTRACE_ATTACH=1");
+
+	if (!find_libc(pid, libc) || !elf.load(utils::asprintf("/proc/%ld/root%s", pid,
+								 libc.path.c_str()))) {
+		fprintf(stderr, "heaptrace: cannot find the libc of %ld\n", pid);
+		return -1;
+	}
+
+	// dlopen() is in the libc since glibc 2.34.
+	libc_funcs_t funcs;
+	funcs.dlopen = find_libc_func(libc, elf, "dlopen");
+	if (!funcs.dlopen)
+		funcs.dlopen = find_libc_func(libc, elf, "__libc_dlopen_mode");
+	funcs.setenv = find_libc_func(libc, elf, "setenv");
+	funcs.unsetenv = find_libc_func(libc, elf, "unsetenv");
+	if (!funcs.dlopen || !funcs.setenv || !funcs.unsetenv) {
+		fprintf(stderr, "heaptrace: cannot find dlopen() in %s\n", libc.path.c_str());
+		return -1;
+	}
+
+	if (ptrace(PTRACE_ATTACH, pid, nullptr, nullptr) < 0) {
+		fprintf(stderr, "heaptrace: cannot attach to %ld: %s\n", pid, strerror(errno));
+		return -1;
+	}
+	if (waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status)) {
+		fprintf(stderr, "heaptrace: cannot stop %ld\n", pid);
+		return -1;
+	}
+
+	bool ok = inject(pid, funcs, envs, libpath);
+
+	ptrace(PTRACE_DETACH, pid, nullptr, nullptr);
+
+	if (!ok)
+		return -1;
+
+	printf("[heaptrace] attached to %ld, use 'heaptrace ctl %ld' to dump\n", pid, pid);
+	return 0;
+}
@@ -0,0 +1,1295 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <linux/futex.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compiler.h"
+#include "heaptrace.h"
+#include "leakcheck.h"
+#include "mmaptrace.h"
+
+#define NSEC_PER_SEC (1000 * 1000 * 1000LL)
+
+// limits of the tids, the threads and the mappings of a process
+#define LEAK_MAX_TID (1 << 22)
+#define LEAK_MAX_THREADS 65536
+#define LEAK_MAX_MAPS 65536
+#define LEAK_MAX_ROOTS (1 << 20)
+#define LEAK_MAPS_BUF_SIZE (16 << 20)
+
+#define LEAK_MAX_WORKERS 16
+
+#define LEAK_TRACER_STACK_SIZE (64 * 1024)
+
+// The incremental scan sleeps LEAK_SLICE_IDLE_NS after each LEAK_SLICE_NS of
+// work so that it takes a small share of a CPU.
+#define LEAK_SLICE_NS (1000 * 1000)
+#define LEAK_SLICE_IDLE_NS (3 * LEAK_SLICE_NS)
+
+// number of objects scanned between the checks of the logs
+#define LEAK_LOG_CHECK_INTERVAL 256
+
+// the roots are scanned in chunks of this size by the workers.
+#define LEAK_CHUNK_SIZE (64 * 1024)
+
+// number of objects a worker takes from the queue at once
+#define LEAK_BATCH 16
+
+// struct pthread and the surplus of the static TLS, which are next to the
+// TLS blocks of the loaded objects.
+#define LEAK_TLS_SLACK 8192
+
+#define BITS_PER_WORD 64
+
+#if defined(__x86_64__)
+#define REG_SP(regs) (regs).rsp
+#elif defined(__i386__)
+#define REG_SP(regs) (regs).esp
+#elif defined(__aarch64__)
+#define REG_SP(regs) (regs).sp
+#endif
+
+// states of the tracer, which stops the threads for the scan
+#define TRACER_IDLE 0
+#define TRACER_STOP 1
+#define TRACER_STOPPED 2
+#define TRACER_FAILED 3
+#define TRACER_RESUME 4
+
+struct leak_range_t {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+// a readable mapping in /proc/self/maps
+struct leak_map_t {
+	uintptr_t start;
+	uintptr_t end;
+	bool writable;
+};
+
+// where the registers and the stack of a stopped thread are
+struct stopped_thread_t {
+	uint32_t tid;
+	// the pending signal it stopped for, which is delivered on detach.
+	int sig;
+	uintptr_t sp;
+	uintptr_t tp;
+#ifdef REG_SP
+	struct user_regs_struct regs;
+#endif
+};
+
+typedef void (*leak_job_t)(int idx);
+
+// The buffers used while the threads are stopped are allocated once and
+// reused by the following scans.
+static stopped_thread_t *stopped_threads;
+static uint64_t *attached_tids;
+static char *tracer_stack;
+static char *maps_buf;
+static leak_map_t *maps;
+static leak_range_t *roots;
+// the first chunk of each root, and the number of all chunks at the end
+static uint64_t *root_chunks;
+
+static size_t nr_maps;
+static size_t nr_roots;
+static uint64_t nr_chunks;
+
+// The tracer is a child task sharing the memory, as a thread can't trace
+// the threads of its own process.  It attaches to the threads, which stay in
+// the ptrace stop until it detaches, so no signal is sent to the program and
+// no system call of it fails with EINTR.  It only runs the system calls and
+// the code of this file, and tracer_state is the futex word to talk to it.
+static uint32_t tracer_state;
+static pid_t tracer_pid;
+static char task_path[32];
+static uint32_t nr_stopped;
+static uint32_t nr_failed;
+// the incremental scan lets each thread go right after taking its registers.
+static bool tracer_hold;
+static uint64_t max_pause;
+
+// offset of thread_flags.realloc_ptr from the thread pointer
+static uintptr_t realloc_ptr_offset;
+
+// the objects sorted by the address, and the other buffer for the merge
+static leak_object_t *objects;
+static leak_object_t *merged;
+static size_t nr_objects;
+static size_t max_objects;
+static uintptr_t objects_lo;
+static uintptr_t objects_hi;
+
+// objects to be scanned, each is pushed at most twice as its state goes up.
+// A slot has the index + 1 of the object once it's pushed.
+static uint32_t *queue;
+static std::atomic<uint64_t> queue_head;
+static std::atomic<uint64_t> queue_tail;
+static std::atomic<uint64_t> next_chunk;
+static std::atomic<uint32_t> nr_active;
+
+// the roots collected before the threads are stopped
+static std::vector<leak_range_t> segment_roots;
+static std::vector<leak_range_t> mmap_roots;
+// max distance from the thread pointer to the end of the TLS
+static uintptr_t tls_window;
+
+// set while a scan is running, as the scans share the buffers.
+static std::atomic<bool> scan_busy;
+
+// the incremental scan copies the memory to read into copy_buf first.
+static bool incremental;
+static char *copy_buf;
+static pid_t scan_pid;
+static long page_size;
+static leak_log_t *logs;
+static uint64_t slice_time;
+// the memory cannot be read, or the program is exiting.
+static bool scan_failed;
+
+// the background thread of the incremental scan
+static pthread_t monitor;
+static bool monitor_started;
+static uint32_t monitor_stopping;
+
+std::atomic<bool> leak_monitor_forked;
+std::mutex leak_monitor_lock;
+
+// the worker 0 is the thread running the scan.
+static pthread_t workers[LEAK_MAX_WORKERS];
+static uint32_t worker_tids[LEAK_MAX_WORKERS];
+static int nr_workers;
+static leak_job_t worker_job;
+static uint32_t job_seq;
+static uint32_t nr_done;
+// number of the sorted slices in each run while merging them
+static int merge_width;
+
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, nullptr, nullptr, 0);
+}
+
+static void futex_wait_ns(uint32_t *uaddr, uint32_t val, uint64_t nsec)
+{
+	struct timespec ts = { (time_t)(nsec / NSEC_PER_SEC), (long)(nsec % NSEC_PER_SEC) };
+
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &ts, nullptr, 0);
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// returns the thread pointer of this thread in the same way as
+// get_thread_pointer() does for the stopped ones.
+static uintptr_t thread_pointer(void)
+{
+	uintptr_t tp = 0;
+
+#if defined(__x86_64__)
+	asm volatile("mov %%fs:0, %0" : "=r"(tp));
+#elif defined(__aarch64__)
+	asm volatile("mrs %0, tpidr_el0" : "=r"(tp));
+#endif
+	return tp;
+}
+
+static void *map_buffer(size_t size)
+{
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return p == MAP_FAILED ? nullptr : p;
+}
+
+static void unmap_buffer(void *p, size_t size)
+{
+	if (p)
+		munmap(p, size);
+}
+
+static inline bool test_tid(const uint64_t *bits, uint32_t tid)
+{
+	uint64_t word = __atomic_load_n(&bits[tid / BITS_PER_WORD], __ATOMIC_ACQUIRE);
+
+	return word & (1ULL << (tid % BITS_PER_WORD));
+}
+
+static inline void set_tid(uint64_t *bits, uint32_t tid)
+{
+	__atomic_fetch_or(&bits[tid / BITS_PER_WORD], 1ULL << (tid % BITS_PER_WORD),
+			  __ATOMIC_RELEASE);
+}
+
+static void *leak_worker(void *arg)
+{
+	auto *tfs = &thread_flags;
+	auto idx = (int)(intptr_t)arg;
+	uint32_t seen = 0;
+	sigset_t sigset;
+
+	// the worker never records its own allocations.
+	tfs->hook_guard = true;
+
+	// let the program threads handle the signals.
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+	worker_tids[idx] = syscall(SYS_gettid);
+
+	while (true) {
+		uint32_t seq;
+
+		while ((seq = __atomic_load_n(&job_seq, __ATOMIC_ACQUIRE)) == seen)
+			futex(&job_seq, FUTEX_WAIT_PRIVATE, seen);
+		seen = seq;
+
+		leak_job_t job = worker_job;
+		if (!job)
+			break;
+		job(idx);
+
+		if (__atomic_add_fetch(&nr_done, 1, __ATOMIC_ACQ_REL) == (uint32_t)nr_workers - 1)
+			futex(&nr_done, FUTEX_WAKE_PRIVATE, 1);
+	}
+	return nullptr;
+}
+
+// Runs the job on all the workers including this thread and waits for them.
+// It doesn't allocate so that it can run while the threads are stopped.
+static void run_job(leak_job_t job)
+{
+	uint32_t done;
+
+	worker_job = job;
+	__atomic_store_n(&nr_done, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&job_seq, 1, __ATOMIC_RELEASE);
+	futex(&job_seq, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+	if (job)
+		job(0);
+
+	while ((done = __atomic_load_n(&nr_done, __ATOMIC_ACQUIRE)) != (uint32_t)nr_workers - 1)
+		futex(&nr_done, FUTEX_WAIT_PRIVATE, done);
+}
+
+static void stop_workers(void)
+{
+	worker_job = nullptr;
+	__atomic_add_fetch(&job_seq, 1, __ATOMIC_RELEASE);
+	futex(&job_seq, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+	for (int i = 1; i < nr_workers; i++)
+		pthread_join(workers[i], nullptr);
+	nr_workers = 0;
+}
+
+static void start_workers(unsigned int n)
+{
+	n = std::min(std::max(n, 1U), (unsigned int)LEAK_MAX_WORKERS);
+
+	// the workers of the previous scan are all gone.
+	job_seq = 0;
+	worker_tids[0] = syscall(SYS_gettid);
+	for (nr_workers = 1; nr_workers < (int)n; nr_workers++) {
+		pthread_t *worker = &workers[nr_workers];
+
+		if (pthread_create(worker, nullptr, leak_worker, (void *)(intptr_t)nr_workers) != 0)
+			break;
+		pthread_setname_np(*worker, "heaptrace-leak");
+	}
+
+	// wait until all the workers have their tids.
+	run_job([](int idx) {});
+}
+
+static bool has_addr(const struct dl_phdr_info *info, uintptr_t addr)
+{
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+		if (phdr->p_type == PT_LOAD && start <= addr && addr < start + phdr->p_memsz)
+			return true;
+	}
+	return false;
+}
+
+static int collect_segments(struct dl_phdr_info *info, size_t size, void *data)
+{
+	// heaptrace's own data points to no object of the program.
+	if (has_addr(info, (uintptr_t)leak_scan_prepare))
+		return 0;
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+		// it includes .bss and .data.rel.ro made read-only later.
+		if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W))
+			segment_roots.push_back({ start, start + phdr->p_memsz });
+		else if (phdr->p_type == PT_TLS)
+			tls_window += phdr->p_memsz + phdr->p_align;
+	}
+	return 0;
+}
+
+static bool alloc_buffers(void)
+{
+	if (maps_buf)
+		return true;
+
+	stopped_threads = (stopped_thread_t *)map_buffer(LEAK_MAX_THREADS * sizeof(stopped_thread_t));
+	attached_tids = (uint64_t *)map_buffer(LEAK_MAX_TID / 8);
+	tracer_stack = (char *)map_buffer(LEAK_TRACER_STACK_SIZE);
+	maps = (leak_map_t *)map_buffer(LEAK_MAX_MAPS * sizeof(leak_map_t));
+	roots = (leak_range_t *)map_buffer(LEAK_MAX_ROOTS * sizeof(leak_range_t));
+	root_chunks = (uint64_t *)map_buffer((LEAK_MAX_ROOTS + 1) * sizeof(uint64_t));
+	copy_buf = (char *)map_buffer(LEAK_CHUNK_SIZE);
+	logs = (leak_log_t *)map_buffer(LEAK_MAX_LOGS * sizeof(leak_log_t));
+
+	if (!stopped_threads || !attached_tids || !tracer_stack || !maps || !roots ||
+	    !root_chunks || !copy_buf || !logs)
+		return false;
+
+	// it's the last one to tell if all of them are allocated.
+	maps_buf = (char *)map_buffer(LEAK_MAPS_BUF_SIZE);
+	return maps_buf != nullptr;
+}
+
+bool leak_scan_prepare(bool incr)
+{
+	std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+	struct timespec wait = { 0, LEAK_SLICE_NS };
+
+	while (scan_busy.exchange(true))
+		nanosleep(&wait, nullptr);
+
+#ifndef REG_SP
+	// the registers of the stopped threads are not known.
+	return false;
+#endif
+	if (!alloc_buffers())
+		return false;
+
+	incremental = incr;
+	scan_failed = false;
+	scan_pid = getpid();
+	page_size = sysconf(_SC_PAGESIZE);
+	snprintf(task_path, sizeof(task_path), "/proc/%d/task", scan_pid);
+	realloc_ptr_offset = (uintptr_t)&thread_flags.realloc_ptr - thread_pointer();
+
+	segment_roots.clear();
+	tls_window = LEAK_TLS_SLACK;
+	dl_iterate_phdr(collect_segments, nullptr);
+
+	mmap_roots.clear();
+	collect_mmap_ranges(ranges, PROT_READ | PROT_WRITE);
+	for (const auto &r : ranges)
+		mmap_roots.push_back({ r.first, r.second });
+
+	start_workers(incremental ? 1 : std::thread::hardware_concurrency());
+	slice_time = monotonic_ns();
+	return true;
+}
+
+bool leak_scan_reserve(size_t n)
+{
+	// the queue has the index + 1 of the objects in 32 bits.
+	if (n >= UINT32_MAX / 2)
+		return false;
+
+	max_objects = std::max<size_t>(n, 1);
+	nr_objects = 0;
+	objects = (leak_object_t *)map_buffer(max_objects * sizeof(leak_object_t));
+	merged = (leak_object_t *)map_buffer(max_objects * sizeof(leak_object_t));
+	queue = (uint32_t *)map_buffer(2 * max_objects * sizeof(uint32_t));
+
+	return objects && merged && queue;
+}
+
+bool leak_scan_add(addr_t addr, const object_info_t &info)
+{
+	if (nr_objects >= max_objects)
+		return false;
+
+	objects[nr_objects++] = { (uintptr_t)addr, info.size, info.time, info.stack_id,
+				  LEAK_DEFINITE };
+	return true;
+}
+
+static bool by_addr(const leak_object_t &o1, const leak_object_t &o2)
+{
+	return o1.addr < o2.addr;
+}
+
+static size_t slice_start(int slice)
+{
+	return nr_objects * slice / nr_workers;
+}
+
+static void sort_job(int idx)
+{
+	std::sort(objects + slice_start(idx), objects + slice_start(idx + 1), by_addr);
+}
+
+// merges two runs of the sorted slices into the other buffer.
+static void merge_job(int idx)
+{
+	int first = 2 * idx * merge_width;
+
+	if (first >= nr_workers)
+		return;
+
+	int mid = std::min(first + merge_width, nr_workers);
+	int last = std::min(first + 2 * merge_width, nr_workers);
+
+	std::merge(objects + slice_start(first), objects + slice_start(mid),
+		   objects + slice_start(mid), objects + slice_start(last),
+		   merged + slice_start(first), by_addr);
+}
+
+static void sort_objects(void)
+{
+	run_job(sort_job);
+	for (merge_width = 1; merge_width < nr_workers; merge_width *= 2) {
+		run_job(merge_job);
+		std::swap(objects, merged);
+	}
+
+	if (nr_objects) {
+		const leak_object_t &last = objects[nr_objects - 1];
+
+		// the objects don't overlap so the last one ends at the highest.
+		objects_lo = objects[0].addr;
+		objects_hi = last.addr + std::max<uint64_t>(last.size, 1);
+	}
+	else {
+		objects_lo = objects_hi = 0;
+	}
+}
+
+// returns true if any object starts in [start, end).
+static bool has_objects(uintptr_t start, uintptr_t end)
+{
+	const leak_object_t key = { start, 0, 0, 0, 0 };
+	auto it = std::lower_bound(objects, objects + nr_objects, key, by_addr);
+
+	return it != objects + nr_objects && it->addr < end;
+}
+
+static inline leak_object_t *find_object(uintptr_t addr)
+{
+	size_t lo = 0;
+	size_t hi = nr_objects;
+
+	// find the last object that starts at or before the addr.
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (objects[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return nullptr;
+
+	leak_object_t *obj = &objects[lo - 1];
+	if (addr == obj->addr || addr < obj->addr + obj->size)
+		return obj;
+	return nullptr;
+}
+
+// Calls func(tid) for each thread of the process.  It reads the directory
+// with the system call as readdir() might allocate.
+template <typename Func>
+static bool for_each_thread(Func func)
+{
+	uint64_t buf[512];
+	long len;
+
+	int fd = open(task_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (long pos = 0; pos < len;) {
+			auto *d = (struct dirent64 *)((char *)buf + pos);
+
+			pos += d->d_reclen;
+			if (d->d_name[0] >= '0' && d->d_name[0] <= '9')
+				func((uint32_t)strtoul(d->d_name, nullptr, 10));
+		}
+	}
+	close(fd);
+	return true;
+}
+
+#ifdef REG_SP
+static uintptr_t get_thread_pointer(uint32_t tid, const struct user_regs_struct &regs)
+{
+#if defined(__x86_64__)
+	return regs.fs_base;
+#elif defined(__aarch64__)
+	uint64_t tls = 0;
+	struct iovec iov = { &tls, sizeof(tls) };
+
+	if (ptrace(PTRACE_GETREGSET, tid, NT_ARM_TLS, &iov) < 0)
+		return 0;
+	return tls;
+#else
+	// no TLS of the other threads is scanned.
+	return 0;
+#endif
+}
+#endif
+
+// Attaches to the thread and waits until it stops.  It returns false if the
+// thread couldn't be stopped, but a thread that has just exited doesn't count.
+static bool attach_thread(uint32_t tid)
+{
+#ifdef REG_SP
+	stopped_thread_t *st = &stopped_threads[nr_stopped];
+	struct iovec iov = { &st->regs, sizeof(st->regs) };
+	uint64_t start = monotonic_ns();
+	int status;
+
+	if (nr_stopped >= LEAK_MAX_THREADS)
+		return false;
+
+	if (ptrace(PTRACE_SEIZE, tid, nullptr, nullptr) < 0)
+		return errno == ESRCH;
+
+	if (ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) < 0 ||
+	    waitpid(tid, &status, __WALL) < 0 || !WIFSTOPPED(status))
+		return true;
+
+	st->tid = tid;
+	// it might stop for a signal before the interrupt.
+	st->sig = (status >> 16) == PTRACE_EVENT_STOP ? 0 : WSTOPSIG(status);
+
+	if (ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) < 0) {
+		ptrace(PTRACE_DETACH, tid, nullptr, (void *)(intptr_t)st->sig);
+		return false;
+	}
+	st->sp = REG_SP(st->regs);
+	st->tp = get_thread_pointer(tid, st->regs);
+
+	if (!tracer_hold) {
+		ptrace(PTRACE_DETACH, tid, nullptr, (void *)(intptr_t)st->sig);
+		max_pause = std::max(max_pause, monotonic_ns() - start);
+	}
+
+	nr_stopped++;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Attaches to the threads until no new thread shows up, as a thread might
+// create another before it's stopped.
+static bool attach_threads(void)
+{
+	bool found = true;
+
+	memset(attached_tids, 0, LEAK_MAX_TID / 8);
+	nr_stopped = 0;
+	nr_failed = 0;
+
+	for (int i = 0; i < nr_workers; i++)
+		set_tid(attached_tids, worker_tids[i]);
+
+	while (found) {
+		found = false;
+
+		bool listed = for_each_thread([&](uint32_t tid) {
+			if (tid >= LEAK_MAX_TID || test_tid(attached_tids, tid))
+				return;
+
+			set_tid(attached_tids, tid);
+			if (attach_thread(tid))
+				found = true;
+			else
+				nr_failed++;
+		});
+		if (!listed || nr_failed)
+			return false;
+	}
+	return true;
+}
+
+static void detach_threads(void)
+{
+	for (uint32_t i = 0; tracer_hold && i < nr_stopped; i++) {
+		const stopped_thread_t &st = stopped_threads[i];
+
+		ptrace(PTRACE_DETACH, st.tid, nullptr, (void *)(intptr_t)st.sig);
+	}
+}
+
+static void set_tracer_state(uint32_t state)
+{
+	__atomic_store_n(&tracer_state, state, __ATOMIC_RELEASE);
+	futex(&tracer_state, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+static uint32_t wait_tracer_state(uint32_t state)
+{
+	uint32_t cur;
+
+	while ((cur = __atomic_load_n(&tracer_state, __ATOMIC_ACQUIRE)) == state)
+		futex(&tracer_state, FUTEX_WAIT_PRIVATE, state);
+	return cur;
+}
+
+// It shares the thread pointer of the scanning thread, which waits for it,
+// so it must not use the TLS other than errno.
+static int tracer_main(void *arg)
+{
+	bool stopped = wait_tracer_state(TRACER_IDLE) == TRACER_STOP && attach_threads();
+
+	set_tracer_state(stopped ? TRACER_STOPPED : TRACER_FAILED);
+	if (stopped)
+		wait_tracer_state(TRACER_STOPPED);
+
+	detach_threads();
+	return 0;
+}
+
+static bool stop_threads(bool hold)
+{
+	tracer_hold = hold;
+	max_pause = 0;
+	tracer_state = TRACER_IDLE;
+	tracer_pid = clone(tracer_main, tracer_stack + LEAK_TRACER_STACK_SIZE,
+			   CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_UNTRACED, nullptr);
+	if (tracer_pid < 0) {
+		nr_stopped = nr_failed = 0;
+		return false;
+	}
+
+	// Yama allows only the ancestors to trace by default.
+	prctl(PR_SET_PTRACER, tracer_pid, 0, 0, 0);
+
+	set_tracer_state(TRACER_STOP);
+	return wait_tracer_state(TRACER_STOP) == TRACER_STOPPED;
+}
+
+static void resume_threads(void)
+{
+	int status;
+
+	if (tracer_pid < 0)
+		return;
+
+	set_tracer_state(TRACER_RESUME);
+	waitpid(tracer_pid, &status, __WALL);
+	prctl(PR_SET_PTRACER, 0, 0, 0, 0);
+}
+
+static const char *skip_fields(const char *p, int n)
+{
+	while (n--) {
+		while (*p && *p != ' ')
+			p++;
+		while (*p == ' ')
+			p++;
+	}
+	return p;
+}
+
+// Reads the readable mappings without allocation as the threads are stopped.
+static void read_maps(void)
+{
+	size_t len = 0;
+	ssize_t ret;
+
+	nr_maps = 0;
+
+	int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	while (len < LEAK_MAPS_BUF_SIZE - 1 &&
+	       (ret = read(fd, maps_buf + len, LEAK_MAPS_BUF_SIZE - 1 - len)) > 0)
+		len += ret;
+	close(fd);
+	maps_buf[len] = '\0';
+
+	for (char *line = maps_buf; *line && nr_maps < LEAK_MAX_MAPS;) {
+		char *eol = strchr(line, '\n');
+		char *p;
+
+		if (!eol)
+			break;
+		*eol = '\0';
+
+		uintptr_t start = strtoul(line, &p, 16);
+		uintptr_t end = strtoul(p + 1, &p, 16);
+		const char *perms = p + 1;
+		const char *name = skip_fields(perms, 4);
+
+		// reading devices or [vvar] might have side effects or fault.
+		if (perms[0] == 'r' && strncmp(name, "/dev/", 5) && strncmp(name, "[v", 2))
+			maps[nr_maps++] = { start, end, perms[1] == 'w' };
+
+		line = eol + 1;
+	}
+}
+
+static const leak_map_t *find_map(uintptr_t addr)
+{
+	const leak_map_t key = { addr, 0, false };
+	auto it = std::upper_bound(maps, maps + nr_maps, key,
+				   [](const leak_map_t &m1, const leak_map_t &m2) {
+					   return m1.start < m2.start;
+				   });
+
+	if (it == maps || addr >= (--it)->end)
+		return nullptr;
+	return it;
+}
+
+// Adds the readable parts of [start, end) to the roots.
+static void add_root(uintptr_t start, uintptr_t end)
+{
+	start = (start + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+
+	const leak_map_t key = { 0, start, false };
+	auto it = std::upper_bound(maps, maps + nr_maps, key,
+				   [](const leak_map_t &m1, const leak_map_t &m2) {
+					   return m1.end < m2.end;
+				   });
+
+	for (; it != maps + nr_maps && it->start < end && nr_roots < LEAK_MAX_ROOTS; ++it) {
+		uintptr_t s = std::max(start, it->start);
+		uintptr_t e = std::min(end, it->end);
+
+		if (s < e)
+			roots[nr_roots++] = { s, e };
+	}
+}
+
+// The stack of a thread is scanned from the stack pointer to the end of its
+// mapping.  But the mapping of a thread created by pthread might be merged
+// with the next anonymous one, so it ends at the TLS at the top of the stack.
+// The TLS of the main thread is elsewhere and it's scanned separately.
+static void add_thread_roots(const stopped_thread_t &st)
+{
+	const leak_map_t *stack = find_map(st.sp);
+	const leak_object_t *obj = find_object(st.sp);
+	uintptr_t tls_start = st.tp > tls_window ? st.tp - tls_window : 0;
+	uintptr_t tls_end = st.tp + tls_window;
+
+	// e.g. a coroutine running on a stack allocated from the heap.
+	if (obj)
+		add_root(st.sp, obj->addr + obj->size);
+	else if (stack && stack->start <= st.tp && st.tp < stack->end)
+		add_root(st.sp, std::min(stack->end, tls_end));
+	else if (stack)
+		add_root(st.sp, stack->end);
+
+	if ((!stack || st.tp < stack->start || st.tp >= stack->end) &&
+	    !has_objects(tls_start, tls_end))
+		add_root(tls_start, tls_end);
+
+#ifdef REG_SP
+	add_root((uintptr_t)&st.regs, (uintptr_t)(&st.regs + 1));
+#endif
+
+	// the thread is not in realloc() any more in the incremental scan, and
+	// the next scan sees the object anyway.
+	uintptr_t slot = st.tp + realloc_ptr_offset;
+	if (!st.tp || incremental || !find_map(slot))
+		return;
+
+	// check the header too as malloc_usable_size() reads it.
+	uintptr_t ptr = *(const uintptr_t *)slot;
+	if (ptr && find_map(ptr) && find_map(ptr - 2 * sizeof(size_t)) == find_map(ptr))
+		add_root(ptr, ptr + malloc_usable_size((void *)ptr));
+}
+
+static void collect_roots(const stopped_thread_t *self)
+{
+	nr_roots = 0;
+
+	for (const auto &r : segment_roots)
+		add_root(r.start, r.end);
+
+	// a custom allocator might get its heap from mmap().
+	for (const auto &r : mmap_roots) {
+		if (!has_objects(r.start, r.end))
+			add_root(r.start, r.end);
+	}
+
+	if (self)
+		add_thread_roots(*self);
+	for (uint32_t i = 0; i < nr_stopped; i++)
+		add_thread_roots(stopped_threads[i]);
+
+	// merge the overlapping ones not to scan them twice.
+	std::sort(roots, roots + nr_roots,
+		  [](const leak_range_t &r1, const leak_range_t &r2) { return r1.start < r2.start; });
+
+	size_t n = 0;
+	for (size_t i = 0; i < nr_roots; i++) {
+		if (n > 0 && roots[i].start <= roots[n - 1].end)
+			roots[n - 1].end = std::max(roots[n - 1].end, roots[i].end);
+		else
+			roots[n++] = roots[i];
+	}
+	nr_roots = n;
+
+	nr_chunks = 0;
+	for (size_t i = 0; i < nr_roots; i++) {
+		root_chunks[i] = nr_chunks;
+		nr_chunks += (roots[i].end - roots[i].start + LEAK_CHUNK_SIZE - 1) / LEAK_CHUNK_SIZE;
+	}
+	root_chunks[nr_roots] = nr_chunks;
+}
+
+static void mark(leak_object_t *obj, uint32_t state)
+{
+	uint32_t old = __atomic_load_n(&obj->state, __ATOMIC_RELAXED);
+
+	while (old < state) {
+		if (__atomic_compare_exchange_n(&obj->state, &old, state, true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			uint64_t slot = queue_tail.fetch_add(1);
+
+			__atomic_store_n(&queue[slot], (uint32_t)(obj - objects) + 1,
+					 __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+// Marks the objects pointed by the aligned words in [start, end).  The ones
+// found from a possibly reachable object are possibly reachable at most.
+static void scan_range(uintptr_t start, uintptr_t end, uint32_t state)
+{
+	auto *p = (const uintptr_t *)start;
+	auto *last = (const uintptr_t *)(end & ~(sizeof(uintptr_t) - 1));
+	uintptr_t span = objects_hi - objects_lo;
+
+	for (; p < last; p++) {
+		uintptr_t word = *p;
+
+		// most words are not even in the heap.
+		if (word - objects_lo >= span)
+			continue;
+
+		leak_object_t *obj = find_object(word);
+		if (obj)
+			mark(obj, word == obj->addr ? state : std::min<uint32_t>(state, LEAK_POSSIBLE));
+	}
+}
+
+// Scans a copy of [start, end) in pieces for the incremental scan, as the
+// program might unmap it in the meantime.  A page that can't be read is
+// skipped.
+static void scan_copy(uintptr_t start, uintptr_t end, uint32_t state)
+{
+	while (start < end) {
+		size_t len = std::min<uintptr_t>(end - start, LEAK_CHUNK_SIZE);
+		struct iovec local = { copy_buf, len };
+		struct iovec remote = { (void *)start, len };
+		ssize_t ret = process_vm_readv(scan_pid, &local, 1, &remote, 1, 0);
+
+		if (ret < 0 && errno != EFAULT) {
+			// e.g. it's not allowed, nothing can be read then.
+			scan_failed = true;
+			return;
+		}
+		if (ret > 0)
+			scan_range((uintptr_t)copy_buf, (uintptr_t)copy_buf + ret, state);
+
+		if (ret == (ssize_t)len)
+			start += len;
+		else
+			start = (start + std::max<ssize_t>(ret, 0) + page_size) & ~(page_size - 1);
+
+		if (start < end && !leak_scan_yield())
+			return;
+	}
+}
+
+static void scan_chunk(uint64_t chunk)
+{
+	size_t i = std::upper_bound(root_chunks, root_chunks + nr_roots + 1, chunk) - root_chunks - 1;
+	uintptr_t start = roots[i].start + (chunk - root_chunks[i]) * LEAK_CHUNK_SIZE;
+	uintptr_t end = std::min<uintptr_t>(start + LEAK_CHUNK_SIZE, roots[i].end);
+
+	if (incremental)
+		scan_copy(start, end, LEAK_REACHABLE);
+	else
+		scan_range(start, end, LEAK_REACHABLE);
+}
+
+static void scan_object(const leak_object_t *obj)
+{
+	uint32_t state = __atomic_load_n(&obj->state, __ATOMIC_RELAXED);
+	uintptr_t start = obj->addr;
+	uintptr_t end = start + obj->size;
+
+	if (incremental) {
+		scan_copy(start, end, state);
+		return;
+	}
+
+	// a big object might have pages protected by the program.
+	if (obj->size < 4096) {
+		scan_range(start, end, state);
+		return;
+	}
+
+	for (const leak_map_t *m = find_map(start); m && m < maps + nr_maps && m->start < end; m++)
+		scan_range(std::max(start, m->start), std::min(end, m->end), state);
+}
+
+static void mark_job(int idx)
+{
+	while (true) {
+		nr_active.fetch_add(1);
+
+		if (next_chunk.load(std::memory_order_relaxed) < nr_chunks) {
+			uint64_t chunk = next_chunk.fetch_add(1);
+
+			if (chunk < nr_chunks)
+				scan_chunk(chunk);
+			nr_active.fetch_sub(1);
+			continue;
+		}
+
+		uint64_t head = queue_head.load();
+		uint64_t tail = queue_tail.load();
+		if (head < tail) {
+			uint64_t n = std::min<uint64_t>(tail - head, LEAK_BATCH);
+
+			if (queue_head.compare_exchange_weak(head, head + n)) {
+				for (uint64_t i = head; i < head + n; i++) {
+					uint32_t v;
+
+					// it's claimed but might not be written yet.
+					while ((v = __atomic_load_n(&queue[i], __ATOMIC_ACQUIRE)) == 0)
+						sched_yield();
+					scan_object(&objects[v - 1]);
+				}
+			}
+			nr_active.fetch_sub(1);
+			continue;
+		}
+		nr_active.fetch_sub(1);
+
+		// only an active worker can push more.
+		if (nr_active.load() == 0 && queue_head.load() >= queue_tail.load())
+			break;
+		sched_yield();
+	}
+}
+
+bool leak_scan_run(leak_info_t &info, uint32_t *nr_unstopped)
+{
+	stopped_thread_t self = {};
+
+	sort_objects();
+
+	info = {};
+	info.nr_objects = nr_objects;
+	for (size_t i = 0; i < nr_objects; i++)
+		info.total_size += objects[i].size;
+	info.nr_workers = nr_workers;
+
+	uint64_t start = monotonic_ns();
+	bool stopped = stop_threads(true);
+
+	if (stopped) {
+		// this frame and the callers, the scan itself is below.
+		self.sp = (uintptr_t)__builtin_frame_address(0);
+		self.tp = thread_pointer();
+
+		read_maps();
+		collect_roots(&self);
+
+		queue_head = 0;
+		queue_tail = 0;
+		next_chunk = 0;
+		nr_active = 0;
+		run_job(mark_job);
+	}
+
+	resume_threads();
+	info.pause = std::chrono::nanoseconds(monotonic_ns() - start);
+
+	*nr_unstopped = nr_failed;
+	info.nr_threads = nr_stopped;
+	info.nr_roots = nr_roots;
+	for (size_t i = 0; i < nr_roots; i++)
+		info.root_size += roots[i].end - roots[i].start;
+	return stopped;
+}
+
+// Scans the objects of the logs as live objects, but only the ones already
+// there not to chase a busy hook.  It returns false if there was none.
+static bool drain_logs(void)
+{
+	bool found = false;
+
+	for (int i = 0; i < LEAK_MAX_LOGS; i++) {
+		leak_log_t *log = &logs[i];
+		uint64_t head = log->head.load(std::memory_order_relaxed);
+		uint64_t tail = log->tail.load(std::memory_order_acquire);
+
+		// the objects in a full log will be found in the addrmap.
+		if (log->overflow.load(std::memory_order_relaxed))
+			continue;
+
+		for (; head < tail && !scan_failed; found = true) {
+			auto entry = log->entries[head % LEAK_LOG_SIZE];
+
+			// the hook can reuse the entry now.
+			log->head.store(++head, std::memory_order_release);
+			scan_copy(entry.addr, entry.addr + entry.size, LEAK_REACHABLE);
+		}
+	}
+	return found;
+}
+
+// Marks the objects in this thread, taking the logs from time to time.  The
+// program might fill the logs faster than it takes them, so it only empties
+// the logs at the end after they're detached.
+static void mark_incremental(bool detached)
+{
+	uint64_t n = 0;
+
+	while (!scan_failed) {
+		if (++n % LEAK_LOG_CHECK_INTERVAL == 0)
+			drain_logs();
+
+		if (next_chunk < nr_chunks)
+			scan_chunk(next_chunk++);
+		else if (queue_head < queue_tail)
+			scan_object(&objects[queue[queue_head++] - 1]);
+		else if (!detached || !drain_logs())
+			break;
+
+		leak_scan_yield();
+	}
+}
+
+bool leak_scan_run_incremental(leak_info_t &info, uint32_t *nr_unstopped)
+{
+	sort_objects();
+
+	info = {};
+	info.incremental = true;
+	info.nr_objects = nr_objects;
+	for (size_t i = 0; i < nr_objects; i++)
+		info.total_size += objects[i].size;
+	info.nr_workers = nr_workers;
+
+	// the threads are running again when it returns.
+	bool sampled = stop_threads(false);
+	resume_threads();
+
+	*nr_unstopped = nr_failed;
+	info.nr_threads = nr_stopped;
+	info.pause = std::chrono::nanoseconds(max_pause);
+	if (!sampled)
+		return false;
+
+	// after the threads are sampled, as their stacks should be in the maps.
+	read_maps();
+	collect_roots(nullptr);
+
+	info.nr_roots = nr_roots;
+	for (size_t i = 0; i < nr_roots; i++)
+		info.root_size += roots[i].end - roots[i].start;
+
+	queue_head = 0;
+	queue_tail = 0;
+	next_chunk = 0;
+	mark_incremental(false);
+	return !scan_failed;
+}
+
+bool leak_scan_drain(void)
+{
+	mark_incremental(true);
+	return !scan_failed;
+}
+
+void leak_scan_new(uintptr_t addr, uint64_t size)
+{
+	scan_copy(addr, addr + size, LEAK_REACHABLE);
+}
+
+leak_log_t *leak_scan_log(int shard)
+{
+	leak_log_t *log = &logs[shard];
+
+	log->head = 0;
+	log->tail = 0;
+	log->overflow = false;
+	return log;
+}
+
+bool leak_scan_yield(void)
+{
+	if (!incremental)
+		return true;
+
+	if (monotonic_ns() - slice_time >= LEAK_SLICE_NS) {
+		futex_wait_ns(&monitor_stopping, 0, LEAK_SLICE_IDLE_NS);
+		slice_time = monotonic_ns();
+	}
+
+	if (__atomic_load_n(&monitor_stopping, __ATOMIC_ACQUIRE))
+		scan_failed = true;
+	return !scan_failed;
+}
+
+const leak_object_t *leak_scan_objects(size_t *n)
+{
+	*n = nr_objects;
+	return objects;
+}
+
+void leak_scan_finish(void)
+{
+	if (nr_workers)
+		stop_workers();
+
+	unmap_buffer(objects, max_objects * sizeof(leak_object_t));
+	unmap_buffer(merged, max_objects * sizeof(leak_object_t));
+	unmap_buffer(queue, 2 * max_objects * sizeof(uint32_t));
+	objects = merged = nullptr;
+	queue = nullptr;
+	nr_objects = max_objects = 0;
+
+	incremental = false;
+	scan_busy = false;
+}
+
+static void *leak_monitor_worker(void *arg)
+{
+	auto *tfs = &thread_flags;
+	auto period = (uint64_t)(opts.leak_interval * NSEC_PER_SEC);
+	sigset_t sigset;
+
+	// the worker never records its own allocations.
+	tfs->hook_guard = true;
+
+	// let the program threads handle the signals.
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+	while (true) {
+		futex_wait_ns(&monitor_stopping, 0, period);
+		if (__atomic_load_n(&monitor_stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		dump_new_leaks();
+	}
+	return nullptr;
+}
+
+static bool leak_monitor_start(void)
+{
+	if (pthread_create(&monitor, nullptr, leak_monitor_worker, nullptr) != 0)
+		return false;
+
+	pthread_setname_np(monitor, "heaptrace-leak");
+	monitor_started = true;
+	return true;
+}
+
+static void leak_monitor_atfork_prepare(void)
+{
+	leak_monitor_lock.lock();
+}
+
+static void leak_monitor_atfork_parent(void)
+{
+	leak_monitor_lock.unlock();
+}
+
+static void leak_monitor_atfork_child(void)
+{
+	leak_monitor_lock.unlock();
+
+	// the scan running in the parent, if any, is not in the child.
+	scan_busy = false;
+	detach_leak_logs();
+
+	// The worker doesn't exist in the child.  A thread cannot be created
+	// safely here, so the first allocation starts a new one.
+	if (monitor_started) {
+		monitor_started = false;
+		leak_monitor_forked.store(true);
+	}
+}
+
+void leak_monitor_start_child(void)
+{
+	if (leak_monitor_forked.exchange(false))
+		leak_monitor_start();
+}
+
+bool leak_monitor_init(void)
+{
+	pthread_atfork(leak_monitor_atfork_prepare, leak_monitor_atfork_parent,
+		       leak_monitor_atfork_child);
+
+	return leak_monitor_start();
+}
+
+void leak_monitor_stop(void)
+{
+	if (!monitor_started)
+		return;
+
+	__atomic_store_n(&monitor_stopping, 1, __ATOMIC_RELEASE);
+	futex(&monitor_stopping, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+	pthread_join(monitor, nullptr);
+	monitor_started = false;
+}
@@ -0,0 +1,147 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_LEAKCHECK_H
+#define HEAPTRACE_LEAKCHECK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <mutex>
+
+#include "dump.h"
+#include "stacktrace.h"
+
+// The leak check finds the tracked objects that the program cannot reach any
+// more, like the mark phase of a conservative garbage collector.  The roots
+// are the writable segments of the loaded objects, the readable and writable
+// mappings made by mmap(), and the stacks, registers and TLS of the threads.
+// An aligned word pointing to the start of an object makes it reachable and
+// a word pointing into its middle makes it possibly reachable, and then the
+// object is scanned for more pointers in turn.  The roots and the objects are
+// scanned by a few worker threads in parallel.  The other objects are lost.
+//
+// The objects are taken from the addrmap, which should be locked from the
+// first leak_scan_add() to the end of leak_scan_run() so that no object is
+// freed under the scan.  The other threads are stopped with ptrace() only
+// while the objects are marked.  Only one scan runs at a time.
+//
+// The incremental scan does the same from a background thread every
+// opts.leak_interval seconds without stopping the world.  The addrmap is
+// copied a shard at a time, the registers are taken from one thread at a
+// time, and the memory is read in short slices with process_vm_readv() as
+// the program might free or unmap it in the meantime.  The allocation hook
+// logs the objects allocated in a shard after it's copied, which are live and
+// scanned for pointers as well.  The freed objects are dropped by looking them
+// up in the addrmap at the end.  But the program might move a pointer from a
+// place not scanned yet to a place already scanned, so an object is reported
+// only if it's found unreachable by two scans in a row.
+
+// state of an object after a scan
+#define LEAK_DEFINITE 0
+#define LEAK_POSSIBLE 1
+#define LEAK_REACHABLE 2
+
+struct leak_object_t {
+	uintptr_t addr;
+	uint64_t size;
+	// allocation time, which tells it from a later object at the same address
+	uint64_t time;
+	stack_id_t stack_id;
+	// one of LEAK_*, it only goes up during the scan.
+	uint32_t state;
+};
+
+// number of objects a log can have before the scan takes them
+#define LEAK_LOG_SIZE 8192
+#define LEAK_MAX_LOGS 64
+
+// The objects allocated in a shard of the addrmap during an incremental scan.
+// It's written under the shard lock and read by the scan without the lock.
+struct leak_log_t {
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> tail;
+	// some objects are missed, they should be found in the addrmap.
+	std::atomic<bool> overflow;
+	struct {
+		uintptr_t addr;
+		uint64_t size;
+	} entries[LEAK_LOG_SIZE];
+};
+
+static inline void leak_log_push(leak_log_t *log, addr_t addr, uint64_t size)
+{
+	uint64_t tail = log->tail.load(std::memory_order_relaxed);
+
+	if (tail - log->head.load(std::memory_order_acquire) >= LEAK_LOG_SIZE) {
+		log->overflow.store(true, std::memory_order_relaxed);
+		return;
+	}
+	log->entries[tail % LEAK_LOG_SIZE] = { (uintptr_t)addr, size };
+	log->tail.store(tail + 1, std::memory_order_release);
+}
+
+// Starts the workers and collects the roots that are known without stopping
+// the threads.  It might allocate, so the addrmap should not be locked yet.
+// It waits for the other scan running if any.
+bool leak_scan_prepare(bool incremental);
+
+// Reserves the room for the objects, which must be added before the scan.
+// leak_scan_add() returns false if there's no more room.
+bool leak_scan_reserve(size_t nr_objects);
+bool leak_scan_add(addr_t addr, const object_info_t &info);
+
+// Stops the other threads, marks the objects reachable from the roots and
+// resumes the threads.  It returns false if any thread couldn't be stopped,
+// e.g. when the process is traced by a debugger, and *nr_unstopped has the
+// number of them.
+bool leak_scan_run(leak_info_t &info, uint32_t *nr_unstopped);
+
+// Returns the objects sorted by the address with their states.
+const leak_object_t *leak_scan_objects(size_t *nr_objects);
+
+// Stops the workers and frees the objects.
+void leak_scan_finish(void);
+
+// Returns the empty log of the shard, which the allocation hook writes to
+// until the incremental scan is done with the shard.
+leak_log_t *leak_scan_log(int shard);
+
+// Sleeps if the incremental scan has run for a slice.  It returns false if
+// the scan should stop as the program is exiting.
+bool leak_scan_yield(void);
+
+// The incremental version of leak_scan_run().  It marks the objects from the
+// roots and some of the logs, while the threads are stopped only one by one
+// to get the registers.  The logs should be detached from the shards after
+// that, and then leak_scan_drain() scans the rest of them.  Both return false
+// if the scan is not reliable.
+bool leak_scan_run_incremental(leak_info_t &info, uint32_t *nr_unstopped);
+bool leak_scan_drain(void);
+
+// Scans a live object missing in the log, then leak_scan_drain() marks the
+// objects found from it.
+void leak_scan_new(uintptr_t addr, uint64_t size);
+
+// Starts the background thread of the incremental scan.
+bool leak_monitor_init(void);
+
+// Stops the thread in the middle of the scan if any, and waits for it.
+void leak_monitor_stop(void);
+
+// The thread holds it while it locks any addr shard, so that fork() waits
+// until the shards are unlocked.
+extern std::mutex leak_monitor_lock;
+
+// A forked child starts the thread on the first allocation, like the control
+// thread.
+extern std::atomic<bool> leak_monitor_forked;
+void leak_monitor_start_child(void);
+
+static inline void leak_monitor_check_fork(void)
+{
+	if (unlikely(leak_monitor_forked.load(std::memory_order_relaxed)))
+		leak_monitor_start_child();
+}
+
+#endif /* HEAPTRACE_LEAKCHECK_H */
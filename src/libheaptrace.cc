@@ -8,17 +8,29 @@
 #include <cstring>
 
 #include <csignal>
+#include <cstdarg>
 #include <dlfcn.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <sstream>
 #include <string>
 
+#include "addrmap.h"
+#include "attach.h"
 #include "compiler.h"
+#include "control.h"
+#include "eventbuf.h"
+#include "evlog.h"
 #include "heaptrace.h"
+#include "ignoremap.h"
+#include "leakcheck.h"
+#include "mmaptrace.h"
+#include "sampling.h"
 #include "sighandler.h"
 #include "stacktrace.h"
+#include "threadmap.h"
 #include "utils.h"
 
 // dlsym internally uses calloc, so use weak symbol to get their symbol
@@ -44,7 +56,8 @@ typedef void *(*PVallocFunction)(size_t size);
 typedef void *(*VallocFunction)(size_t size);
 typedef void *(*ReallocArrayFunction)(void *ptr, size_t nmemb, size_t size);
 typedef void *(*MmapFunction)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
-typedef int (*MunmapFunction)(void *addr, size_t length);
+typedef void *(*Mmap64Function)(void *addr, size_t length, int prot, int flags, int fd,
+				off64_t offset);
 
 static MallocFunction real_malloc;
 static FreeFunction real_free;
@@ -56,6 +69,10 @@ static AlignedAllocFunction real_aligned_alloc;
 static PVallocFunction real_pvalloc;
 static VallocFunction real_valloc;
 static ReallocArrayFunction real_reallocarray;
+static MmapFunction real_mmap;
+static Mmap64Function real_mmap64;
+static MunmapFunction real_munmap;
+static MremapFunction real_mremap;
 
 thread_local struct thread_flags_t thread_flags;
 
@@ -83,14 +100,14 @@ __constructor static void heaptrace_init()
 	real_pvalloc = (PVallocFunction)dlsym(RTLD_NEXT, "pvalloc");
 	real_valloc = (VallocFunction)dlsym(RTLD_NEXT, "valloc");
 	real_reallocarray = (ReallocArrayFunction)dlsym(RTLD_NEXT, "reallocarray");
-
-	// initialize signal handlers
-	sighandler_init();
+	real_mmap = (MmapFunction)dlsym(RTLD_NEXT, "mmap");
+	real_mmap64 = (Mmap64Function)dlsym(RTLD_NEXT, "mmap64");
+	real_munmap = (MunmapFunction)dlsym(RTLD_NEXT, "munmap");
+	real_mremap = (MremapFunction)dlsym(RTLD_NEXT, "mremap");
 
 	// setup option values
-	// TODO: create constexpr variables instead of default magic values.
 	env = getenv("HEAPTRACE_NUM_TOP_BACKTRACE");
-	opts.top = env ? std::stoi(env) : 10;
+	opts.top = env ? std::stoi(env) : DEFAULT_TOP_BACKTRACE;
 
 	env = getenv("HEAPTRACE_SORT_KEYS");
 	opts.sort_keys = env ? env : "size";
@@ -98,7 +115,60 @@ __constructor static void heaptrace_init()
 	env = getenv("HEAPTRACE_FLAME_GRAPH");
 	opts.flamegraph = env ? std::stoi(env) : false;
 
+	env = getenv("HEAPTRACE_RAW");
+	opts.raw = env ? std::stoi(env) : false;
+
+	env = getenv("HEAPTRACE_SNAPSHOT");
+	opts.snapshot = env ? std::stoi(env) : false;
+
+	opts.ignore = getenv("HEAPTRACE_IGNORE");
+	opts.filter = getenv("HEAPTRACE_FILTER");
+
+	env = getenv("HEAPTRACE_UNWIND");
+	opts.unwinder = (env && !strcmp(env, "fp")) ? UNWIND_FP : UNWIND_BACKTRACE;
+
+	env = getenv("HEAPTRACE_SAMPLE_RATE");
+	opts.sample_rate = env ? std::stoull(env) : 0;
+
+	env = getenv("HEAPTRACE_ATTACH");
+	opts.attach = env ? std::stoi(env) : false;
+
+	if (!threadmap_init())
+		pr_dbg("failed to init the thread map\n");
+
+	// most frees are of untracked objects in both modes.
+	if (opts.sample_rate || opts.attach)
+		opts.addr_filter = addr_filter_init();
+
+	env = getenv("HEAPTRACE_ASYNC");
+	opts.async = env ? std::stoi(env) : false;
+	if (opts.async && !eventbuf_init()) {
+		pr_dbg("failed to start async mode\n");
+		opts.async = false;
+	}
+
 	opts.outfile = getenv("HEAPTRACE_OUTFILE");
+
+	env = getenv("HEAPTRACE_EVENT_LOG");
+	opts.event_log = env ? std::stoi(env) : false;
+	if (opts.event_log && !evlog_init(opts.outfile ? opts.outfile : "heaptrace")) {
+		pr_dbg("failed to start the event log\n");
+		opts.event_log = false;
+	}
+
+	env = getenv("HEAPTRACE_LEAK_CHECK");
+	opts.leak_check = env ? std::stoi(env) : false;
+
+	env = getenv("HEAPTRACE_INTERVAL");
+	opts.interval = env ? std::stod(env) : 0;
+	if (opts.interval < 0)
+		opts.interval = 0;
+
+	env = getenv("HEAPTRACE_LEAK_INTERVAL");
+	opts.leak_interval = env ? std::stod(env) : 0;
+	if (opts.leak_interval < 0)
+		opts.leak_interval = 0;
+
 	if (opts.outfile) {
 		ss << opts.outfile << "." << pid << "." << comm.c_str();
 		outfp = fopen(ss.str().c_str(), "w");
@@ -106,30 +176,72 @@ __constructor static void heaptrace_init()
 	else
 		outfp = stdout;
 
+	// needs outfp to report a missing file.
+	if (opts.ignore)
+		ignoremap_init();
+
+	// the signal handlers need the control thread.
+	if (!control_init()) {
+		pr_dbg("failed to start the control thread\n");
+		opts.interval = 0;
+	}
+
+	// every live object should be in the addrmap as in dump_leaks(), and the
+	// text would break the flamegraph and the raw dump.
+	if (opts.leak_interval && (opts.sample_rate || opts.async || opts.attach)) {
+		pr_out("[heaptrace] leak check is not supported with sampling, async or attach\n");
+		opts.leak_interval = 0;
+	}
+	if (opts.leak_interval && !opts.flamegraph && !opts.raw && !leak_monitor_init())
+		pr_dbg("failed to start the leak check thread\n");
+
+	// the program might use the signals for itself.
+	env = getenv("HEAPTRACE_NO_SIGNALS");
+	opts.no_signals = env ? std::stoi(env) : false;
+	if (!opts.no_signals)
+		sighandler_init();
+
 	if (!opts.flamegraph) {
 		pr_out("[heaptrace] initialized for /proc/%d/maps (%s)\n", pid, comm.c_str());
 	}
 
 	initialized = true;
+
+	// loaded by 'heaptrace --pid', the hooks are not interposed yet.
+	if (opts.attach && !attach_hooks())
+		pr_dbg("failed to hook the allocation functions\n");
 }
 
 __destructor static void heaptrace_fini()
 {
 	auto *tfs = &thread_flags;
 	int pid = getpid();
+
+	// Disable any other hooking from here.  Otherwise the allocations of
+	// heaptrace itself would show up after attach, as its own calls to the
+	// allocator are not hooked but the ones from the libc are.
+	tfs->hook_guard = true;
+
 	std::string comm = utils::get_comm_name();
 
 	if (!opts.flamegraph) {
 		pr_out("[heaptrace]   finalized for /proc/%d/maps (%s)\n", pid, comm.c_str());
 	}
 
+	// no more dump by the control thread as outfp is closed below.
+	leak_monitor_stop();
+	control_stop();
 	dump_stackmap(opts.sort_keys, opts.flamegraph);
 
+	// the text would break the flamegraph and the raw dump for report.
+	if (opts.leak_check && !opts.flamegraph && !opts.raw)
+		dump_leaks();
+
+	if (opts.ignore)
+		ignoremap_fini();
+
 	if (opts.outfile)
 		fclose(outfp);
-
-	// disable any other hooking after this.
-	tfs->hook_guard = true;
 }
 
 __visible_default void *operator new(size_t size)
@@ -267,10 +379,17 @@ extern "C" __visible_default void *realloc(void *ptr, size_t size)
 
 	tfs->hook_guard = true;
 
+	// release it before the reallocation so that another thread cannot
+	// get the same address before it's released.
+	tfs->in_realloc = true;
+	tfs->realloc_ptr = ptr;
+	release_backtrace(ptr);
 	void *p = real_realloc(ptr, size);
+	tfs->realloc_ptr = p;
 	pr_dbg("realloc(%p, %zd) = %p\n", ptr, size, p);
-	release_backtrace(ptr);
 	record_backtrace(size, p);
+	tfs->realloc_ptr = nullptr;
+	tfs->in_realloc = false;
 
 	tfs->hook_guard = false;
 
@@ -380,10 +499,129 @@ extern "C" __visible_default void *reallocarray(void *ptr, size_t nmemb, size_t
 
 	tfs->hook_guard = true;
 
+	// release it before the reallocation so that another thread cannot
+	// get the same address before it's released.
+	tfs->in_realloc = true;
+	tfs->realloc_ptr = ptr;
+	release_backtrace(ptr);
 	void *p = real_reallocarray(ptr, nmemb, size);
+	tfs->realloc_ptr = p;
 	pr_dbg("reallocarray(%p, %zd, %zd) = %p\n", ptr, nmemb, size, p);
-	release_backtrace(ptr);
 	record_backtrace(nmemb * size, p);
+	tfs->realloc_ptr = nullptr;
+	tfs->in_realloc = false;
+
+	tfs->hook_guard = false;
+
+	return p;
+}
+
+// mmap can be called before heaptrace_init() so use the system calls until
+// the real functions are found.
+static void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+#ifdef SYS_mmap2
+	return (void *)syscall(SYS_mmap2, addr, length, prot, flags, fd, offset >> 12);
+#else
+	return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+#endif
+}
+
+extern "C" __visible_default void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+					off_t offset)
+{
+	auto *tfs = &thread_flags;
+
+	if (unlikely(tfs->hook_guard || !initialized)) {
+		if (unlikely(!real_mmap))
+			return sys_mmap(addr, length, prot, flags, fd, offset);
+		return real_mmap(addr, length, prot, flags, fd, offset);
+	}
+
+	tfs->hook_guard = true;
+
+	void *p = real_mmap(addr, length, prot, flags, fd, offset);
+	pr_dbg("mmap(%p, %zd, %s, %s, %d, %jd) = %p\n", addr, length,
+	       utils::mmap_prot_string(prot).c_str(), utils::mmap_flags_string(flags).c_str(), fd,
+	       (intmax_t)offset, p);
+	if (p != MAP_FAILED)
+		record_mmap(p, length, prot, flags);
+
+	tfs->hook_guard = false;
+
+	return p;
+}
+
+extern "C" __visible_default void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+					  off64_t offset)
+{
+	auto *tfs = &thread_flags;
+
+	if (unlikely(tfs->hook_guard || !initialized)) {
+		if (unlikely(!real_mmap64))
+			return sys_mmap(addr, length, prot, flags, fd, offset);
+		return real_mmap64(addr, length, prot, flags, fd, offset);
+	}
+
+	tfs->hook_guard = true;
+
+	void *p = real_mmap64(addr, length, prot, flags, fd, offset);
+	pr_dbg("mmap64(%p, %zd, %s, %s, %d, %jd) = %p\n", addr, length,
+	       utils::mmap_prot_string(prot).c_str(), utils::mmap_flags_string(flags).c_str(), fd,
+	       (intmax_t)offset, p);
+	if (p != MAP_FAILED)
+		record_mmap(p, length, prot, flags);
+
+	tfs->hook_guard = false;
+
+	return p;
+}
+
+extern "C" __visible_default int munmap(void *addr, size_t length)
+{
+	auto *tfs = &thread_flags;
+
+	if (unlikely(tfs->hook_guard || !initialized)) {
+		if (unlikely(!real_munmap))
+			return syscall(SYS_munmap, addr, length);
+		return real_munmap(addr, length);
+	}
+
+	tfs->hook_guard = true;
+
+	pr_dbg("munmap(%p, %zd)\n", addr, length);
+	int ret = release_mmap(addr, length, real_munmap);
+
+	tfs->hook_guard = false;
+
+	return ret;
+}
+
+extern "C" __visible_default void *mremap(void *old_address, size_t old_size, size_t new_size,
+					  int flags, ...)
+{
+	auto *tfs = &thread_flags;
+	void *new_address = nullptr;
+
+	if (flags & MREMAP_FIXED) {
+		va_list ap;
+
+		va_start(ap, flags);
+		new_address = va_arg(ap, void *);
+		va_end(ap);
+	}
+
+	if (unlikely(tfs->hook_guard || !initialized)) {
+		if (unlikely(!real_mremap))
+			return (void *)syscall(SYS_mremap, old_address, old_size, new_size, flags,
+					       new_address);
+		return real_mremap(old_address, old_size, new_size, flags, new_address);
+	}
+
+	tfs->hook_guard = true;
+
+	void *p = record_mremap(old_address, old_size, new_size, flags, new_address, real_mremap);
+	pr_dbg("mremap(%p, %zd, %zd, %d) = %p\n", old_address, old_size, new_size, flags, p);
 
 	tfs->hook_guard = false;
 
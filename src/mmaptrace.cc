@@ -0,0 +1,198 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include "heaptrace.h"
+#include "mmaptrace.h"
+
+struct mmap_stack_t {
+	stack_info_t info;
+};
+
+// a mapped range [start, end), the start is the key of the interval map.
+struct mmap_range_t {
+	uintptr_t end;
+	int prot;
+	int flags;
+	mmap_stack_t *stack;
+};
+
+static std::mutex mmap_lock;
+static std::map<uintptr_t, mmap_range_t> mmap_ranges;
+// std::map never moves the values so ranges keep pointers to them.
+static std::map<stack_trace_t, mmap_stack_t> mmap_stacks;
+
+static inline uintptr_t page_align(uintptr_t size)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+	return (size + page_size - 1) & ~(page_size - 1);
+}
+
+static void stack_add(mmap_stack_t *stack, uint64_t size, int count)
+{
+	stack_info_t &info = stack->info;
+
+	if (info.count == 0 && info.total_size == 0)
+		info.birth_time = std::chrono::steady_clock::now();
+
+	info.total_size += size;
+	info.peak_total_size = std::max(info.peak_total_size, info.total_size);
+	info.count += count;
+	info.peak_count = std::max(info.peak_count, info.count);
+}
+
+static void stack_sub(mmap_stack_t *stack, uint64_t size, int count)
+{
+	stack->info.total_size -= size;
+	stack->info.count -= count;
+}
+
+// Splits the range containing addr into two at the addr.
+static mmap_stack_t *split_range(uintptr_t addr)
+{
+	auto it = mmap_ranges.upper_bound(addr);
+
+	if (it == mmap_ranges.begin())
+		return nullptr;
+
+	--it;
+	if (it->first == addr || it->second.end <= addr)
+		return nullptr;
+
+	mmap_range_t tail = it->second;
+	it->second.end = addr;
+	mmap_ranges.emplace(addr, tail);
+
+	// the peak is updated by the caller after removing the part.
+	tail.stack->info.count++;
+	return tail.stack;
+}
+
+// Removes [start, end) from the ranges.  The caller should hold mmap_lock.
+static void remove_range(uintptr_t start, uintptr_t end)
+{
+	mmap_stack_t *split[2] = { split_range(start), split_range(end) };
+
+	auto it = mmap_ranges.lower_bound(start);
+	while (it != mmap_ranges.end() && it->first < end) {
+		stack_sub(it->second.stack, it->second.end - it->first, 1);
+		it = mmap_ranges.erase(it);
+	}
+
+	// unmapping the middle of a mapping leaves two of them.
+	for (mmap_stack_t *stack : split) {
+		if (stack)
+			stack->info.peak_count = std::max(stack->info.peak_count, stack->info.count);
+	}
+}
+
+void __record_mmap(void *addr, size_t length, int prot, int flags, stack_trace_t &stack_trace,
+		   int nptrs)
+{
+	auto start = (uintptr_t)addr;
+	uintptr_t end = start + page_align(length);
+
+	std::lock_guard<std::mutex> lock(mmap_lock);
+
+	// MAP_FIXED might replace existing mappings.
+	remove_range(start, end);
+
+	mmap_stack_t *stack = &mmap_stacks[stack_trace];
+	stack->info.stack_depth = nptrs;
+	stack_add(stack, end - start, 1);
+
+	mmap_ranges[start] = { end, prot, flags, stack };
+}
+
+int release_mmap(void *addr, size_t length, MunmapFunction real_munmap)
+{
+	auto start = (uintptr_t)addr;
+
+	std::lock_guard<std::mutex> lock(mmap_lock);
+
+	int ret = real_munmap(addr, length);
+	if (ret == 0)
+		remove_range(start, start + page_align(length));
+	return ret;
+}
+
+void *record_mremap(void *old_addr, size_t old_size, size_t new_size, int flags,
+		    void *new_addr, MremapFunction real_mremap)
+{
+	auto old_start = (uintptr_t)old_addr;
+
+	std::lock_guard<std::mutex> lock(mmap_lock);
+
+	void *p = real_mremap(old_addr, old_size, new_size, flags, new_addr);
+	if (p == MAP_FAILED)
+		return p;
+
+	auto new_start = (uintptr_t)p;
+	auto it = mmap_ranges.upper_bound(old_start);
+	if (it == mmap_ranges.begin())
+		return p;
+
+	--it;
+	if (it->second.end <= old_start)
+		return p;
+
+	// keep the attributes of the old mapping, it cannot span mappings.
+	mmap_range_t range = it->second;
+
+	remove_range(old_start, old_start + page_align(old_size));
+	remove_range(new_start, new_start + page_align(new_size));
+
+	range.end = new_start + page_align(new_size);
+	mmap_ranges[new_start] = range;
+	stack_add(range.stack, range.end - new_start, 1);
+	return p;
+}
+
+void collect_mmaps(mmap_dump_t &dump)
+{
+	std::map<std::pair<int, int>, mmap_class_t> classes;
+
+	std::lock_guard<std::mutex> lock(mmap_lock);
+
+	for (const auto &stack : mmap_stacks) {
+		if (stack.second.info.count)
+			dump.stacks.emplace_back(stack.first, stack.second.info);
+	}
+
+	for (const auto &range : mmap_ranges) {
+		const mmap_range_t &r = range.second;
+		mmap_class_t &mc = classes[std::make_pair(r.prot, r.flags)];
+
+		mc.prot = r.prot;
+		mc.flags = r.flags;
+		mc.count++;
+		mc.size += r.end - range.first;
+	}
+
+	for (const auto &mc : classes)
+		dump.classes.push_back(mc.second);
+}
+
+void collect_mmap_ranges(std::vector<std::pair<uintptr_t, uintptr_t>> &ranges, int prot)
+{
+	std::lock_guard<std::mutex> lock(mmap_lock);
+
+	for (const auto &range : mmap_ranges) {
+		if ((range.second.prot & prot) == prot)
+			ranges.emplace_back(range.first, range.second.end);
+	}
+}
+
+void clear_mmaps(void)
+{
+	std::lock_guard<std::mutex> lock(mmap_lock);
+
+	mmap_ranges.clear();
+	mmap_stacks.clear();
+}
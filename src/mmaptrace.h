@@ -0,0 +1,57 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_MMAPTRACE_H
+#define HEAPTRACE_MMAPTRACE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <utility>
+#include <vector>
+
+#include "dump.h"
+#include "stacktrace.h"
+
+// Mappings created by mmap() are tracked as address intervals, each with
+// the stack that created it, so that munmap() and mremap() of any part of
+// them are accounted correctly.  They're much less frequent than malloc so
+// they're handled synchronously under a single lock even in async mode.
+
+typedef int (*MunmapFunction)(void *addr, size_t length);
+typedef void *(*MremapFunction)(void *old_address, size_t old_size, size_t new_size, int flags,
+				...);
+
+void __record_mmap(void *addr, size_t length, int prot, int flags, stack_trace_t &stack_trace,
+		   int nptrs);
+
+// This is inline for the same reason as record_backtrace().
+inline void record_mmap(void *addr, size_t length, int prot, int flags)
+{
+	int nptrs;
+	stack_trace_t stack_trace{};
+
+	if (opts.unwinder == UNWIND_FP)
+		nptrs = fp_backtrace(stack_trace.data(), DEPTH);
+	else
+		nptrs = backtrace(stack_trace.data(), DEPTH);
+	__record_mmap(addr, length, prot, flags, stack_trace, nptrs);
+}
+
+// Unmaps the range with real_munmap and releases it only if that succeeds.
+// It's done under the lock so that a new mapping at the same address from
+// another thread is not released instead.
+int release_mmap(void *addr, size_t length, MunmapFunction real_munmap);
+
+// Remaps the mapping with real_mremap under the lock in the same way.  The new
+// mapping is still accounted to the stack of the old mapping.
+void *record_mremap(void *old_addr, size_t old_size, size_t new_size, int flags,
+		    void *new_addr, MremapFunction real_mremap);
+
+void collect_mmaps(mmap_dump_t &dump);
+
+// Collects [start, end) of the mappings that have all the bits of prot.
+void collect_mmap_ranges(std::vector<std::pair<uintptr_t, uintptr_t>> &ranges, int prot);
+
+void clear_mmaps(void);
+
+#endif /* HEAPTRACE_MMAPTRACE_H */
@@ -0,0 +1,154 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cinttypes>
+#include <cstdarg>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "outbuf.h"
+
+// size of the buffer, a backtrace longer than this is cut.
+#define OUTBUF_SIZE (1024 * 1024)
+
+// used when mmap() fails, a dump is printed by one thread at a time.
+static char fallback_buf[16 * 1024];
+
+outbuf_t::outbuf_t(FILE *fp)
+	: fp(fp)
+	, len(0)
+	, committed(0)
+	, in_progress(false)
+{
+	void *p = mmap(nullptr, OUTBUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		       -1, 0);
+
+	if (p != MAP_FAILED) {
+		buf = static_cast<char *>(p);
+		size = OUTBUF_SIZE;
+	}
+	else {
+		buf = fallback_buf;
+		size = sizeof(fallback_buf);
+	}
+}
+
+outbuf_t::~outbuf_t()
+{
+	flush();
+	if (buf != fallback_buf)
+		munmap(buf, size);
+}
+
+// writes out the committed text and moves the pending text to the front.
+void outbuf_t::drain(void)
+{
+	if (committed == 0)
+		return;
+
+	fwrite(buf, 1, committed, fp);
+	memmove(buf, buf + committed, len - committed);
+	len -= committed;
+	committed = 0;
+}
+
+void outbuf_t::printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	while (true) {
+		size_t avail = size - len;
+
+		va_start(ap, fmt);
+		int n = vsnprintf(buf + len, avail, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+
+		if ((size_t)n < avail) {
+			len += n;
+			break;
+		}
+
+		if (committed == 0) {
+			// the pending text fills the whole buffer, cut it.
+			len = size - 1;
+			break;
+		}
+		drain();
+	}
+
+	if (!in_progress)
+		committed = len;
+}
+
+void outbuf_t::begin(void)
+{
+	committed = len;
+	in_progress = true;
+}
+
+void outbuf_t::commit(void)
+{
+	committed = len;
+	in_progress = false;
+}
+
+void outbuf_t::rollback(void)
+{
+	len = committed;
+	in_progress = false;
+}
+
+void outbuf_t::flush(void)
+{
+	committed = len;
+	drain();
+	fflush(fp);
+}
+
+const char *format_byte_unit(char *buf, uint64_t size)
+{
+	uint64_t mb = size / 1000000;
+	uint64_t kb = size / 1000 % 1000;
+	uint64_t b = size % 1000;
+
+	if (mb > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRIu64 ".%" PRIu64 " MB", mb, kb);
+	else if (kb > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRIu64 ".%" PRIu64 " KB", kb, b);
+	else
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRIu64 " bytes", b);
+	return buf;
+}
+
+const char *format_delta_byte_unit(char *buf, int64_t delta)
+{
+	buf[0] = delta < 0 ? '-' : '+';
+	format_byte_unit(buf + 1, delta < 0 ? -delta : delta);
+	return buf;
+}
+
+const char *format_time_unit(char *buf, int64_t nsec)
+{
+	int64_t h = nsec / 3600000000000LL;
+	int64_t mins = nsec / 60000000000LL % 60;
+	int64_t secs = nsec / 1000000000 % 60;
+	int64_t millis = nsec / 1000000 % 1000;
+	int64_t micros = nsec / 1000 % 1000;
+	int64_t nanos = nsec % 1000;
+
+	if (h > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRId64 " hours %" PRId64 " mins", h, mins);
+	else if (mins > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRId64 " mins %" PRId64 " secs", mins, secs);
+	else if (secs > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRId64 ".%" PRId64 " secs", secs, millis);
+	else if (millis > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRId64 ".%" PRId64 " ms", millis, micros);
+	else if (micros > 0)
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRId64 ".%" PRId64 " us", micros, nanos);
+	else
+		snprintf(buf, UNIT_BUF_SIZE, "%" PRId64 " ns", nanos);
+	return buf;
+}
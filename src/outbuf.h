@@ -0,0 +1,59 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_OUTBUF_H
+#define HEAPTRACE_OUTBUF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// outbuf_t collects the text of a dump in a buffer allocated by mmap() and
+// writes it to the file in large chunks, so printing a dump doesn't allocate
+// from the heap of the traced program for each line.
+//
+// The text after begin() is pending until commit(), and rollback() drops it,
+// e.g. for an ignored backtrace.  Only the committed text is written when
+// the buffer gets full, so a pending text is cut if it doesn't fit in the
+// whole buffer.
+class outbuf_t {
+public:
+	explicit outbuf_t(FILE *fp);
+	~outbuf_t();
+
+	void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	void begin(void);
+	void commit(void);
+	void rollback(void);
+
+	// the text since begin()
+	const char *pending(void) const
+	{
+		return buf + committed;
+	}
+	size_t pending_size(void) const
+	{
+		return len - committed;
+	}
+
+	void flush(void);
+
+private:
+	void drain(void);
+
+	FILE *fp;
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t committed;
+	bool in_progress;
+};
+
+// Fixed size formatters for the units, they return buf.
+#define UNIT_BUF_SIZE 32
+
+const char *format_byte_unit(char *buf, uint64_t size);
+const char *format_delta_byte_unit(char *buf, int64_t delta);
+const char *format_time_unit(char *buf, int64_t nsec);
+
+#endif /* HEAPTRACE_OUTBUF_H */
@@ -0,0 +1,331 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <link.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "elffile.h"
+#include "heaptrace.h"
+#include "outbuf.h"
+#include "raw.h"
+
+// loaded range of an object and its build-id
+struct dl_object_t {
+	uint64_t start;
+	uint64_t end;
+	std::string build_id;
+};
+
+static int get_dl_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	auto *objects = static_cast<std::vector<dl_object_t> *>(data);
+	dl_object_t obj = { UINT64_MAX, 0 };
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uint64_t start = info->dlpi_addr + phdr->p_vaddr;
+
+		if (phdr->p_type == PT_LOAD) {
+			obj.start = std::min(obj.start, start);
+			obj.end = std::max(obj.end, start + phdr->p_memsz);
+		}
+		else if (phdr->p_type == PT_NOTE && obj.build_id.empty()) {
+			obj.build_id = elf_note_build_id((const void *)start, phdr->p_memsz);
+		}
+	}
+
+	if (obj.start < obj.end && !obj.build_id.empty())
+		objects->push_back(obj);
+	return 0;
+}
+
+void read_self_maps(std::vector<raw_map_t> &maps)
+{
+	std::vector<dl_object_t> objects;
+	std::ifstream fs("/proc/self/maps");
+	std::string line;
+
+	dl_iterate_phdr(get_dl_object, &objects);
+
+	while (std::getline(fs, line)) {
+		raw_map_t map;
+		char perms[8];
+		int pos = 0;
+
+		if (sscanf(line.c_str(), "%" SCNx64 "-%" SCNx64 " %7s %" SCNx64 " %*s %*s %n",
+			   &map.start, &map.end, perms, &map.offset, &pos) != 4 || pos == 0)
+			continue;
+
+		// only file mappings are needed to symbolize the stacks.
+		const char *path = line.c_str() + pos;
+		if (path[0] != '/')
+			continue;
+
+		map.perms = perms;
+		map.path = path;
+		for (const auto &obj : objects) {
+			if (obj.start <= map.start && map.start < obj.end) {
+				map.build_id = obj.build_id;
+				break;
+			}
+		}
+		maps.push_back(map);
+	}
+}
+
+static void print_numbers(outbuf_t &ob, const uint64_t *values, int n)
+{
+	for (int i = 0; i < n; i++)
+		ob.printf(" %" PRIx64, values[i]);
+}
+
+void write_raw_dump(const dump_stacks_t &stacks, const char *sort_keys,
+		    const dump_info_t &info)
+{
+	outbuf_t ob(outfp);
+	dump_stack_t stack;
+	const stack_trace_t &stack_trace = stack.first;
+	const stack_info_t &sinfo = stack.second;
+
+	ob.printf("heaptrace-raw-dump %d %ld %s %s\n", RAW_DUMP_VERSION, info.pid, sort_keys,
+		  info.comm.c_str());
+
+	std::vector<raw_map_t> maps;
+
+	read_self_maps(maps);
+	for (const auto &map : maps) {
+		ob.printf("map %" PRIx64 "-%" PRIx64 " %s %" PRIx64 " %s %s\n", map.start, map.end,
+			  map.perms.c_str(), map.offset,
+			  map.build_id.empty() ? "-" : map.build_id.c_str(), map.path.c_str());
+	}
+
+	for (const auto &key : stacks.keys) {
+		if (!stacks.read(key.id, stacks.arg, stack))
+			continue;
+
+		std::chrono::nanoseconds age = info.time - sinfo.birth_time;
+
+		ob.printf("stack %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64,
+			  (uint64_t)sinfo.count, (uint64_t)sinfo.peak_count,
+			  (uint64_t)sinfo.total_size, (uint64_t)sinfo.peak_total_size,
+			  (uint64_t)age.count());
+		ob.printf(" %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %zx",
+			  sinfo.nr_allocs, sinfo.alloc_bytes, sinfo.nr_frees, sinfo.free_bytes,
+			  sinfo.waste, sinfo.stack_depth);
+		for (size_t i = 0; i < sinfo.stack_depth; i++)
+			ob.printf(" %lx", (unsigned long)stack_trace[i]);
+		ob.printf("\n");
+
+		ob.printf("hist");
+		print_numbers(ob, sinfo.size_class, NR_SIZE_CLASSES);
+		print_numbers(ob, sinfo.lifetime, NR_LIFETIME_BUCKETS);
+		ob.printf("\n");
+	}
+
+	std::chrono::nanoseconds elapsed = info.time - info.start;
+
+	ob.printf("info %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %x %" PRIx64
+		  " %" PRIx64 " %" PRIx64 "\n",
+		  info.alloc_virtual, info.alloc_resident, info.statm_vss, info.statm_rss,
+		  info.statm_shared, info.async, info.nr_overflows, info.sample_rate,
+		  (uint64_t)elapsed.count());
+
+	ob.printf("lifetime");
+	print_numbers(ob, info.lifetime, NR_LIFETIME_BUCKETS);
+	ob.printf("\n");
+
+	for (const auto &td : info.threads) {
+		ob.printf("thread %x %x %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64
+			  " %" PRIx64 " %s\n",
+			  td.tid, td.exited, td.total_size, td.count, td.nr_allocs, td.nr_frees,
+			  td.remote_frees, td.foreign_frees, td.comm.c_str());
+	}
+
+	ob.printf("heaptrace-raw-end\n");
+}
+
+static bool read_raw_stack(std::istringstream &ss, const time_point_t &now, dump_stack_t &stack)
+{
+	stack_trace_t &stack_trace = stack.first;
+	stack_info_t &sinfo = stack.second;
+	uint64_t count, peak_count, age;
+	size_t depth;
+
+	sinfo = {};
+	ss >> count >> peak_count >> sinfo.total_size >> sinfo.peak_total_size >> age >>
+		sinfo.nr_allocs >> sinfo.alloc_bytes >> sinfo.nr_frees >> sinfo.free_bytes >>
+		sinfo.waste >> depth;
+	if (ss.fail())
+		return false;
+
+	stack_trace = {};
+	for (size_t i = 0; i < depth; i++) {
+		unsigned long addr;
+
+		ss >> addr;
+		if (ss.fail())
+			return false;
+		// keep the innermost frames if it's built with a smaller DEPTH.
+		if (i < DEPTH)
+			stack_trace[i] = (void *)addr;
+	}
+
+	sinfo.stack_depth = std::min(depth, (size_t)DEPTH);
+	sinfo.count = count;
+	sinfo.peak_count = peak_count;
+	sinfo.birth_time = now - std::chrono::nanoseconds(age);
+	return true;
+}
+
+static bool read_raw_map(std::istringstream &ss, raw_map_t &map)
+{
+	char dash;
+
+	ss >> map.start >> dash >> map.end >> map.perms >> map.offset >> map.build_id >> std::ws;
+	if (ss.fail() || dash != '-')
+		return false;
+
+	if (map.build_id == "-")
+		map.build_id.clear();
+	std::getline(ss, map.path);
+	return !map.path.empty();
+}
+
+static bool read_raw_info(std::istringstream &ss, dump_info_t &info)
+{
+	uint64_t elapsed;
+	int async;
+
+	ss >> info.alloc_virtual >> info.alloc_resident >> info.statm_vss >> info.statm_rss >>
+		info.statm_shared >> async >> info.nr_overflows >> info.sample_rate >> elapsed;
+	if (ss.fail())
+		return false;
+
+	info.async = async;
+	info.start = info.time - std::chrono::nanoseconds(elapsed);
+	return true;
+}
+
+static bool read_numbers(std::istringstream &ss, uint64_t *values, int n)
+{
+	for (int i = 0; i < n; i++)
+		ss >> values[i];
+	return !ss.fail();
+}
+
+static bool read_raw_hist(std::istringstream &ss, stack_info_t &sinfo)
+{
+	stack_info_t tmp;
+
+	// don't leave a half of them on a broken line.
+	if (!read_numbers(ss, tmp.size_class, NR_SIZE_CLASSES) ||
+	    !read_numbers(ss, tmp.lifetime, NR_LIFETIME_BUCKETS))
+		return false;
+
+	memcpy(sinfo.size_class, tmp.size_class, sizeof(sinfo.size_class));
+	memcpy(sinfo.lifetime, tmp.lifetime, sizeof(sinfo.lifetime));
+	return true;
+}
+
+static bool read_raw_thread(std::istringstream &ss, thread_dump_t &td)
+{
+	int exited;
+
+	ss >> td.tid >> exited >> td.total_size >> td.count >> td.nr_allocs >> td.nr_frees >>
+		td.remote_frees >> td.foreign_frees >> std::ws;
+	if (ss.fail())
+		return false;
+
+	td.exited = exited;
+	std::getline(ss, td.comm);
+	return true;
+}
+
+bool read_raw_dumps(const char *filename, std::vector<raw_dump_t> &dumps)
+{
+	std::ifstream fs(filename);
+	std::string line;
+	raw_dump_t *dump = nullptr;
+	time_point_t now = std::chrono::steady_clock::now();
+
+	if (!fs.is_open())
+		return false;
+
+	while (std::getline(fs, line)) {
+		std::istringstream ss(line);
+		std::string tag;
+
+		ss >> tag;
+		if (tag == "heaptrace-raw-dump") {
+			int version;
+
+			ss >> version;
+			if (ss.fail() || version != RAW_DUMP_VERSION) {
+				dump = nullptr;
+				continue;
+			}
+
+			dumps.emplace_back();
+			dump = &dumps.back();
+			dump->info = {};
+			dump->info.time = now;
+			dump->info.start = now;
+			ss >> dump->info.pid >> dump->sort_keys >> std::ws;
+			std::getline(ss, dump->info.comm);
+			continue;
+		}
+
+		// ignore anything out of a dump, e.g. messages of the program.
+		if (!dump)
+			continue;
+
+		ss >> std::hex;
+		if (tag == "stack") {
+			dump_stack_t stack;
+
+			if (read_raw_stack(ss, now, stack))
+				dump->stacks.push_back(stack);
+		}
+		else if (tag == "map") {
+			raw_map_t map;
+
+			if (read_raw_map(ss, map))
+				dump->maps.push_back(map);
+		}
+		else if (tag == "hist") {
+			if (!dump->stacks.empty())
+				read_raw_hist(ss, dump->stacks.back().second);
+		}
+		else if (tag == "info") {
+			read_raw_info(ss, dump->info);
+		}
+		else if (tag == "lifetime") {
+			uint64_t lifetime[NR_LIFETIME_BUCKETS];
+
+			if (read_numbers(ss, lifetime, NR_LIFETIME_BUCKETS))
+				memcpy(dump->info.lifetime, lifetime, sizeof(lifetime));
+		}
+		else if (tag == "thread") {
+			thread_dump_t td;
+
+			if (read_raw_thread(ss, td))
+				dump->info.threads.push_back(td);
+		}
+		else if (tag == "heaptrace-raw-end") {
+			dump = nullptr;
+		}
+	}
+
+	return !dumps.empty();
+}
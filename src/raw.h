@@ -0,0 +1,63 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_RAW_H
+#define HEAPTRACE_RAW_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dump.h"
+
+// A raw dump keeps the stacks unsymbolized together with the file mappings of
+// the process so that 'heaptrace report' can symbolize them later from the
+// ELF files.  It's a line oriented text format:
+//
+//   heaptrace-raw-dump <version> <pid> <sort keys> <comm>
+//   map <start>-<end> <perms> <offset> <build-id or -> <path>
+//   stack <count> <peak count> <size> <peak size> <age in ns> <allocs> <alloc bytes>
+//         <frees> <free bytes> <waste> <depth> <addr>...
+//   hist <size class>... <lifetime>...
+//   info <alloc virtual> <alloc resident> <vss> <rss> <shared> <async> <overflows> <sample rate>
+//        <elapsed in ns>
+//   lifetime <lifetime>...
+//   thread <tid> <exited> <size> <count> <allocs> <frees> <remote frees> <foreign frees> <comm>
+//   heaptrace-raw-end
+//
+// A record is a single line, wrapped above only to fit.  The hist record has
+// the NR_SIZE_CLASSES and NR_LIFETIME_BUCKETS numbers of the stack before it.
+// The stacks without live objects are kept for the cumulative sort keys.
+// Numbers are in hex except for the version and the pid.  The comm and the
+// path are the rest of their lines as they might have spaces.  Readers ignore
+// unknown lines so that new records can be added later.
+
+#define RAW_DUMP_VERSION 1
+
+struct raw_map_t {
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+	std::string perms;
+	// hex string of the GNU build-id, empty if unknown
+	std::string build_id;
+	std::string path;
+};
+
+struct raw_dump_t {
+	dump_info_t info;
+	std::string sort_keys;
+	std::vector<dump_stack_t> stacks;
+	std::vector<raw_map_t> maps;
+};
+
+// Reads the file mappings of the current process with their build-ids.
+void read_self_maps(std::vector<raw_map_t> &maps);
+
+void write_raw_dump(const dump_stacks_t &stacks, const char *sort_keys,
+		    const dump_info_t &info);
+
+// Reads all the dumps in the file.  It returns false if the file cannot be
+// read or has no dump.
+bool read_raw_dumps(const char *filename, std::vector<raw_dump_t> &dumps);
+
+#endif /* HEAPTRACE_RAW_H */
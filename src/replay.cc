@@ -0,0 +1,285 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "dump.h"
+#include "evlog.h"
+#include "heaptrace.h"
+#include "outbuf.h"
+#include "utils.h"
+
+// set in the environment after the allocator is preloaded.
+#define REPLAY_ALLOCATOR_ENV "HEAPTRACE_REPLAY_ALLOCATOR"
+
+#define PAGE_SIZE_MIN 4096
+
+enum replay_op_type {
+	REPLAY_MALLOC,
+	REPLAY_FREE,
+	REPLAY_REALLOC,
+};
+
+struct replay_op_t {
+	uint32_t type;
+	// index of the object slot, an object can be freed by other thread.
+	uint32_t slot;
+	// the old object slot of realloc
+	uint32_t old_slot;
+	uint64_t size;
+};
+
+struct replay_thread_t {
+	uint32_t tid;
+	std::vector<replay_op_t> ops;
+};
+
+struct replay_stat_t {
+	size_t nr_mallocs;
+	size_t nr_frees;
+	size_t nr_reallocs;
+	uint64_t peak_size;
+};
+
+// allocated by the replay, nullptr until the allocation is replayed.
+static std::atomic<void *> *slots;
+
+// marks a failed allocation so that its free doesn't wait forever.
+static char failed_slot;
+
+static std::atomic<bool> replay_done;
+
+// Converts the events into per-thread operations keeping the order in each
+// thread.  A free of an object that was allocated before the log started
+// cannot be replayed so it's dropped.
+static size_t build_replay(const evlog_data_t &data, std::vector<replay_thread_t> &threads,
+			   replay_stat_t &stat)
+{
+	std::map<uint32_t, size_t> thread_idx;
+	std::unordered_map<uint64_t, std::pair<uint32_t, uint64_t>> live;
+	// the slot freed by the first half of realloc in each thread
+	std::unordered_map<uint32_t, uint32_t> pending;
+	uint64_t total_size = 0;
+	uint32_t nr_slots = 0;
+
+	stat = {};
+
+	auto get_thread = [&](uint32_t tid) -> replay_thread_t & {
+		auto it = thread_idx.find(tid);
+		if (it == thread_idx.end()) {
+			it = thread_idx.emplace(tid, threads.size()).first;
+			threads.push_back({ tid });
+		}
+		return threads[it->second];
+	};
+
+	// realloc() that returned nullptr only freed the object.
+	auto flush_pending = [&](uint32_t tid) {
+		auto it = pending.find(tid);
+		if (it == pending.end())
+			return;
+		get_thread(tid).ops.push_back({ REPLAY_FREE, it->second });
+		stat.nr_frees++;
+		pending.erase(it);
+	};
+
+	for (const auto &ev : data.events) {
+		if (ev.type == EVLOG_ALLOC) {
+			auto it = pending.find(ev.tid);
+			uint32_t slot = nr_slots++;
+
+			if ((ev.flags & EVENT_REALLOC) && it != pending.end()) {
+				get_thread(ev.tid).ops.push_back(
+					{ REPLAY_REALLOC, slot, it->second, ev.size });
+				stat.nr_reallocs++;
+				pending.erase(it);
+			}
+			else {
+				flush_pending(ev.tid);
+				get_thread(ev.tid).ops.push_back({ REPLAY_MALLOC, slot, 0, ev.size });
+				stat.nr_mallocs++;
+			}
+
+			live[ev.addr] = { slot, ev.size };
+			total_size += ev.size;
+			stat.peak_size = std::max(stat.peak_size, total_size);
+		}
+		else if (ev.type == EVLOG_FREE) {
+			auto it = live.find(ev.addr);
+
+			flush_pending(ev.tid);
+			if (it == live.end())
+				continue;
+
+			if (ev.flags & EVENT_REALLOC) {
+				pending[ev.tid] = it->second.first;
+			}
+			else {
+				get_thread(ev.tid).ops.push_back({ REPLAY_FREE, it->second.first });
+				stat.nr_frees++;
+			}
+			total_size -= it->second.second;
+			live.erase(it);
+		}
+	}
+
+	while (!pending.empty())
+		flush_pending(pending.begin()->first);
+
+	return nr_slots;
+}
+
+// touches every page so that the RSS reflects the allocation.
+static void touch_pages(void *p, uint64_t size)
+{
+	auto *ptr = static_cast<volatile char *>(p);
+
+	for (uint64_t i = 0; i < size; i += PAGE_SIZE_MIN)
+		ptr[i] = 0;
+}
+
+static void *wait_slot(uint32_t slot)
+{
+	void *p;
+
+	while (!(p = slots[slot].load(std::memory_order_acquire)))
+		sched_yield();
+	return p == &failed_slot ? nullptr : p;
+}
+
+static void replay_thread(const replay_thread_t *thread)
+{
+	for (const auto &op : thread->ops) {
+		void *p;
+
+		switch (op.type) {
+		case REPLAY_MALLOC:
+			p = malloc(op.size);
+			touch_pages(p, p ? op.size : 0);
+			slots[op.slot].store(p ? p : &failed_slot, std::memory_order_release);
+			break;
+
+		case REPLAY_FREE:
+			free(wait_slot(op.slot));
+			break;
+
+		case REPLAY_REALLOC:
+			p = realloc(wait_slot(op.old_slot), op.size);
+			touch_pages(p, p ? op.size : 0);
+			slots[op.slot].store(p ? p : &failed_slot, std::memory_order_release);
+			break;
+		}
+	}
+}
+
+static uint64_t read_rss(void)
+{
+	long vss = 0;
+	long rss = 0;
+	std::ifstream fs("/proc/self/statm");
+
+	fs >> vss >> rss;
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void rss_sampler(std::atomic<uint64_t> *peak_rss)
+{
+	while (!replay_done.load(std::memory_order_acquire)) {
+		uint64_t rss = read_rss();
+
+		if (rss > peak_rss->load(std::memory_order_relaxed))
+			peak_rss->store(rss, std::memory_order_relaxed);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// Runs itself again with the allocator preloaded.
+static void preload_allocator(const char *allocator, char *argv[])
+{
+	std::string preload = allocator;
+	char *old_preload = getenv("LD_PRELOAD");
+
+	if (old_preload)
+		preload += std::string(":") + old_preload;
+
+	setenv("LD_PRELOAD", preload.c_str(), 1);
+	setenv(REPLAY_ALLOCATOR_ENV, allocator, 1);
+
+	execv("/proc/self/exe", argv);
+	perror("heaptrace");
+}
+
+int command_replay(struct opts *opts, char *argv[])
+{
+	std::vector<replay_thread_t> threads;
+	std::vector<std::thread> workers;
+	evlog_data_t evlog;
+	replay_stat_t stat;
+	const char *allocator = getenv(REPLAY_ALLOCATOR_ENV);
+
+	if (opts->allocator && !allocator) {
+		preload_allocator(opts->allocator, argv);
+		return -1;
+	}
+
+	if (!is_evlog(opts->exename) || !read_evlog(opts->exename, evlog)) {
+		fprintf(stderr, "heaptrace: no event log in %s\n", opts->exename);
+		return -1;
+	}
+
+	size_t nr_slots = build_replay(evlog, threads, stat);
+	size_t nr_ops = stat.nr_mallocs + stat.nr_frees + stat.nr_reallocs;
+
+	// the log is not needed anymore, release it before the measurement.
+	evlog = {};
+
+	slots = new std::atomic<void *>[nr_slots]();
+
+	std::atomic<uint64_t> peak_rss(read_rss());
+	uint64_t base_rss = peak_rss.load();
+	std::thread sampler(rss_sampler, &peak_rss);
+
+	auto start = std::chrono::steady_clock::now();
+	for (const auto &thread : threads)
+		workers.emplace_back(replay_thread, &thread);
+	for (auto &worker : workers)
+		worker.join();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	replay_done.store(true, std::memory_order_release);
+	sampler.join();
+
+	uint64_t rss = peak_rss.load() - base_rss;
+	double secs = std::chrono::duration<double>(elapsed).count();
+	char buf[UNIT_BUF_SIZE];
+
+	pr_out("[heaptrace] replay of %s with %s\n", opts->exename,
+	       allocator ? allocator : "the default allocator");
+	pr_out("[heaptrace] %zd mallocs, %zd frees and %zd reallocs in %zd threads\n",
+	       stat.nr_mallocs, stat.nr_frees, stat.nr_reallocs, threads.size());
+	pr_out("[heaptrace] elapsed time       : %s\n",
+	       format_time_unit(buf, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+					     .count()));
+	pr_out("[heaptrace] throughput         : %.0f ops/sec\n", secs > 0 ? nr_ops / secs : 0);
+	pr_out("[heaptrace] peak live size     : %s\n", format_byte_unit(buf, stat.peak_size));
+	pr_out("[heaptrace] peak RSS increase  : %s\n", format_byte_unit(buf, rss));
+	if (stat.peak_size)
+		pr_out("[heaptrace] fragmentation      : %.2f (peak RSS / peak live size)\n",
+		       (double)rss / stat.peak_size);
+
+	// the replayed objects are not freed as the process exits anyway.
+	return 0;
+}
@@ -0,0 +1,283 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dump.h"
+#include "elffile.h"
+#include "evlog.h"
+#include "heaptrace.h"
+#include "outbuf.h"
+#include "raw.h"
+#include "snapshot.h"
+#include "symbol.h"
+
+// the dump being reported, its maps are used to symbolize the addresses.
+static const raw_dump_t *cur_dump;
+
+static std::unordered_map<void *, symbol_t> symbol_cache;
+
+// ELF files are shared across the dumps, nullptr if it cannot be used.
+static std::map<std::string, elf_file_t *> elf_cache;
+
+static elf_file_t *get_elf_file(const raw_map_t &map)
+{
+	auto it = elf_cache.find(map.path);
+	if (it != elf_cache.end())
+		return it->second;
+
+	auto *elf = new elf_file_t;
+	if (!elf->load(map.path)) {
+		fprintf(stderr, "heaptrace: cannot read %s\n", map.path.c_str());
+		delete elf;
+		elf = nullptr;
+	}
+	else if (!map.build_id.empty() && !elf->build_id().empty() &&
+		 map.build_id != elf->build_id()) {
+		// symbols of a different build would be just wrong.
+		fprintf(stderr, "heaptrace: build-id of %s doesn't match\n", map.path.c_str());
+		delete elf;
+		elf = nullptr;
+	}
+
+	elf_cache[map.path] = elf;
+	return elf;
+}
+
+static const raw_map_t *find_map(uint64_t addr)
+{
+	for (const auto &map : cur_dump->maps) {
+		if (map.start <= addr && addr < map.end)
+			return &map;
+	}
+	return nullptr;
+}
+
+// the lowest mapping of the file as dladdr() gives in dli_fbase
+static uint64_t get_load_base(const raw_map_t &map)
+{
+	uint64_t base = map.start;
+
+	for (const auto &m : cur_dump->maps) {
+		if (m.path == map.path && m.start < base)
+			base = m.start;
+	}
+	return base;
+}
+
+static void resolve_symbol(void *addr, symbol_t &sym)
+{
+	const raw_map_t *map = find_map((uintptr_t)addr);
+	uint64_t vaddr;
+
+	sym.found = map != nullptr;
+	if (!sym.found)
+		return;
+
+	sym.fname = map->path;
+	sym.file_offset = (int)((uintptr_t)addr - get_load_base(*map));
+
+	elf_file_t *elf = get_elf_file(*map);
+	if (!elf || !elf->offset_to_vaddr((uintptr_t)addr - map->start + map->offset, &vaddr))
+		return;
+
+	const elf_symbol_t *esym = elf->find_symbol(vaddr);
+	if (!esym)
+		return;
+
+	// keep the same unit of the offset as lookup_symbol().
+	sym.name = demangle_symbol(esym->name.c_str());
+	sym.offset = (int)((vaddr - esym->addr) / sizeof(int));
+}
+
+static const symbol_t &report_symbol(void *addr)
+{
+	auto it = symbol_cache.find(addr);
+	if (it != symbol_cache.end())
+		return it->second;
+
+	symbol_t &sym = symbol_cache[addr];
+	resolve_symbol(addr, sym);
+	return sym;
+}
+
+// per-stack state while replaying the event log
+struct replay_stack_t {
+	stack_info_t info;
+	uint64_t birth_ns;
+};
+
+struct replay_object_t {
+	uint64_t size;
+	uint32_t stack_id;
+};
+
+// Replays the events up to nr_events, or all the events if it's SIZE_MAX.
+// It returns the index of the event at the peak of the heap usage.
+static size_t replay_evlog(const evlog_data_t &data, size_t nr_events,
+			   std::vector<replay_stack_t> &stacks)
+{
+	std::unordered_map<uint64_t, replay_object_t> objects;
+	uint64_t total_size = 0;
+	uint64_t peak_size = 0;
+	size_t peak = 0;
+
+	stacks.assign(data.stacks.size(), {});
+
+	for (size_t i = 0; i < data.events.size() && i < nr_events; i++) {
+		const evlog_event_t &ev = data.events[i];
+
+		if (ev.type == EVLOG_CLEAR) {
+			objects.clear();
+			stacks.assign(data.stacks.size(), {});
+			total_size = 0;
+		}
+		else if (ev.type == EVLOG_ALLOC && ev.stack_id != STACK_ID_NONE) {
+			stack_info_t &info = stacks[ev.stack_id].info;
+
+			if (info.count == 0) {
+				info = {};
+				stacks[ev.stack_id].birth_ns = ev.time;
+			}
+			info.total_size += ev.size;
+			info.peak_total_size = std::max(info.peak_total_size, info.total_size);
+			info.count++;
+			info.peak_count = std::max(info.peak_count, info.count);
+
+			objects[ev.addr] = { ev.size, ev.stack_id };
+			total_size += ev.size;
+		}
+		else if (ev.type == EVLOG_FREE) {
+			auto it = objects.find(ev.addr);
+			if (it == objects.end())
+				continue;
+
+			stack_info_t &info = stacks[it->second.stack_id].info;
+			info.total_size -= it->second.size;
+			info.count--;
+
+			total_size -= it->second.size;
+			objects.erase(it);
+		}
+
+		if (total_size > peak_size) {
+			peak_size = total_size;
+			peak = i;
+		}
+	}
+	return peak;
+}
+
+// Makes a dump of the live objects at the peak of the heap usage.
+static void evlog_peak_dump(const evlog_data_t &data, raw_dump_t &dump)
+{
+	std::vector<replay_stack_t> stacks;
+	size_t peak = replay_evlog(data, SIZE_MAX, stacks);
+	uint64_t start = data.events.front().time;
+	uint64_t peak_time = data.events[peak].time;
+	uint64_t peak_size = 0;
+	size_t nr_allocs = 0;
+	size_t nr_frees = 0;
+
+	replay_evlog(data, peak + 1, stacks);
+
+	dump.info = {};
+	dump.info.pid = data.pid;
+	dump.info.comm = data.comm;
+	dump.info.time = std::chrono::steady_clock::now();
+	dump.maps = data.maps;
+
+	for (size_t i = 0; i < stacks.size(); i++) {
+		stack_info_t info = stacks[i].info;
+
+		if (info.count == 0)
+			continue;
+
+		info.stack_depth = data.stacks[i].depth;
+		info.birth_time =
+			dump.info.time - std::chrono::nanoseconds(peak_time - stacks[i].birth_ns);
+		dump.stacks.emplace_back(data.stacks[i].stack_trace, info);
+		peak_size += info.total_size;
+	}
+
+	for (const auto &ev : data.events) {
+		nr_allocs += ev.type == EVLOG_ALLOC;
+		nr_frees += ev.type == EVLOG_FREE;
+	}
+
+	if (!opts.flamegraph) {
+		std::chrono::nanoseconds duration(data.events.back().time - start);
+		std::chrono::nanoseconds at(peak_time - start);
+		char buf[2][UNIT_BUF_SIZE];
+
+		pr_out("[heaptrace] event log of /proc/%ld/maps (%s)\n", (long)data.pid,
+		       data.comm.c_str());
+		pr_out("[heaptrace] %zd allocs and %zd frees in %s\n", nr_allocs, nr_frees,
+		       format_time_unit(buf[0], duration.count()));
+		pr_out("[heaptrace] heap peak %s at %s (event #%zd)\n",
+		       format_byte_unit(buf[0], peak_size), format_time_unit(buf[1], at.count()), peak);
+	}
+}
+
+int command_report(struct opts *opts)
+{
+	std::vector<raw_dump_t> dumps;
+	evlog_data_t evlog;
+
+	if (opts->outfile) {
+		outfp = fopen(opts->outfile, "w");
+		if (!outfp) {
+			perror(opts->outfile);
+			return -1;
+		}
+	}
+
+	if (is_evlog(opts->exename)) {
+		if (!read_evlog(opts->exename, evlog) || evlog.events.empty()) {
+			fprintf(stderr, "heaptrace: no event in %s\n", opts->exename);
+			return -1;
+		}
+		// show the objects at the peak as it's the most interesting.
+		dumps.emplace_back();
+		evlog_peak_dump(evlog, dumps.back());
+	}
+	else if (is_snapshot(opts->exename)) {
+		dumps.emplace_back();
+		if (!read_snapshot(opts->exename, dumps.back())) {
+			fprintf(stderr, "heaptrace: invalid snapshot %s\n", opts->exename);
+			return -1;
+		}
+	}
+	else if (!read_raw_dumps(opts->exename, dumps)) {
+		fprintf(stderr, "heaptrace: no raw dump in %s\n", opts->exename);
+		return -1;
+	}
+
+	for (auto &dump : dumps) {
+		const char *sort_keys = opts->sort_keys ? opts->sort_keys : dump.sort_keys.c_str();
+
+		if (dump.stacks.empty())
+			continue;
+
+		// addresses are valid only within the dump.
+		cur_dump = &dump;
+		symbol_cache.clear();
+
+		dump_stacks_t stacks;
+
+		make_dump_stacks(dump.stacks, stacks);
+		print_dump(stacks, sort_keys, opts->flamegraph, dump.info, report_symbol);
+	}
+
+	if (opts->outfile)
+		fclose(outfp);
+	return 0;
+}
@@ -0,0 +1,70 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cmath>
+#include <ctime>
+
+#include <algorithm>
+
+#include "compiler.h"
+#include "heaptrace.h"
+#include "sampling.h"
+#include "utils.h"
+
+// xorshift64* generator, returns a number in (0, 1].
+static double next_random(void)
+{
+	auto *tfs = &thread_flags;
+
+	if (unlikely(tfs->random_state == 0)) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		tfs->random_state = utils::hash_mix(utils::gettid() ^ ts.tv_nsec) | 1;
+	}
+
+	tfs->random_state ^= tfs->random_state >> 12;
+	tfs->random_state ^= tfs->random_state << 25;
+	tfs->random_state ^= tfs->random_state >> 27;
+
+	uint64_t r = tfs->random_state * 0x2545f4914f6cdd1dULL;
+	return ((r >> 11) + 1) * (1.0 / (1ULL << 53));
+}
+
+// The interval between samples follows the exponential distribution.
+static uint64_t next_sample_interval(void)
+{
+	return (uint64_t)(-std::log(next_random()) * opts.sample_rate) + 1;
+}
+
+bool __sample_allocation(size_t size)
+{
+	auto *tfs = &thread_flags;
+
+	// the first allocation of a thread starts a new interval.
+	if (unlikely(tfs->bytes_until_sample == 0)) {
+		tfs->bytes_until_sample = next_sample_interval();
+		if (tfs->bytes_until_sample > size) {
+			tfs->bytes_until_sample -= size;
+			return false;
+		}
+	}
+
+	tfs->bytes_until_sample = next_sample_interval();
+	return true;
+}
+
+void sample_weight(size_t size, uint64_t *est_size, uint32_t *est_count)
+{
+	double prob = -std::expm1(-(double)size / opts.sample_rate);
+	double count = prob > 0 ? 1 / prob : 1;
+	// a tiny object at a huge sample rate can weigh more than the count holds.
+	double clamped = std::min(count, (double)UINT32_MAX);
+	uint32_t whole = (uint32_t)clamped;
+
+	// round it up randomly by the fraction to keep the estimate unbiased.
+	if (next_random() <= clamped - whole)
+		whole++;
+
+	*est_count = whole;
+	*est_size = (uint64_t)std::llround(size * count);
+}
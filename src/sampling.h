@@ -0,0 +1,35 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_SAMPLING_H
+#define HEAPTRACE_SAMPLING_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "compiler.h"
+#include "heaptrace.h"
+
+// In sampling mode, allocations are sampled as a Poisson process over the
+// allocated bytes with the mean interval of opts.sample_rate bytes, the same
+// way as tcmalloc and jemalloc do.  So an allocation of size bytes is picked
+// with the probability of 1 - exp(-size / sample_rate).
+
+bool __sample_allocation(size_t size);
+
+// This is called for every allocation so keep the fast path inline.
+inline bool sample_allocation(size_t size)
+{
+	auto *tfs = &thread_flags;
+
+	if (likely(tfs->bytes_until_sample > size)) {
+		tfs->bytes_until_sample -= size;
+		return false;
+	}
+	return __sample_allocation(size);
+}
+
+// Estimates the number of allocations and their total size that a sampled
+// allocation of size bytes stands for.
+void sample_weight(size_t size, uint64_t *est_size, uint32_t *est_count);
+
+#endif /* HEAPTRACE_SAMPLING_H */
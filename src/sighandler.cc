@@ -2,25 +2,24 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 #include <csignal>
 
+#include "control.h"
 #include "heaptrace.h"
-#include "stacktrace.h"
 
+// The handlers can interrupt the hooks holding the locks, so they leave the
+// actual work to the control thread.
 static void sigusr1_handler(int signo)
 {
-	pr_dbg("\n=== sigusr1_handler(%d) ===\n", signo);
-	dump_stackmap("size", opts.flamegraph);
+	control_request(CONTROL_DUMP_SIZE);
 }
 
 static void sigusr2_handler(int signo)
 {
-	pr_dbg("\n=== sigusr2_handler(%d) ===\n", signo);
-	dump_stackmap("count", opts.flamegraph);
+	control_request(CONTROL_DUMP_COUNT);
 }
 
 static void sigquit_handler(int signo)
 {
-	pr_dbg("\n=== sigquit_handler(%d) ===\n", signo);
-	clear_stackmap();
+	control_request(CONTROL_CLEAR);
 }
 
 void sighandler_init(void)
@@ -0,0 +1,344 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "snapshot.h"
+
+static inline uint64_t align8(uint64_t size)
+{
+	return (size + 7) & ~7ULL;
+}
+
+// strings are deduplicated as all the mappings of a file have the same path.
+struct strtab_t {
+	std::string data{ '\0' };
+	std::unordered_map<std::string, uint32_t> offsets;
+
+	uint32_t add(const std::string &str)
+	{
+		if (str.empty())
+			return 0;
+
+		auto it = offsets.find(str);
+		if (it != offsets.end())
+			return it->second;
+
+		uint32_t offset = data.size();
+		data.append(str.c_str(), str.size() + 1);
+		offsets[str] = offset;
+		return offset;
+	}
+};
+
+static bool write_all(int fd, const char *buf, size_t size)
+{
+	while (size) {
+		ssize_t ret = write(fd, buf, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+bool write_snapshot(const char *filename, const dump_stacks_t &stacks,
+		    const char *sort_keys, const dump_info_t &info)
+{
+	std::vector<raw_map_t> maps;
+	strtab_t strtab;
+	uint64_t nr_addrs = 0;
+	dump_stack_t stack;
+
+	// the stacks are read twice, the depth of a stack trace never changes.
+	read_self_maps(maps);
+	for (const auto &key : stacks.keys) {
+		if (stacks.read(key.id, stacks.arg, stack))
+			nr_addrs += stack.second.stack_depth;
+	}
+
+	snapshot_header_t hdr = {};
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.byte_order = SNAPSHOT_BYTE_ORDER;
+	hdr.header_size = sizeof(hdr);
+	hdr.flags = info.async ? SNAPSHOT_FLAG_ASYNC : 0;
+	hdr.pid = info.pid;
+	hdr.comm = strtab.add(info.comm);
+	hdr.sort_keys = strtab.add(sort_keys);
+	hdr.alloc_virtual = info.alloc_virtual;
+	hdr.alloc_resident = info.alloc_resident;
+	hdr.statm_vss = info.statm_vss;
+	hdr.statm_rss = info.statm_rss;
+	hdr.statm_shared = info.statm_shared;
+	hdr.nr_overflows = info.nr_overflows;
+	hdr.sample_rate = info.sample_rate;
+	hdr.elapsed_ns = std::chrono::nanoseconds(info.time - info.start).count();
+	memcpy(hdr.lifetime, info.lifetime, sizeof(hdr.lifetime));
+
+	// the string table is filled while the maps and threads are added, so put it last.
+	hdr.maps_offset = align8(sizeof(hdr));
+	hdr.nr_maps = maps.size();
+	hdr.stacks_offset = hdr.maps_offset + hdr.nr_maps * sizeof(snapshot_map_t);
+	hdr.nr_stacks = stacks.keys.size();
+	hdr.threads_offset = hdr.stacks_offset + hdr.nr_stacks * sizeof(snapshot_stack_t);
+	hdr.nr_threads = info.threads.size();
+	hdr.addrs_offset = hdr.threads_offset + hdr.nr_threads * sizeof(snapshot_thread_t);
+	hdr.nr_addrs = nr_addrs;
+	hdr.strtab_offset = hdr.addrs_offset + hdr.nr_addrs * sizeof(uint64_t);
+
+	std::vector<snapshot_map_t> smaps(maps.size());
+	for (size_t i = 0; i < maps.size(); i++) {
+		smaps[i].start = maps[i].start;
+		smaps[i].end = maps[i].end;
+		smaps[i].offset = maps[i].offset;
+		smaps[i].perms = strtab.add(maps[i].perms);
+		smaps[i].build_id = strtab.add(maps[i].build_id);
+		smaps[i].path = strtab.add(maps[i].path);
+	}
+
+	std::vector<snapshot_thread_t> sthreads(info.threads.size());
+	for (size_t i = 0; i < info.threads.size(); i++) {
+		const thread_dump_t &td = info.threads[i];
+
+		sthreads[i].tid = td.tid;
+		sthreads[i].comm = strtab.add(td.comm);
+		sthreads[i].exited = td.exited;
+		sthreads[i].total_size = td.total_size;
+		sthreads[i].count = td.count;
+		sthreads[i].nr_allocs = td.nr_allocs;
+		sthreads[i].nr_frees = td.nr_frees;
+		sthreads[i].remote_frees = td.remote_frees;
+		sthreads[i].foreign_frees = td.foreign_frees;
+	}
+	hdr.strtab_size = strtab.data.size();
+
+	size_t size = hdr.strtab_offset + hdr.strtab_size;
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+
+	auto *buf = static_cast<char *>(p);
+	auto *sstacks = reinterpret_cast<snapshot_stack_t *>(buf + hdr.stacks_offset);
+	auto *addrs = reinterpret_cast<uint64_t *>(buf + hdr.addrs_offset);
+	uint32_t addr_index = 0;
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	if (!smaps.empty())
+		memcpy(buf + hdr.maps_offset, smaps.data(), smaps.size() * sizeof(snapshot_map_t));
+	if (!sthreads.empty()) {
+		memcpy(buf + hdr.threads_offset, sthreads.data(),
+		       sthreads.size() * sizeof(snapshot_thread_t));
+	}
+
+	for (const auto &key : stacks.keys) {
+		const stack_info_t &sinfo = stack.second;
+
+		// a stack gone in the meantime is left empty.
+		if (!stacks.read(key.id, stacks.arg, stack) ||
+		    addr_index + sinfo.stack_depth > nr_addrs) {
+			sstacks->addr_index = addr_index;
+			sstacks++;
+			continue;
+		}
+
+		std::chrono::nanoseconds age = info.time - sinfo.birth_time;
+
+		sstacks->count = sinfo.count;
+		sstacks->peak_count = sinfo.peak_count;
+		sstacks->total_size = sinfo.total_size;
+		sstacks->peak_total_size = sinfo.peak_total_size;
+		sstacks->age_ns = age.count();
+		sstacks->nr_allocs = sinfo.nr_allocs;
+		sstacks->alloc_bytes = sinfo.alloc_bytes;
+		sstacks->nr_frees = sinfo.nr_frees;
+		sstacks->free_bytes = sinfo.free_bytes;
+		sstacks->waste = sinfo.waste;
+		memcpy(sstacks->size_class, sinfo.size_class, sizeof(sstacks->size_class));
+		memcpy(sstacks->lifetime, sinfo.lifetime, sizeof(sstacks->lifetime));
+		sstacks->addr_index = addr_index;
+		sstacks->depth = sinfo.stack_depth;
+		sstacks++;
+
+		for (int i = 0; i < sinfo.stack_depth; i++)
+			addrs[addr_index++] = (uintptr_t)stack.first[i];
+	}
+	memcpy(buf + hdr.strtab_offset, strtab.data.data(), hdr.strtab_size);
+
+	bool ret = false;
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		ret = write_all(fd, buf, size);
+		close(fd);
+	}
+
+	munmap(p, size);
+	return ret;
+}
+
+bool is_snapshot(const char *filename)
+{
+	char magic[SNAPSHOT_MAGIC_LEN];
+	int fd = open(filename, O_RDONLY);
+	bool ret;
+
+	if (fd < 0)
+		return false;
+
+	ret = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	      !memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	close(fd);
+	return ret;
+}
+
+static bool check_table(uint64_t offset, uint64_t nr, uint64_t entry_size, size_t size)
+{
+	if (offset % 8 || offset > size)
+		return false;
+	return nr <= (size - offset) / entry_size;
+}
+
+static const char *get_string(const char *strtab, uint64_t strtab_size, uint32_t offset)
+{
+	return offset < strtab_size ? strtab + offset : "";
+}
+
+bool read_snapshot(const char *filename, raw_dump_t &dump)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header_t)) {
+		close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	const char *buf = static_cast<const char *>(p);
+	size_t size = st.st_size;
+	auto *hdr = reinterpret_cast<const snapshot_header_t *>(buf);
+	bool ret = false;
+
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) ||
+	    hdr->version != SNAPSHOT_VERSION || hdr->byte_order != SNAPSHOT_BYTE_ORDER ||
+	    hdr->header_size < sizeof(*hdr) ||
+	    !check_table(hdr->maps_offset, hdr->nr_maps, sizeof(snapshot_map_t), size) ||
+	    !check_table(hdr->stacks_offset, hdr->nr_stacks, sizeof(snapshot_stack_t), size) ||
+	    !check_table(hdr->threads_offset, hdr->nr_threads, sizeof(snapshot_thread_t), size) ||
+	    !check_table(hdr->addrs_offset, hdr->nr_addrs, sizeof(uint64_t), size) ||
+	    !check_table(hdr->strtab_offset, hdr->strtab_size, 1, size))
+		goto out;
+
+	{
+		auto *smaps = reinterpret_cast<const snapshot_map_t *>(buf + hdr->maps_offset);
+		auto *sstacks = reinterpret_cast<const snapshot_stack_t *>(buf + hdr->stacks_offset);
+		auto *sthreads =
+			reinterpret_cast<const snapshot_thread_t *>(buf + hdr->threads_offset);
+		auto *addrs = reinterpret_cast<const uint64_t *>(buf + hdr->addrs_offset);
+		const char *strtab = buf + hdr->strtab_offset;
+		uint64_t strtab_size = hdr->strtab_size;
+		time_point_t now = std::chrono::steady_clock::now();
+
+		// the string table must end with NUL to use the strings in place.
+		if (strtab_size == 0 || strtab[strtab_size - 1] != '\0')
+			goto out;
+
+		dump.info = {};
+		dump.info.pid = hdr->pid;
+		dump.info.comm = get_string(strtab, strtab_size, hdr->comm);
+		dump.info.time = now;
+		dump.info.alloc_virtual = hdr->alloc_virtual;
+		dump.info.alloc_resident = hdr->alloc_resident;
+		dump.info.statm_vss = hdr->statm_vss;
+		dump.info.statm_rss = hdr->statm_rss;
+		dump.info.statm_shared = hdr->statm_shared;
+		dump.info.async = hdr->flags & SNAPSHOT_FLAG_ASYNC;
+		dump.info.nr_overflows = hdr->nr_overflows;
+		dump.info.sample_rate = hdr->sample_rate;
+		dump.info.start = now - std::chrono::nanoseconds(hdr->elapsed_ns);
+		memcpy(dump.info.lifetime, hdr->lifetime, sizeof(dump.info.lifetime));
+		dump.sort_keys = get_string(strtab, strtab_size, hdr->sort_keys);
+
+		dump.maps.resize(hdr->nr_maps);
+		for (uint64_t i = 0; i < hdr->nr_maps; i++) {
+			raw_map_t &map = dump.maps[i];
+
+			map.start = smaps[i].start;
+			map.end = smaps[i].end;
+			map.offset = smaps[i].offset;
+			map.perms = get_string(strtab, strtab_size, smaps[i].perms);
+			map.build_id = get_string(strtab, strtab_size, smaps[i].build_id);
+			map.path = get_string(strtab, strtab_size, smaps[i].path);
+		}
+
+		dump.info.threads.resize(hdr->nr_threads);
+		for (uint64_t i = 0; i < hdr->nr_threads; i++) {
+			thread_dump_t &td = dump.info.threads[i];
+
+			td.tid = sthreads[i].tid;
+			td.comm = get_string(strtab, strtab_size, sthreads[i].comm);
+			td.exited = sthreads[i].exited;
+			td.total_size = sthreads[i].total_size;
+			td.count = sthreads[i].count;
+			td.nr_allocs = sthreads[i].nr_allocs;
+			td.nr_frees = sthreads[i].nr_frees;
+			td.remote_frees = sthreads[i].remote_frees;
+			td.foreign_frees = sthreads[i].foreign_frees;
+		}
+
+		dump.stacks.resize(hdr->nr_stacks);
+		for (uint64_t i = 0; i < hdr->nr_stacks; i++) {
+			const snapshot_stack_t *sstack = &sstacks[i];
+			stack_trace_t &stack_trace = dump.stacks[i].first;
+			stack_info_t &sinfo = dump.stacks[i].second;
+
+			if ((uint64_t)sstack->addr_index + sstack->depth > hdr->nr_addrs)
+				goto out;
+
+			// keep the innermost frames if it's built with a smaller DEPTH.
+			stack_trace = {};
+			sinfo = {};
+			sinfo.stack_depth = std::min<uint32_t>(sstack->depth, DEPTH);
+			for (int j = 0; j < sinfo.stack_depth; j++)
+				stack_trace[j] = (void *)(uintptr_t)addrs[sstack->addr_index + j];
+
+			sinfo.count = sstack->count;
+			sinfo.peak_count = sstack->peak_count;
+			sinfo.total_size = sstack->total_size;
+			sinfo.peak_total_size = sstack->peak_total_size;
+			sinfo.birth_time = now - std::chrono::nanoseconds(sstack->age_ns);
+			sinfo.nr_allocs = sstack->nr_allocs;
+			sinfo.alloc_bytes = sstack->alloc_bytes;
+			sinfo.nr_frees = sstack->nr_frees;
+			sinfo.free_bytes = sstack->free_bytes;
+			sinfo.waste = sstack->waste;
+			memcpy(sinfo.size_class, sstack->size_class, sizeof(sinfo.size_class));
+			memcpy(sinfo.lifetime, sstack->lifetime, sizeof(sinfo.lifetime));
+		}
+		ret = true;
+	}
+
+out:
+	munmap(p, size);
+	return ret;
+}
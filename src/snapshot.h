@@ -0,0 +1,122 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_SNAPSHOT_H
+#define HEAPTRACE_SNAPSHOT_H
+
+#include <cstdint>
+#include <vector>
+
+#include "dump.h"
+#include "raw.h"
+
+// A snapshot is a binary version of the raw dump.  It's built in memory and
+// written to its own file at once, and the layout allows a reader to use the
+// tables in place after mmap().  Every table starts at an 8 byte aligned
+// offset from the beginning of the file and strings are referred to by their
+// offset in the string table.  Numbers are in the byte order of the writer
+// which is checked with byte_order.
+//
+//   snapshot_header_t
+//   snapshot_map_t    maps[nr_maps]
+//   snapshot_stack_t  stacks[nr_stacks]
+//   snapshot_thread_t threads[nr_threads]
+//   uint64_t          addrs[nr_addrs]
+//   char              strtab[strtab_size]
+
+#define SNAPSHOT_MAGIC "HTSNAPSH"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+struct snapshot_header_t {
+	char magic[SNAPSHOT_MAGIC_LEN];
+	uint32_t version;
+	uint32_t byte_order;
+	// size of this header, new fields are added at the end.
+	uint32_t header_size;
+	uint32_t flags;
+
+	int64_t pid;
+	// offsets in the string table
+	uint32_t comm;
+	uint32_t sort_keys;
+
+	uint64_t alloc_virtual;
+	uint64_t alloc_resident;
+	uint64_t statm_vss;
+	uint64_t statm_rss;
+	uint64_t statm_shared;
+	uint64_t nr_overflows;
+	uint64_t sample_rate;
+	// since the tracing started or was cleared, for the rates.
+	uint64_t elapsed_ns;
+	uint64_t lifetime[NR_LIFETIME_BUCKETS];
+
+	uint64_t maps_offset;
+	uint64_t nr_maps;
+	uint64_t stacks_offset;
+	uint64_t nr_stacks;
+	uint64_t threads_offset;
+	uint64_t nr_threads;
+	uint64_t addrs_offset;
+	uint64_t nr_addrs;
+	uint64_t strtab_offset;
+	uint64_t strtab_size;
+};
+
+#define SNAPSHOT_FLAG_ASYNC (1U << 0)
+
+struct snapshot_map_t {
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+	// offsets in the string table, the build-id is an empty string if unknown.
+	uint32_t perms;
+	uint32_t build_id;
+	uint32_t path;
+	uint32_t reserved;
+};
+
+struct snapshot_stack_t {
+	uint64_t count;
+	uint64_t peak_count;
+	uint64_t total_size;
+	uint64_t peak_total_size;
+	uint64_t age_ns;
+	uint64_t nr_allocs;
+	uint64_t alloc_bytes;
+	uint64_t nr_frees;
+	uint64_t free_bytes;
+	uint64_t waste;
+	uint64_t size_class[NR_SIZE_CLASSES];
+	uint64_t lifetime[NR_LIFETIME_BUCKETS];
+	// the frames are addrs[addr_index] to addrs[addr_index + depth - 1].
+	uint32_t addr_index;
+	uint32_t depth;
+};
+
+struct snapshot_thread_t {
+	uint32_t tid;
+	// offset in the string table
+	uint32_t comm;
+	uint32_t exited;
+	uint32_t reserved;
+	uint64_t total_size;
+	uint64_t count;
+	uint64_t nr_allocs;
+	uint64_t nr_frees;
+	uint64_t remote_frees;
+	uint64_t foreign_frees;
+};
+
+// Writes a snapshot file of the stacks, it returns false on failure.
+bool write_snapshot(const char *filename, const dump_stacks_t &stacks,
+		    const char *sort_keys, const dump_info_t &info);
+
+// Returns true if the file starts with the snapshot magic.
+bool is_snapshot(const char *filename);
+
+// Reads the snapshot into a dump for 'heaptrace report'.
+bool read_snapshot(const char *filename, raw_dump_t &dump);
+
+#endif /* HEAPTRACE_SNAPSHOT_H */
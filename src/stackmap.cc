@@ -0,0 +1,137 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstring>
+#include <sys/mman.h>
+
+#include "compiler.h"
+#include "stackmap.h"
+#include "utils.h"
+
+// initial number of slots of a stackmap_t, it must be a power of 2.
+#define STACKMAP_INIT_SLOTS 64
+
+stack_table_t stack_table;
+
+uint64_t hash_stack_trace(const stack_trace_t &stack_trace)
+{
+	uint64_t h = 0;
+
+	for (void *pc : stack_trace)
+		h = utils::hash_mix(h ^ (uintptr_t)pc);
+	return h;
+}
+
+static void *alloc_pages(size_t size)
+{
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? nullptr : p;
+}
+
+stack_id_t stack_table_t::alloc(void)
+{
+	stack_id_t id = nr_stacks.load(std::memory_order_relaxed);
+	size_t idx;
+
+	// The id is taken only when its chunk is available, so get() never
+	// sees a missing chunk for an id below nr_stacks.
+	do {
+		idx = id / STACK_CHUNK_ENTRIES;
+		if (unlikely(idx >= STACK_MAX_CHUNKS))
+			return STACK_ID_NONE;
+
+		if (unlikely(!chunks[idx].load(std::memory_order_acquire))) {
+			std::lock_guard<std::mutex> lock(chunk_lock);
+
+			if (!chunks[idx].load(std::memory_order_relaxed)) {
+				void *chunk = alloc_pages(STACK_CHUNK_ENTRIES * sizeof(stack_entry_t));
+				if (!chunk)
+					return STACK_ID_NONE;
+				chunks[idx].store(static_cast<stack_entry_t *>(chunk),
+						  std::memory_order_release);
+			}
+		}
+	} while (!nr_stacks.compare_exchange_weak(id, id + 1, std::memory_order_acq_rel));
+
+	return id;
+}
+
+void stack_table_t::clear(void)
+{
+	std::lock_guard<std::mutex> lock(chunk_lock);
+
+	for (auto &chunk : chunks) {
+		stack_entry_t *p = chunk.load(std::memory_order_relaxed);
+		if (!p)
+			break;
+		munmap(p, STACK_CHUNK_ENTRIES * sizeof(stack_entry_t));
+		chunk.store(nullptr, std::memory_order_relaxed);
+	}
+	nr_stacks.store(0, std::memory_order_release);
+}
+
+bool stackmap_t::grow(void)
+{
+	size_t nr_slots = slots ? (mask + 1) * 2 : STACKMAP_INIT_SLOTS;
+	auto *new_slots = static_cast<stack_id_t *>(alloc_pages(nr_slots * sizeof(stack_id_t)));
+
+	if (!new_slots)
+		return false;
+
+	for (size_t i = 0; slots && i <= mask; i++) {
+		if (!slots[i])
+			continue;
+
+		uint64_t hash = stack_table.get(slots[i] - 1)->hash;
+		size_t j = hash & (nr_slots - 1);
+
+		while (new_slots[j])
+			j = (j + 1) & (nr_slots - 1);
+		new_slots[j] = slots[i];
+	}
+
+	if (slots)
+		munmap(slots, (mask + 1) * sizeof(stack_id_t));
+	slots = new_slots;
+	mask = nr_slots - 1;
+	return true;
+}
+
+stack_id_t stackmap_t::intern(const stack_trace_t &stack_trace, uint64_t hash, bool *created)
+{
+	if (unlikely((count + 1) * 2 > (slots ? mask + 1 : 0))) {
+		if (!grow())
+			return STACK_ID_NONE;
+	}
+
+	size_t i = hash & mask;
+	while (slots[i]) {
+		stack_entry_t *entry = stack_table.get(slots[i] - 1);
+
+		if (entry->hash == hash && entry->stack_trace == stack_trace)
+			return slots[i] - 1;
+		i = (i + 1) & mask;
+	}
+
+	stack_id_t id = stack_table.alloc();
+	if (unlikely(id == STACK_ID_NONE))
+		return STACK_ID_NONE;
+
+	stack_entry_t *entry = stack_table.get(id);
+	entry->stack_trace = stack_trace;
+	entry->hash = hash;
+
+	slots[i] = id + 1;
+	count++;
+	if (created)
+		*created = true;
+	return id;
+}
+
+void stackmap_t::clear(void)
+{
+	if (slots)
+		munmap(slots, (mask + 1) * sizeof(stack_id_t));
+	slots = nullptr;
+	mask = 0;
+	count = 0;
+}
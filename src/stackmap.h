@@ -0,0 +1,101 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_STACKMAP_H
+#define HEAPTRACE_STACKMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "stacktrace.h"
+
+struct stack_entry_t {
+	stack_trace_t stack_trace;
+	stack_info_t info;
+	uint64_t hash;
+};
+
+uint64_t hash_stack_trace(const stack_trace_t &stack_trace);
+
+// stack_table_t keeps every interned stack trace once, indexed by its dense
+// 32-bit stack id.  Entries are stored in chunks that never move so that the
+// entry of a given id can be accessed without a lock once it's published.
+class stack_table_t {
+public:
+	// Allocates a new zero-filled entry and returns its id, or STACK_ID_NONE
+	// if it runs out of memory.
+	stack_id_t alloc(void);
+
+	// Returns nullptr if the id is not valid, e.g. it's from before clear().
+	stack_entry_t *get(stack_id_t id) const
+	{
+		if (unlikely(id >= size()))
+			return nullptr;
+
+		stack_entry_t *chunk = chunks[id / STACK_CHUNK_ENTRIES].load(std::memory_order_acquire);
+		if (unlikely(!chunk))
+			return nullptr;
+		return &chunk[id % STACK_CHUNK_ENTRIES];
+	}
+
+	size_t size(void) const
+	{
+		return nr_stacks.load(std::memory_order_acquire);
+	}
+
+	// The caller must make sure that nobody accesses the entries.
+	void clear(void);
+
+private:
+	static constexpr size_t STACK_CHUNK_ENTRIES = 4096;
+	static constexpr size_t STACK_MAX_CHUNKS = 4096;
+
+	std::atomic<stack_entry_t *> chunks[STACK_MAX_CHUNKS];
+	std::atomic<stack_id_t> nr_stacks;
+	std::mutex chunk_lock;
+};
+
+extern stack_table_t stack_table;
+
+// stackmap_t is an open-addressing hash index from a stack trace to its id
+// in stack_table.  The stack_info_t of the entries are protected by the same
+// lock that protects the stackmap_t interning them.
+//
+// It is not thread safe and must be protected by its user.
+class stackmap_t {
+public:
+	constexpr stackmap_t()
+		: slots(nullptr)
+		, mask(0)
+		, count(0)
+	{
+	}
+
+	// Returns the id of the stack_trace, adding it to stack_table if it's
+	// not found.  Returns STACK_ID_NONE if it runs out of memory.  created
+	// is set if it's given and the stack_trace is added.
+	stack_id_t intern(const stack_trace_t &stack_trace, uint64_t hash,
+			  bool *created = nullptr);
+
+	template <typename Func>
+	void for_each(Func func) const
+	{
+		for (size_t i = 0; slots && i <= mask; i++) {
+			if (slots[i])
+				func(slots[i] - 1);
+		}
+	}
+
+	void clear(void);
+
+private:
+	bool grow(void);
+
+	// stack id + 1 of each slot, 0 for an empty slot.
+	stack_id_t *slots;
+	size_t mask;
+	size_t count;
+};
+
+#endif /* HEAPTRACE_STACKMAP_H */
@@ -7,89 +7,271 @@
 #include <cstring>
 #include <malloc.h>
 
-#include <cxxabi.h>
-#include <dlfcn.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
-#include <iomanip>
-#include <map>
-#include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
 
+#include "addrmap.h"
 #include "compiler.h"
+#include "control.h"
+#include "dump.h"
+#include "eventbuf.h"
+#include "evlog.h"
 #include "heaptrace.h"
+#include "ignoremap.h"
+#include "leakcheck.h"
+#include "mmaptrace.h"
+#include "raw.h"
+#include "snapshot.h"
+#include "stackmap.h"
 #include "stacktrace.h"
+#include "symbol.h"
+#include "threadmap.h"
 #include "utils.h"
 
-#define SYMBOL_MAXLEN 128
-
 #if (__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
 #define GLIBC_233_OR_LATER
 #endif
 
-std::map<stack_trace_t, stack_info_t> stackmap;
-std::map<addr_t, object_info_t> addrmap;
-std::vector<std::string> ignorevec;
-bool ignorevec_initialized = false;
+// The number of shards must be a power of 2.
+#define NR_SHARDS_BITS 6
+#define NR_SHARDS (1 << NR_SHARDS_BITS)
+
+// Both stackmap and addrmap are split into shards so that threads recording
+// or releasing unrelated allocations don't contend on a single lock.  Each
+// shard sits in its own cache line to avoid false sharing between the locks.
+struct stack_shard_t {
+	std::mutex lock;
+	stackmap_t stackmap;
+} __align(64);
+
+struct addr_shard_t {
+	std::mutex lock;
+	addrmap_t addrmap;
+	// the new objects are logged here during an incremental leak check.
+	leak_log_t *leak_log;
+} __align(64);
+
+static stack_shard_t stack_shards[NR_SHARDS];
+static addr_shard_t addr_shards[NR_SHARDS];
+
+static_assert(NR_SHARDS <= LEAK_MAX_LOGS, "not enough logs for the incremental leak check");
+
+// bumped by clear_stackmap() as it reuses the stack ids.
+static std::atomic<uint64_t> stackmap_generation;
+// when the stackmap was (re)started empty, protected by all stack shard locks.
+static time_point_t stackmap_start = std::chrono::steady_clock::now();
+
+// Both stackmap_t and addrmap_t use the lower bits of the same hash for their
+// slots, so pick the shard with the upper bits.
+static inline stack_shard_t &get_stack_shard(uint64_t hash)
+{
+	return stack_shards[hash >> (64 - NR_SHARDS_BITS)];
+}
 
-std::recursive_mutex container_mutex;
+static inline addr_shard_t &get_addr_shard(addr_t addr)
+{
+	return addr_shards[utils::hash_mix((uintptr_t)addr) >> (64 - NR_SHARDS_BITS)];
+}
 
-static void lazyinit_ignorevec()
+static bool get_stack_range(uintptr_t *lo, uintptr_t *hi)
 {
-	if (ignorevec_initialized)
-		return;
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+	int ret;
 
-	opts.ignore = getenv("HEAPTRACE_IGNORE");
-	if (opts.ignore) {
-		std::ifstream file(opts.ignore);
-		if (file.is_open()) {
-			std::string line;
-			while (std::getline(file, line)) {
-				ignorevec.push_back(line);
-			}
-			file.close();
-		}
-		else {
-			pr_out("Failed to open file %s\n", opts.ignore);
-		}
-	}
-	ignorevec_initialized = true;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return false;
+
+	ret = pthread_attr_getstack(&attr, &addr, &size);
+	pthread_attr_destroy(&attr);
+	if (ret != 0)
+		return false;
+
+	*lo = (uintptr_t)addr;
+	*hi = (uintptr_t)addr + size;
+	return true;
 }
 
-static bool is_ignored(const std::string &report)
+// This must not be inlined so that the first entry is the return address to
+// the caller as backtrace() does.
+__noinline int fp_backtrace(void **buffer, int size)
 {
-	lazyinit_ignorevec();
-	return std::any_of(ignorevec.begin(), ignorevec.end(), [&report](const std::string& s)
-			   { return report.find(s) != std::string::npos; });
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+	auto *tfs = &thread_flags;
+	auto **fp = static_cast<void **>(__builtin_frame_address(0));
+	int nptrs = 0;
+
+	if (unlikely(tfs->stack_hi == 0)) {
+		if (!get_stack_range(&tfs->stack_lo, &tfs->stack_hi)) {
+			// use the full range to mark it's unknown.
+			tfs->stack_lo = 0;
+			tfs->stack_hi = UINTPTR_MAX;
+		}
+	}
+
+	// Fall back to backtrace() if the stack range is unknown.
+	if (unlikely(tfs->stack_lo == 0))
+		return backtrace(buffer, size);
+
+	// Each frame has the previous frame pointer followed by the return
+	// address.  Stop at any frame pointer that doesn't move towards the
+	// bottom of this thread's stack.
+	while (nptrs < size) {
+		auto cur = (uintptr_t)fp;
+
+		if (cur < tfs->stack_lo || cur > tfs->stack_hi - 2 * sizeof(void *) ||
+		    cur % sizeof(void *))
+			break;
+
+		void *ret = fp[1];
+		if (!ret)
+			break;
+		buffer[nptrs++] = ret;
+
+		auto **next = static_cast<void **>(fp[0]);
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+
+	// e.g. it's running on an alternate signal stack.
+	if (unlikely(nptrs == 0))
+		return backtrace(buffer, size);
+
+	return nptrs;
+#else
+	return backtrace(buffer, size);
+#endif
 }
 
 // record_backtrace() is defined in stacktrace.h as an inline function.
 void __record_backtrace(size_t size, void *addr, stack_trace_t &stack_trace, int nptrs)
 {
-	std::lock_guard<std::recursive_mutex> lock(container_mutex);
+	control_check_fork();
+	leak_monitor_check_fork();
+	if (opts.event_log)
+		evlog_check_fork();
+
+	// don't track the objects of the ignored backtraces at all.
+	if (unlikely(opts.ignore) && ignoremap_match(stack_trace, nptrs))
+		return;
+
+	// This must be done before the address is returned to the program.
+	if (opts.addr_filter)
+		addr_filter_add(addr);
+
+	// the object might be freed already when an async event is applied.
+	size_t usable = malloc_usable_size(addr);
+
+	if (opts.async && likely(eventbuf_push_alloc(size, usable, addr, stack_trace, nptrs)))
+		return;
+
+	// the time is needed for the lifetime and the event log.
+	event_origin_t origin = get_event_origin();
+	do_record_backtrace(size, usable, addr, stack_trace, nptrs, origin);
+
+	if (opts.event_log)
+		evlog_flush_pending();
+}
+
+void do_record_backtrace(size_t size, size_t usable, void *addr, stack_trace_t &stack_trace,
+			 int nptrs, const event_origin_t &origin)
+{
+	uint64_t hash = hash_stack_trace(stack_trace);
+	stack_shard_t &sshard = get_stack_shard(hash);
+	stack_entry_t *entry;
+	stack_id_t stack_id;
+	uint32_t count = 1;
+	uint64_t alloc_size = size;
+	uint32_t waste = usable > size ? std::min<size_t>(usable - size, UINT32_MAX) : 0;
+	int size_class = get_size_class(size);
+	bool created = false;
 
 	pr_dbg("  record_backtrace(%zd, %p)\n", size, addr);
 
-	if (stackmap.find(stack_trace) == stackmap.end()) {
-		// Record the creation time for the stack_trace
-		struct stack_info_t stack_info {};
-		stack_info.birth_time = std::chrono::steady_clock::now();
-		stackmap[stack_trace] = stack_info;
+	// scale up the sampled allocation to the estimated amount.
+	if (opts.sample_rate) {
+		uint64_t est_size;
+
+		sample_weight(size, &est_size, &count);
+		size = est_size;
 	}
 
-	struct stack_info_t &stack_info = stackmap[stack_trace];
-	stack_info.stack_depth = nptrs;
-	stack_info.total_size += size;
-	stack_info.peak_total_size = std::max(stack_info.peak_total_size, stack_info.total_size);
-	stack_info.count++;
-	stack_info.peak_count = std::max(stack_info.peak_count, stack_info.count);
+	// Keep the addr shard lock until the object is inserted so that
+	// clear_stackmap() cannot reuse the stack id in the middle.  The lock
+	// order is the same as do_release_backtrace().
+	addr_shard_t &ashard = get_addr_shard(addr);
+	std::lock_guard<std::mutex> alock(ashard.lock);
+
+	{
+		std::lock_guard<std::mutex> slock(sshard.lock);
+
+		stack_id = sshard.stackmap.intern(stack_trace, hash, &created);
+		if (unlikely(stack_id == STACK_ID_NONE))
+			return;
+
+		if (opts.event_log && created)
+			evlog_stack(stack_id, stack_trace, nptrs);
+
+		entry = stack_table.get(stack_id);
 
-	struct object_info_t &object_info = addrmap[addr];
-	object_info.stack_trace = stack_trace;
-	object_info.size = size;
+		struct stack_info_t &stack_info = entry->info;
+		if (stack_info.count == 0) {
+			// Record the creation time for the stack_trace and restart
+			// the peaks.  The cumulative numbers are kept.
+			stack_info.birth_time = std::chrono::steady_clock::now();
+			stack_info.total_size = 0;
+			stack_info.peak_total_size = 0;
+			stack_info.peak_count = 0;
+		}
+
+		stack_info.stack_depth = nptrs;
+		stack_info.total_size += size;
+		stack_info.peak_total_size =
+			std::max(stack_info.peak_total_size, stack_info.total_size);
+		stack_info.count += count;
+		stack_info.peak_count = std::max(stack_info.peak_count, stack_info.count);
+		stack_info.size_class[size_class] += count;
+		stack_info.waste += (uint64_t)waste * count;
+		stack_info.nr_allocs += count;
+		stack_info.alloc_bytes += size;
+	}
+
+	struct object_info_t *object_info = ashard.addrmap.insert(addr);
+	if (unlikely(!object_info)) {
+		// revert the stack_info as the object cannot be released later.
+		std::lock_guard<std::mutex> slock(sshard.lock);
+		entry->info.total_size -= size;
+		entry->info.count -= count;
+		entry->info.size_class[size_class] -= count;
+		entry->info.waste -= (uint64_t)waste * count;
+		entry->info.nr_allocs -= count;
+		entry->info.alloc_bytes -= size;
+		return;
+	}
+
+	object_info->size = size;
+	object_info->stack_id = stack_id;
+	object_info->count = count;
+	object_info->time = origin.time;
+	object_info->waste = waste;
+	object_info->size_class = size_class;
+	object_info->thread = thread_account_alloc(origin.tid, size, count);
+
+	if (unlikely(ashard.leak_log))
+		leak_log_push(ashard.leak_log, addr, alloc_size);
+
+	// log it in the lock so that it's always before the free of the addr.
+	if (opts.event_log)
+		evlog_event(EVLOG_ALLOC, origin, addr, alloc_size, stack_id);
 }
 
 void release_backtrace(void *addr)
@@ -97,366 +279,655 @@ void release_backtrace(void *addr)
 	if (unlikely(!addr))
 		return;
 
-	std::lock_guard<std::recursive_mutex> lock(container_mutex);
+	if (opts.event_log)
+		evlog_check_fork();
+
+	// unsampled objects or the ones allocated before attach are not in the
+	// addrmap, skip them without taking the lock.
+	if (opts.addr_filter && !addr_filter_test(addr))
+		return;
+
+	if (opts.async && likely(eventbuf_push_free(addr)))
+		return;
+
+	event_origin_t origin = get_event_origin();
+	do_release_backtrace(addr, origin);
+
+	if (opts.event_log)
+		evlog_flush_pending();
+}
+
+void do_release_backtrace(void *addr, const event_origin_t &origin)
+{
+	// The addr shard lock is kept while updating the stack shard so that
+	// clear_stackmap() never sees a half released object.  The lock order
+	// is always addr shard first, then stack shard.
+	addr_shard_t &ashard = get_addr_shard(addr);
+	std::lock_guard<std::mutex> alock(ashard.lock);
 
 	pr_dbg("  release_backtrace(%p)\n", addr);
 
-	const auto &addrit = addrmap.find(addr);
-	if (unlikely(addrit == addrmap.end()))
+	// The given address is released so remove it from addrmap.
+	object_info_t object_info;
+	if (unlikely(!ashard.addrmap.erase(addr, &object_info)))
 		return;
 
-	object_info_t &object_info = addrit->second;
-	stack_trace_t &stack_trace = object_info.stack_trace;
+	if (opts.addr_filter)
+		addr_filter_remove(addr);
+
+	if (opts.event_log)
+		evlog_event(EVLOG_FREE, origin, addr, object_info.size, object_info.stack_id);
 
-	const auto &stackit = stackmap.find(stack_trace);
-	if (unlikely(stackit == stackmap.end()))
+	// The stack id directly gives the entry without another lookup.
+	stack_entry_t *entry = stack_table.get(object_info.stack_id);
+	if (unlikely(!entry))
 		return;
 
-	stack_info_t &stack_info = stackit->second;
+	stack_shard_t &sshard = get_stack_shard(entry->hash);
+	std::lock_guard<std::mutex> slock(sshard.lock);
+
+	// the times of different threads might be slightly out of order.
+	uint64_t lifetime = origin.time > object_info.time ? origin.time - object_info.time : 0;
+
+	stack_info_t &stack_info = entry->info;
 	stack_info.total_size -= object_info.size;
-	stack_info.count--;
-	if (stack_info.count == 0) {
-		// The stackmap for the given stacktrace is no longer needed.
-		stackmap.erase(stackit);
-	}
+	stack_info.count -= object_info.count;
+	stack_info.lifetime[lifetime_bucket(lifetime)] += object_info.count;
+	stack_info.size_class[object_info.size_class] -= object_info.count;
+	stack_info.waste -= (uint64_t)object_info.waste * object_info.count;
+	stack_info.nr_frees += object_info.count;
+	stack_info.free_bytes += object_info.size;
+
+	thread_account_free(object_info.thread, origin.tid, object_info.size, object_info.count);
+}
 
-	// The given address is released so remove it from addrmap.
-	addrmap.erase(addrit);
+static void get_dump_info(dump_info_t &info)
+{
+	long vss = 0;
+	long rss = 0;
+	long shared = 0;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	std::ifstream fs("/proc/self/statm");
+
+	/*
+	 * Get allocated size information from the allocator. mallinfo() is
+	 * deprecated because it uses int for variables, which can only support
+	 * memory sizes less than 4GB. Therefore, use mallinfo() only in
+	 * environments with old glibc versions less than 2.33
+	 */
+#ifdef GLIBC_233_OR_LATER
+	struct mallinfo2 minfo = mallinfo2();
+#else
+	struct mallinfo minfo = mallinfo();
+#endif
+
+	fs >> vss >> rss >> shared;
+
+	info.pid = getpid();
+	info.comm = utils::get_comm_name();
+	info.time = std::chrono::steady_clock::now();
+	info.alloc_virtual = minfo.arena + minfo.hblkhd;
+	info.alloc_resident = minfo.uordblks;
+	info.statm_vss = vss * pagesize;
+	info.statm_rss = rss * pagesize;
+	info.statm_shared = shared * pagesize;
+	info.async = opts.async;
+	info.nr_overflows = opts.async ? eventbuf_overflows() : 0;
+	info.sample_rate = opts.sample_rate;
+	info.start = stackmap_start;
+	memset(info.lifetime, 0, sizeof(info.lifetime));
+	collect_threads(info.threads);
 }
 
-static void get_backtrace_string(int count, void *addr, std::stringstream &ss_bt)
+static void dump_snapshot(const dump_stacks_t &stacks, const char *sort_keys,
+			  const dump_info_t &info)
 {
-	Dl_info dlip;
-	char *symbol;
-	int offset;
-	int status;
-	int dl_ret;
-	int len = SYMBOL_MAXLEN;
-
-	ss_bt << std::dec << count << " [0x" << std::hex <<
-		std::setw(4 + __SIZEOF_LONG__) << (unsigned long)addr << "] ";
-	// dladdr() translates address to symbolic info.
-	dl_ret = dladdr(addr, &dlip);
-	if (dl_ret == 0) {
-		ss_bt << "?\n";
-		return;
-	}
+	static std::atomic<int> seq;
+	std::string filename = utils::asprintf("%s.%ld.%s.%d.snap",
+					       opts.outfile ? opts.outfile : "heaptrace", info.pid,
+					       info.comm.c_str(), seq++);
 
-	if (dlip.dli_sname != nullptr && dlip.dli_saddr != nullptr) {
-		symbol = abi::__cxa_demangle(dlip.dli_sname, nullptr, nullptr, &status);
-		if (status != 0)
-			symbol = strdup(dlip.dli_sname);
+	if (!write_snapshot(filename.c_str(), stacks, sort_keys, info))
+		pr_dbg("failed to write snapshot %s\n", filename.c_str());
+}
 
-		if (strlen(symbol) > len) {
-			symbol[len - 3] = '.';
-			symbol[len - 2] = '.';
-			symbol[len - 1] = '.';
-			symbol[len] = '\0';
-		}
-		offset = static_cast<int>(static_cast<int *>(addr) -
-					  static_cast<int *>(dlip.dli_saddr));
-		ss_bt << symbol << " +0x" << offset << " ";
-		free(symbol);
+// Reads a stack of the stackmap when a dump prints it.  The arg is the
+// generation of the stackmap when the dump collected the ids.
+static bool read_stack(uint32_t id, const void *arg, dump_stack_t &stack)
+{
+	// the ids are given to different stacks after clear.
+	if (stackmap_generation.load() != *static_cast<const uint64_t *>(arg))
+		return false;
+
+	const stack_entry_t *entry = stack_table.get(id);
+	if (!entry)
+		return false;
+
+	stack_shard_t &sshard = get_stack_shard(entry->hash);
+	std::lock_guard<std::mutex> lock(sshard.lock);
+
+	stack.first = entry->stack_trace;
+	stack.second = entry->info;
+	return true;
+}
+
+// Collects the sort keys of the stacks that have live objects, or all stacks
+// if freed is set, and sums up them and the lifetime of all stacks.  Only the
+// sums are collected for the summary.  The hook guard should be set.
+static void collect_stackmap(dump_stacks_t &stacks, const uint64_t *generation,
+			     uint64_t *lifetime, bool freed = false, bool summary = false)
+{
+	// apply the events queued in async mode before the dump.
+	if (opts.async)
+		eventbuf_flush();
+
+	if (opts.event_log)
+		evlog_sync();
+
+	init_dump_stacks(stacks, read_stack, generation);
+	if (!summary)
+		stacks.keys.reserve(stack_table.size());
+
+	for (auto &shard : stack_shards) {
+		// protect stackmap access
+		std::lock_guard<std::mutex> lock(shard.lock);
+
+		shard.stackmap.for_each([&](stack_id_t id) {
+			const stack_entry_t *entry = stack_table.get(id);
+
+			for (int i = 0; i < NR_LIFETIME_BUCKETS; i++)
+				lifetime[i] += entry->info.lifetime[i];
+
+			// skip the stack traces that have no live objects.
+			if (entry->info.count || freed)
+				add_dump_stack(stacks, id, entry->info, !summary);
+		});
 	}
-	offset = (int)((char *)addr - (char *)(dlip.dli_fbase));
-	ss_bt << "(" << dlip.dli_fname << " +0x" << offset << ")\n";
 }
 
-static void get_backtrace_string_flamegraph(void *addr, const char *semicolon,
-					    std::stringstream &ss_bt)
+void dump_stackmap(const char *sort_keys, bool flamegraph)
 {
-	Dl_info dlip;
-	char *symbol;
-	int offset;
-	int status;
+	auto *tfs = &thread_flags;
+	bool hook_guard = tfs->hook_guard;
 
-	// dladdr() translates address to symbolic info.
-	dladdr(addr, &dlip);
+	tfs->hook_guard = true;
 
-	symbol = abi::__cxa_demangle(dlip.dli_sname, nullptr, nullptr, &status);
+	// objects might be unloaded since the ignore rules were compiled.
+	if (opts.ignore)
+		ignoremap_sync();
 
-	if (status == -2 && !symbol)
-		symbol = strdup(dlip.dli_sname);
+	// the stacks without live objects are needed to sort by the cumulative
+	// numbers.  The raw dump and the snapshot keep them for 'heaptrace report'
+	// which might be given other sort keys.
+	bool freed = opts.raw || opts.snapshot || has_cumulative_sort_key(sort_keys);
 
-	if (symbol) {
-		int len = SYMBOL_MAXLEN;
+	dump_stacks_t stacks;
+	uint64_t generation = stackmap_generation.load();
+	uint64_t lifetime[NR_LIFETIME_BUCKETS] = {};
+	collect_stackmap(stacks, &generation, lifetime, freed);
 
-		if (strlen(symbol) > len) {
-			symbol[len - 3] = '.';
-			symbol[len - 2] = '.';
-			symbol[len - 1] = '.';
-			symbol[len] = '\0';
-		}
-		offset = static_cast<int>(static_cast<int *>(addr) -
-					  static_cast<int *>(dlip.dli_saddr));
-		ss_bt << semicolon << symbol << "+0x" << offset;
-		free(symbol);
+	mmap_dump_t mmaps;
+	collect_mmaps(mmaps);
+
+	if (stacks.keys.empty() && mmaps.stacks.empty()) {
+		tfs->hook_guard = hook_guard;
+		return;
+	}
+
+	dump_info_t info;
+	get_dump_info(info);
+	memcpy(info.lifetime, lifetime, sizeof(info.lifetime));
+
+	if (opts.snapshot) {
+		// a binary version of the raw dump in a separate file.
+		dump_snapshot(stacks, sort_keys, info);
+	}
+	else if (opts.raw) {
+		// leave the symbolization to 'heaptrace report'.
+		write_raw_dump(stacks, sort_keys, info);
 	}
 	else {
-		ss_bt << semicolon << dlip.dli_fname << addr;
+		sync_symbol_cache();
+		print_dump(stacks, sort_keys, flamegraph, info, lookup_symbol, &mmaps);
 	}
+
+	tfs->hook_guard = hook_guard;
 }
 
-static std::string get_delta_time_unit(std::chrono::nanoseconds delta)
+void dump_stackmap_summary(void)
 {
-	std::string str;
+	auto *tfs = &thread_flags;
+	bool hook_guard = tfs->hook_guard;
 
-	auto h = std::chrono::duration_cast<std::chrono::hours>(delta);
-	delta -= h;
+	tfs->hook_guard = true;
 
-	auto mins = std::chrono::duration_cast<std::chrono::minutes>(delta);
-	delta -= mins;
+	dump_stacks_t stacks;
+	uint64_t generation = stackmap_generation.load();
+	uint64_t lifetime[NR_LIFETIME_BUCKETS] = {};
+	collect_stackmap(stacks, &generation, lifetime, false, true);
 
-	auto secs = std::chrono::duration_cast<std::chrono::seconds>(delta);
-	delta -= secs;
+	mmap_dump_t mmaps;
+	collect_mmaps(mmaps);
 
-	auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(delta);
-	delta -= millis;
+	dump_info_t info;
+	get_dump_info(info);
+	memcpy(info.lifetime, lifetime, sizeof(info.lifetime));
 
-	auto micros = std::chrono::duration_cast<std::chrono::microseconds>(delta);
-	delta -= micros;
+	print_dump_summary(stacks, info, &mmaps);
 
-	auto nanos = delta;
+	tfs->hook_guard = hook_guard;
+}
 
-	if (h.count() > 0)
-		str = utils::asprintf("%" PRId64 " hours %" PRId64 " mins", h.count(),
-				      mins.count());
-	else if (mins.count() > 0)
-		str = utils::asprintf("%" PRId64 " mins %" PRId64 " secs", mins.count(),
-				      secs.count());
-	else if (secs.count() > 0)
-		str = utils::asprintf("%" PRId64 ".%" PRId64 " secs", secs.count(), millis.count());
-	else if (millis.count() > 0)
-		str = utils::asprintf("%" PRId64 ".%" PRId64 " ms", millis.count(), micros.count());
-	else if (micros.count() > 0)
-		str = utils::asprintf("%" PRId64 ".%" PRId64 " us", micros.count(), nanos.count());
-	else
-		str = utils::asprintf("%" PRId64 " ns", nanos.count());
+// live size and count of each stack id at the previous delta dump
+struct delta_base_t {
+	uint64_t total_size;
+	uint64_t count;
+};
 
-	return str;
-}
+// The delta state is used by the interval thread only.
+static std::vector<delta_base_t> delta_base;
+static uint64_t delta_generation;
+static time_point_t delta_time;
 
-static std::string get_byte_unit(uint64_t size)
+// Prints only the stacks whose live size or count grew since the previous
+// call, so that slow leaks stand out in the periodic dumps.
+void dump_stackmap_delta(const char *sort_keys, bool flamegraph)
 {
-	std::string str;
-	int ret;
+	auto *tfs = &thread_flags;
+	bool hook_guard = tfs->hook_guard;
+	uint64_t generation = stackmap_generation.load();
+
+	tfs->hook_guard = true;
+
+	if (opts.async)
+		eventbuf_flush();
+
+	std::vector<delta_stack_t> grown;
+	for (auto &shard : stack_shards) {
+		std::lock_guard<std::mutex> lock(shard.lock);
+
+		// cleared in the middle, start over in the next round.
+		if (stackmap_generation.load() != generation) {
+			tfs->hook_guard = hook_guard;
+			return;
+		}
+
+		// the ids are given to different stacks after clear.
+		if (delta_generation != generation || delta_time == time_point_t()) {
+			delta_base.clear();
+			delta_generation = generation;
+			delta_time = stackmap_start;
+		}
 
-	utils::bytes sz(size);
+		shard.stackmap.for_each([&grown](stack_id_t id) {
+			const stack_entry_t *entry = stack_table.get(id);
+			const stack_info_t &info = entry->info;
 
-	auto mb = std::chrono::duration_cast<utils::megabytes>(sz);
-	sz -= mb;
+			if (id >= delta_base.size())
+				delta_base.resize(id + 1);
 
-	auto kb = std::chrono::duration_cast<utils::kilobytes>(sz);
-	sz -= kb;
+			delta_base_t &base = delta_base[id];
+			if (info.total_size > base.total_size || info.count > base.count) {
+				grown.push_back({ id, (int64_t)(info.total_size - base.total_size),
+						  (int64_t)(info.count - base.count) });
+			}
+			base = { info.total_size, info.count };
+		});
+	}
 
-	auto b = sz;
+	dump_info_t info;
+	get_dump_info(info);
 
-	if (mb.count() > 0)
-		str = utils::asprintf("%" PRId64 ".%" PRId64 " MB", mb.count(), kb.count());
-	else if (kb.count() > 0)
-		str = utils::asprintf("%" PRId64 ".%" PRId64 " KB", kb.count(), b.count());
-	else
-		str = utils::asprintf("%" PRId64 " bytes", b.count());
+	auto period = info.time - delta_time;
+	delta_time = info.time;
+
+	if (!grown.empty()) {
+		sync_symbol_cache();
+		print_delta_dump(grown, read_stack, &generation, sort_keys, flamegraph, info, period,
+				 lookup_symbol);
+	}
 
-	return str;
+	tfs->hook_guard = hook_guard;
 }
 
-std::string read_statm()
+void clear_stackmap(void)
 {
-	long vss;
-	long rss;
-	long shared;
-	long pagesize_kb = sysconf(_SC_PAGESIZE);
-	std::ifstream fs("/proc/self/statm");
+	auto *tfs = &thread_flags;
+	bool hook_guard = tfs->hook_guard;
 
-	fs >> vss >> rss >> shared;
-	vss *= pagesize_kb;
-	rss *= pagesize_kb;
-	shared *= pagesize_kb;
+	tfs->hook_guard = true;
 
-	std::string str =
-		get_byte_unit(vss) + " / " + get_byte_unit(rss) + " / " + get_byte_unit(shared);
-	return str;
+	// Take all the locks in the same order as release_backtrace() does.
+	for (auto &shard : addr_shards)
+		shard.lock.lock();
+	for (auto &shard : stack_shards)
+		shard.lock.lock();
+
+	// no event is being recorded as all the locks are held.
+	if (opts.event_log)
+		evlog_clear();
+
+	for (auto &shard : addr_shards)
+		shard.addrmap.clear();
+	for (auto &shard : stack_shards)
+		shard.stackmap.clear();
+	stack_table.clear();
+	clear_mmaps();
+	thread_clear();
+	stackmap_generation++;
+	stackmap_start = std::chrono::steady_clock::now();
+
+	for (auto &shard : stack_shards)
+		shard.lock.unlock();
+	for (auto &shard : addr_shards)
+		shard.lock.unlock();
+
+	tfs->hook_guard = hook_guard;
 }
 
-static void print_dump_stackmap_header(const char *sort_key)
+// Adds an unreachable object to the leaks of its stack.
+static void add_leak(std::vector<leak_stack_t> &stacks,
+		     std::unordered_map<stack_id_t, size_t> &index, const leak_object_t &obj)
 {
-	pr_out("[heaptrace] dump allocation sorted by '%s' for /proc/%ld/maps (%s)\n", sort_key,
-	       utils::gettid(), utils::get_comm_name().c_str());
+	const stack_entry_t *entry = stack_table.get(obj.stack_id);
+	if (unlikely(!entry))
+		return;
+
+	auto it = index.emplace(obj.stack_id, stacks.size()).first;
+	if (it->second == stacks.size())
+		stacks.push_back({ obj.stack_id, 0, 0, 0, 0 });
+
+	leak_stack_t &leak = stacks[it->second];
+	if (obj.state == LEAK_DEFINITE) {
+		leak.definite_count++;
+		leak.definite_size += obj.size;
+	}
+	else {
+		leak.possible_count++;
+		leak.possible_size += obj.size;
+	}
 }
 
-static void
-print_dump_stackmap_footer(const std::vector<std::pair<stack_trace_t, stack_info_t>> &sorted_stack)
+// Groups the unreachable objects by their stacks.  The addrmap should still be
+// locked so that the stack ids are not reused.
+static void collect_leaks(std::vector<leak_stack_t> &stacks)
 {
-	/*
-	 * Get allocated size information from the allocator. mallinfo() is
-	 * deprecated because it uses int for variables, which can only support
-	 * memory sizes less than 4GB. Therefore, use mallinfo() only in
-	 * environments with old glibc versions less than 2.33
-	 */
-#ifdef GLIBC_233_OR_LATER
-	struct mallinfo2 minfo = mallinfo2();
-#else
-	struct mallinfo minfo = mallinfo();
-#endif
+	std::unordered_map<stack_id_t, size_t> index;
+	size_t nr_objects;
+	const leak_object_t *objects = leak_scan_objects(&nr_objects);
 
-	uint64_t total_size = 0;
-	size_t stack_size = sorted_stack.size();
-	for (int i = 0; i < stack_size; i++) {
-		const stack_info_t &sinfo = sorted_stack[i].second;
-		total_size += sinfo.total_size;
+	for (size_t i = 0; i < nr_objects; i++) {
+		if (objects[i].state != LEAK_REACHABLE)
+			add_leak(stacks, index, objects[i]);
 	}
+}
 
-	pr_out("[heaptrace] heap traced num of backtrace : %zd\n", stack_size);
+void dump_leaks(void)
+{
+	auto *tfs = &thread_flags;
+	bool hook_guard = tfs->hook_guard;
+	uint64_t generation = stackmap_generation.load();
+	std::vector<leak_stack_t> stacks;
+	leak_info_t linfo;
+	uint32_t nr_unstopped = 0;
+	bool done = false;
 
-	pr_out("[heaptrace] heap traced allocation size  : %s\n",
-	       get_byte_unit(total_size).c_str());
+	tfs->hook_guard = true;
 
-	pr_out("[heaptrace] allocator info (virtual)     : %s\n",
-	       get_byte_unit(minfo.arena + minfo.hblkhd).c_str());
-	pr_out("[heaptrace] allocator info (resident)    : %s\n",
-	       get_byte_unit(minfo.uordblks).c_str());
+	// every live object should be in the addrmap, or the objects pointed
+	// only by the missing ones would look leaked.
+	if (opts.sample_rate || opts.async || opts.attach) {
+		pr_out("[heaptrace] leak check is not supported with sampling, async or attach\n");
+		tfs->hook_guard = hook_guard;
+		return;
+	}
 
-	pr_out("[heaptrace] statm info (VSS/RSS/shared)  : %s\n", read_statm().c_str());
-}
+	if (!leak_scan_prepare(false)) {
+		pr_out("[heaptrace] failed to start the leak check\n");
+		leak_scan_finish();
+		tfs->hook_guard = hook_guard;
+		return;
+	}
 
-static void print_dump_stackmap(std::vector<std::pair<stack_trace_t, stack_info_t>> &sorted_stack)
-{
-	const time_point_t current = std::chrono::steady_clock::now();
-	int cnt = 1;
-	int top = opts.top;
-	int i = 0;
-
-	size_t stack_size = sorted_stack.size();
-	while (i < stack_size && i < top) {
-		const stack_info_t &info = sorted_stack[i].second;
-		const stack_trace_t &stack_trace = sorted_stack[i].first;
-		std::string age = get_delta_time_unit(current - info.birth_time);
-		std::stringstream ss_intro;
-		std::stringstream ss_bt;
-
-		ss_intro << "=== backtrace #" << cnt << " === [count/peak: " << info.count << "/"
-			 << info.peak_count << "] "
-			 << "[size/peak: " << get_byte_unit(info.total_size) << "/"
-			 << get_byte_unit(info.peak_total_size) << "] [age: " << age << "]\n";
-		ss_bt << std::setfill('0');
-		for (int j = 0; j < info.stack_depth; j++)
-			get_backtrace_string(j, stack_trace[j], ss_bt);
-
-		if (is_ignored(ss_bt.str())) {
-			++top;
-		}
-		else {
-			pr_out("%s%s\n", ss_intro.str().c_str(), ss_bt.str().c_str());
-			++cnt;
+	// no object is allocated or freed until the scan is done.
+	for (auto &shard : addr_shards)
+		shard.lock.lock();
+
+	size_t nr_objects = 0;
+	for (auto &shard : addr_shards)
+		nr_objects += shard.addrmap.size();
+
+	bool reserved = leak_scan_reserve(nr_objects);
+	if (reserved) {
+		for (auto &shard : addr_shards) {
+			shard.addrmap.for_each([](addr_t addr, const object_info_t &info) {
+				leak_scan_add(addr, info);
+			});
 		}
-		++i;
+		done = leak_scan_run(linfo, &nr_unstopped);
 	}
-}
+	if (done)
+		collect_leaks(stacks);
 
-static void
-print_dump_stackmap_flamegraph(std::vector<std::pair<stack_trace_t, stack_info_t>> &sorted_stack)
-{
-	size_t stack_size = sorted_stack.size();
-	int i = 0;
-	int top = opts.top;
-
-	while (i < stack_size && i < top) {
-		const stack_info_t &info = sorted_stack[i].second;
-		uint64_t size = info.total_size;
-		const char *semicolon = "";
-		const stack_trace_t &stack_trace = sorted_stack[i].first;
-		std::stringstream ss_bt;
-
-		ss_bt << std::hex;
-		for (size_t j = 0; j < info.stack_depth; ++j) {
-			get_backtrace_string_flamegraph(stack_trace[info.stack_depth - 1 - j],
-							semicolon, ss_bt);
-			semicolon = ";";
-		}
-		if (is_ignored(ss_bt.str())) {
-			++top;
-		}
-		else {
-			pr_out("%s", ss_bt.str().c_str());
-			pr_out(" %" PRIu64 "\n", size);
-		}
-		++i;
+	for (auto &shard : addr_shards)
+		shard.lock.unlock();
+
+	leak_scan_finish();
+
+	if (!done) {
+		if (!reserved)
+			pr_out("[heaptrace] failed to start the leak check\n");
+		else
+			pr_out("[heaptrace] leak check cancelled: failed to stop %u threads\n",
+			       nr_unstopped);
+		tfs->hook_guard = hook_guard;
+		return;
 	}
 
-	fflush(outfp);
+	dump_info_t info;
+	get_dump_info(info);
+
+	sync_symbol_cache();
+	print_leak_dump(stacks, read_stack, &generation, linfo, info, lookup_symbol);
+
+	tfs->hook_guard = hook_guard;
 }
 
-static void sort_stack(const std::string &order,
-		       std::vector<std::pair<stack_trace_t, stack_info_t>> &sorted_stack)
+// an unreachable object found by the previous incremental leak check
+struct leak_candidate_t {
+	uintptr_t addr;
+	uint64_t time;
+	bool reported;
+};
+
+// sorted by the address, only the incremental checks use them.
+static std::vector<leak_candidate_t> leak_candidates;
+static uint64_t leak_candidates_generation;
+
+// returns true if the object is in the copy of the incremental leak check.
+static bool is_leak_scanned(addr_t addr, const object_info_t &info)
 {
-	std::sort(sorted_stack.begin(), sorted_stack.end(),
-		  [&order](const std::pair<stack_trace_t, stack_info_t> &p1,
-			   const std::pair<stack_trace_t, stack_info_t> &p2) {
-			  if (order == "count") {
-				  if (p1.second.count == p2.second.count)
-					  return p1.second.total_size > p2.second.total_size;
-				  return p1.second.count > p2.second.count;
-			  }
-			  else {
-				  // sort based on size for unknown sort order.
-				  if (p1.second.total_size == p2.second.total_size)
-					  return p1.second.count > p2.second.count;
-				  return p1.second.total_size > p2.second.total_size;
-			  }
-		  });
+	size_t nr_objects;
+	const leak_object_t *objects = leak_scan_objects(&nr_objects);
+	const leak_object_t *end = objects + nr_objects;
+	auto it = std::lower_bound(objects, end, (uintptr_t)addr,
+				   [](const leak_object_t &obj, uintptr_t a) { return obj.addr < a; });
+
+	return it != end && it->addr == (uintptr_t)addr && it->time == info.time;
 }
 
-void dump_stackmap(const char *sort_keys, bool flamegraph)
+// Groups the unreachable objects that are still alive and were found by the
+// previous check too, but only the ones not reported yet.  The candidates
+// are replaced by the unreachable objects of this check.
+static void collect_new_leaks(std::vector<leak_stack_t> &stacks)
 {
-	auto *tfs = &thread_flags;
+	std::unordered_map<stack_id_t, size_t> index;
+	std::vector<leak_candidate_t> candidates;
+	size_t nr_objects;
+	const leak_object_t *objects = leak_scan_objects(&nr_objects);
+	auto prev = leak_candidates.cbegin();
+
+	for (size_t i = 0; i < nr_objects; i++) {
+		const leak_object_t &obj = objects[i];
+
+		if (obj.state == LEAK_REACHABLE)
+			continue;
+
+		// it might be freed during the check, and the address reused.
+		addr_shard_t &ashard = get_addr_shard((addr_t)obj.addr);
+		{
+			std::lock_guard<std::mutex> mlock(leak_monitor_lock);
+			std::lock_guard<std::mutex> lock(ashard.lock);
+			object_info_t *info = ashard.addrmap.find((addr_t)obj.addr);
+
+			if (!info || info->time != obj.time)
+				continue;
+		}
 
-	if (stackmap.empty())
+		while (prev != leak_candidates.cend() && prev->addr < obj.addr)
+			++prev;
+
+		bool found = prev != leak_candidates.cend() && prev->addr == obj.addr &&
+			     prev->time == obj.time;
+		candidates.push_back({ obj.addr, obj.time, found });
+
+		if (found && !prev->reported)
+			add_leak(stacks, index, obj);
+	}
+	leak_candidates.swap(candidates);
+}
+
+void dump_new_leaks(void)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t generation = stackmap_generation.load();
+	std::vector<leak_stack_t> stacks;
+	leak_info_t linfo;
+	uint32_t nr_unstopped = 0;
+	uint64_t max_pause = 0;
+	size_t nr_objects = 0;
+
+	if (!leak_scan_prepare(true)) {
+		leak_scan_finish();
 		return;
+	}
 
-	tfs->hook_guard = true;
+	// the shard locks are taken under leak_monitor_lock not to be held
+	// across fork().
+	leak_monitor_lock.lock();
+	for (auto &shard : addr_shards) {
+		std::lock_guard<std::mutex> lock(shard.lock);
+		nr_objects += shard.addrmap.size();
+	}
+	leak_monitor_lock.unlock();
 
-	std::vector<std::string> sort_key_vec = utils::string_split(sort_keys, ',');
+	// leave room for the objects allocated until the shards are copied.
+	bool done = leak_scan_reserve(nr_objects + nr_objects / 4 + 1024);
 
-	// sort the stack trace based on the count and then total_size
-	std::vector<std::pair<stack_trace_t, stack_info_t>> sorted_stack;
-	{
-		// protect stackmap access
-		std::lock_guard<std::recursive_mutex> lock(container_mutex);
+	// A shard starts logging its new objects as soon as it's copied, so the
+	// program waits for a shard at most.
+	for (int i = 0; i < NR_SHARDS && done; i++) {
+		addr_shard_t &shard = addr_shards[i];
+
+		leak_monitor_lock.lock();
+		shard.lock.lock();
+		uint64_t copy_start = utils::get_time_ns();
+
+		shard.addrmap.for_each([&](addr_t addr, const object_info_t &info) {
+			if (!leak_scan_add(addr, info))
+				done = false;
+		});
+		shard.leak_log = leak_scan_log(i);
+
+		max_pause = std::max(max_pause, utils::get_time_ns() - copy_start);
+		shard.lock.unlock();
+		leak_monitor_lock.unlock();
 
-		for (auto &p : stackmap)
-			sorted_stack.emplace_back(p.first, p.second);
+		if (!leak_scan_yield())
+			done = false;
 	}
 
-	if (flamegraph) {
-		// use only the first sort order given by -s/--sort option.
-		sort_stack(sort_key_vec.front(), sorted_stack);
-		print_dump_stackmap_flamegraph(sorted_stack);
+	if (done)
+		done = leak_scan_run_incremental(linfo, &nr_unstopped);
+
+	bool overflow[NR_SHARDS] = {};
+	leak_monitor_lock.lock();
+	for (int i = 0; i < NR_SHARDS; i++) {
+		addr_shard_t &shard = addr_shards[i];
+		std::lock_guard<std::mutex> lock(shard.lock);
+
+		overflow[i] = shard.leak_log && shard.leak_log->overflow;
+		shard.leak_log = nullptr;
 	}
-	else {
-		pr_out("=================================================================\n");
-		for (const auto &sort_key : sort_key_vec) {
-			print_dump_stackmap_header(sort_key.c_str());
-			sort_stack(sort_key, sorted_stack);
-			print_dump_stackmap(sorted_stack);
-		}
-		print_dump_stackmap_footer(sorted_stack);
-		pr_out("=================================================================\n");
-		fflush(outfp);
+	leak_monitor_lock.unlock();
+
+	// the logs might have more objects until they're detached above.
+	if (done)
+		done = leak_scan_drain();
+
+	// A full log missed some new objects, which are the ones in the addrmap
+	// but not in the copy.
+	for (int i = 0; i < NR_SHARDS && done; i++) {
+		std::vector<std::pair<uintptr_t, uint64_t>> missed;
+
+		if (!overflow[i])
+			continue;
+
+		addr_shard_t &shard = addr_shards[i];
+		leak_monitor_lock.lock();
+		shard.lock.lock();
+		uint64_t copy_start = utils::get_time_ns();
+
+		shard.addrmap.for_each([&](addr_t addr, const object_info_t &info) {
+			if (!is_leak_scanned(addr, info))
+				missed.push_back({ (uintptr_t)addr, info.size });
+		});
+
+		max_pause = std::max(max_pause, utils::get_time_ns() - copy_start);
+		shard.lock.unlock();
+		leak_monitor_lock.unlock();
+
+		for (const auto &m : missed)
+			leak_scan_new(m.first, m.second);
+		done = leak_scan_drain();
 	}
 
-	tfs->hook_guard = false;
-}
+	// the stack ids of the candidates are not valid after a clear.
+	if (generation != leak_candidates_generation) {
+		leak_candidates.clear();
+		leak_candidates_generation = generation;
+	}
+	if (done)
+		collect_new_leaks(stacks);
 
-void clear_stackmap(void)
-{
-	std::lock_guard<std::recursive_mutex> lock(container_mutex);
-	auto *tfs = &thread_flags;
+	leak_scan_finish();
 
-	tfs->hook_guard = true;
+	if (!done) {
+		if (nr_unstopped)
+			pr_dbg("leak check skipped: failed to stop %u threads\n", nr_unstopped);
+		return;
+	}
+	if (stacks.empty() || generation != stackmap_generation.load())
+		return;
 
-	stackmap.clear();
-	addrmap.clear();
+	linfo.pause = std::max(linfo.pause, std::chrono::nanoseconds(max_pause));
+	linfo.elapsed = std::chrono::steady_clock::now() - start;
 
-	tfs->hook_guard = false;
+	if (!control_output_lock())
+		return;
+
+	dump_info_t info;
+	get_dump_info(info);
+
+	sync_symbol_cache();
+	print_leak_dump(stacks, read_stack, &generation, linfo, info, lookup_symbol);
+
+	control_output_unlock();
+}
+
+void detach_leak_logs(void)
+{
+	// the child has only the thread calling fork(), which holds no shard.
+	for (auto &shard : addr_shards)
+		shard.leak_log = nullptr;
 }
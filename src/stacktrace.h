@@ -11,10 +11,26 @@
 
 #include "compiler.h"
 #include "heaptrace.h"
+#include "sampling.h"
+#include "threadmap.h"
+#include "utils.h"
 
 using stack_trace_t = std::array<void *, DEPTH>;
 using addr_t = void *;
 using time_point_t = std::chrono::steady_clock::time_point;
+using stack_id_t = uint32_t;
+
+#define STACK_ID_NONE UINT32_MAX
+
+// The lifetime of freed objects is counted in log-scale buckets, each of
+// them 10 times longer than the previous one: <1us, <10us, ..., <100s, >=100s.
+#define NR_LIFETIME_BUCKETS 10
+
+// Request sizes are counted in power-of-2 size classes from 16 bytes, which
+// are coarser than the classes of glibc and jemalloc.  The last class is for
+// the sizes bigger than 256KB.
+#define NR_SIZE_CLASSES 16
+#define MIN_SIZE_CLASS 16
 
 struct stack_info_t {
 	size_t stack_depth;
@@ -23,15 +39,82 @@ struct stack_info_t {
 	size_t count;
 	size_t peak_count;
 	time_point_t birth_time;
+	uint64_t lifetime[NR_LIFETIME_BUCKETS];
+	// live objects in each size class
+	uint64_t size_class[NR_SIZE_CLASSES];
+	// bytes of the live objects usable but not requested
+	uint64_t waste;
+	// cumulative numbers, kept even if no object is live.
+	uint64_t nr_allocs;
+	uint64_t nr_frees;
+	uint64_t alloc_bytes;
+	uint64_t free_bytes;
 };
 
 struct object_info_t {
-	stack_trace_t stack_trace;
 	uint64_t size;
+	stack_id_t stack_id;
+	// number of allocations it stands for, more than 1 if it's sampled.
+	uint32_t count;
+	// allocation time by utils::get_time_ns()
+	uint64_t time;
+	// malloc_usable_size() - requested size of each allocation
+	uint32_t waste;
+	uint32_t size_class;
+	// slot of the allocating thread in the threadmap
+	uint32_t thread;
+};
+
+inline int lifetime_bucket(uint64_t nsec)
+{
+	uint64_t limit = 1000;
+	int i;
+
+	for (i = 0; i < NR_LIFETIME_BUCKETS - 1; i++, limit *= 10) {
+		if (nsec < limit)
+			break;
+	}
+	return i;
+}
+
+inline int get_size_class(uint64_t size)
+{
+	uint64_t limit = MIN_SIZE_CLASS;
+	int i;
+
+	for (i = 0; i < NR_SIZE_CLASSES - 1; i++, limit *= 2) {
+		if (size <= limit)
+			break;
+	}
+	return i;
+}
+
+// where and when an alloc/free event happened, kept for the event log and
+// the per-thread accounting.
+struct event_origin_t {
+	uint64_t time;
+	uint32_t tid;
+	uint32_t flags;
 };
 
+// the event is a half of realloc()
+#define EVENT_REALLOC (1U << 0)
+
+inline event_origin_t get_event_origin(void)
+{
+	auto *tfs = &thread_flags;
+
+	if (unlikely(tfs->tid == 0))
+		tfs->tid = thread_register();
+	return { utils::get_time_ns(), tfs->tid, tfs->in_realloc ? EVENT_REALLOC : 0U };
+}
+
 void __record_backtrace(size_t size, void *addr, stack_trace_t &stack_trace, int nptrs);
 
+// Walks the frame pointer chain instead of unwinding with DWARF CFI like
+// backtrace() does.  It works only when the program keeps frame pointers.
+int fp_backtrace(void **buffer, int size);
+
 // This is defined as a inline function to avoid having one more useless
 // backtrace in the recorded stacktrace.
 // Most of the work will be done inside __record_backtrace().
@@ -43,14 +126,42 @@ inline void record_backtrace(size_t size, void *addr)
 	if (unlikely(!addr))
 		return;
 
-	nptrs = backtrace(stack_trace.data(), DEPTH);
+	// don't even get the backtrace if it's not sampled.
+	if (opts.sample_rate && !sample_allocation(size))
+		return;
+
+	if (opts.unwinder == UNWIND_FP)
+		nptrs = fp_backtrace(stack_trace.data(), DEPTH);
+	else
+		nptrs = backtrace(stack_trace.data(), DEPTH);
 	__record_backtrace(size, addr, stack_trace, nptrs);
 }
 
 void release_backtrace(void *addr);
 
+// These update the stackmap/addrmap directly even in async mode.
+void do_record_backtrace(size_t size, size_t usable, void *addr, stack_trace_t &stack_trace,
+			 int nptrs, const event_origin_t &origin);
+void do_release_backtrace(void *addr, const event_origin_t &origin);
+
 void dump_stackmap(const char *sort_keys, bool flamegraph = false);
 
+void dump_stackmap_delta(const char *sort_keys, bool flamegraph = false);
+
+// prints only the summary of the dump even if it's empty
+void dump_stackmap_summary(void);
+
 void clear_stackmap(void);
 
+// Prints the stacks of the objects that are not reachable from the program.
+void dump_leaks(void);
+
+// Runs an incremental leak check without stopping the program, and prints the
+// objects found unreachable by this and the previous check if not yet.
+void dump_new_leaks(void);
+
+// Stops logging the new objects for the incremental leak check, which is not
+// running in a forked child.
+void detach_leak_logs(void);
+
 #endif /* HEAPTRACE_STACKTRACE_H */
@@ -0,0 +1,105 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <link.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "symbol.h"
+
+#define SYMBOL_MAXLEN 128
+
+static std::unordered_map<void *, symbol_t> symbol_cache;
+static std::mutex symbol_lock;
+
+// number of dlopen() and dlclose() when the cache was validated
+static unsigned long long dl_changes;
+
+static int get_dl_changes(struct dl_phdr_info *info, size_t size, void *data)
+{
+	// dlpi_adds and dlpi_subs are the same for every object.
+	if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+		*static_cast<unsigned long long *>(data) = info->dlpi_adds + info->dlpi_subs;
+	return 1;
+}
+
+unsigned long long count_dl_changes(void)
+{
+	unsigned long long changes = 0;
+
+	dl_iterate_phdr(get_dl_changes, &changes);
+	return changes;
+}
+
+void sync_symbol_cache(void)
+{
+	unsigned long long changes = count_dl_changes();
+
+	std::lock_guard<std::mutex> lock(symbol_lock);
+	if (changes != dl_changes) {
+		symbol_cache.clear();
+		dl_changes = changes;
+	}
+}
+
+std::string demangle_symbol(const char *name)
+{
+	std::string str;
+	char *symbol;
+	int status;
+	size_t len = SYMBOL_MAXLEN;
+
+	symbol = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+	if (status != 0)
+		symbol = strdup(name);
+
+	if (strlen(symbol) > len) {
+		symbol[len - 3] = '.';
+		symbol[len - 2] = '.';
+		symbol[len - 1] = '.';
+		symbol[len] = '\0';
+	}
+	str = symbol;
+	free(symbol);
+	return str;
+}
+
+static void resolve_symbol(void *addr, symbol_t &sym)
+{
+	Dl_info dlip;
+
+	// dladdr() translates address to symbolic info.
+	sym.found = dladdr(addr, &dlip) != 0;
+	if (!sym.found)
+		return;
+
+	if (dlip.dli_sname != nullptr && dlip.dli_saddr != nullptr) {
+		sym.name = demangle_symbol(dlip.dli_sname);
+		sym.offset = static_cast<int>(static_cast<int *>(addr) -
+					      static_cast<int *>(dlip.dli_saddr));
+	}
+	sym.fname = dlip.dli_fname;
+	sym.file_offset = (int)((char *)addr - (char *)(dlip.dli_fbase));
+}
+
+const symbol_t &lookup_symbol(void *addr)
+{
+	std::lock_guard<std::mutex> lock(symbol_lock);
+
+	auto it = symbol_cache.find(addr);
+	if (it != symbol_cache.end())
+		return it->second;
+
+	symbol_t &sym = symbol_cache[addr];
+	resolve_symbol(addr, sym);
+	return sym;
+}
@@ -0,0 +1,33 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_SYMBOL_H
+#define HEAPTRACE_SYMBOL_H
+
+#include <string>
+
+// symbolic info of a return address from dladdr()
+struct symbol_t {
+	// false if dladdr() failed
+	bool found;
+	// demangled symbol name, empty if it has no symbol
+	std::string name;
+	int offset;
+	std::string fname;
+	int file_offset;
+};
+
+// Returns the symbolic info of the addr.  Resolved addresses are cached so
+// the same frame is resolved only once across all the dumps.
+const symbol_t &lookup_symbol(void *addr);
+
+// Demangles the name and truncates it if it's too long.
+std::string demangle_symbol(const char *name);
+
+// Returns the number of dlopen() and dlclose() so far.
+unsigned long long count_dl_changes(void);
+
+// Drops the cached symbols if any object is loaded or unloaded since the
+// last call.  It must be called before resolving symbols of a new dump.
+void sync_symbol_cache(void);
+
+#endif /* HEAPTRACE_SYMBOL_H */
@@ -0,0 +1,195 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <cstring>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+
+#include "compiler.h"
+#include "dump.h"
+#include "heaptrace.h"
+#include "threadmap.h"
+#include "utils.h"
+
+// the maximum pid of linux on 64-bit, see PID_MAX_LIMIT in linux/threads.h
+#define THREADMAP_MAX_TID (4 * 1024 * 1024)
+
+// number of thread slots, the others share the slot 0.
+#define THREADMAP_MAX_SLOTS (64 * 1024)
+
+// each thread updates its own slot mostly, keep them in separate cache lines.
+struct thread_stat_t {
+	std::atomic<uint64_t> total_size __align(64);
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> nr_allocs;
+	std::atomic<uint64_t> nr_frees;
+	// own objects freed by other threads
+	std::atomic<uint64_t> remote_frees;
+	// objects of other threads freed by this thread
+	std::atomic<uint64_t> foreign_frees;
+
+	uint32_t tid;
+	char comm[16];
+};
+
+// slot + 1 of each tid, 0 if it has none.
+static std::atomic<uint32_t> *tid_slots;
+static thread_stat_t *thread_stats;
+static std::atomic<uint32_t> nr_slots;
+
+static void *alloc_pages(size_t size)
+{
+	// anonymous mapping is zero filled and only the touched pages are used.
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? nullptr : p;
+}
+
+static void threadmap_atfork_child(void)
+{
+	// the forking thread is the only one in the child and has a new tid.
+	thread_flags.tid = 0;
+}
+
+bool threadmap_init(void)
+{
+	tid_slots = static_cast<std::atomic<uint32_t> *>(
+		alloc_pages(THREADMAP_MAX_TID * sizeof(*tid_slots)));
+	thread_stats = static_cast<thread_stat_t *>(
+		alloc_pages(THREADMAP_MAX_SLOTS * sizeof(*thread_stats)));
+	if (!tid_slots || !thread_stats)
+		return false;
+
+	nr_slots.store(1);
+	pthread_atfork(nullptr, nullptr, threadmap_atfork_child);
+	return true;
+}
+
+uint32_t thread_register(void)
+{
+	uint32_t tid = utils::gettid();
+
+	if (!thread_stats || tid >= THREADMAP_MAX_TID)
+		return tid;
+
+	uint32_t slot = nr_slots.fetch_add(1, std::memory_order_relaxed);
+	if (slot >= THREADMAP_MAX_SLOTS) {
+		tid_slots[tid].store(0, std::memory_order_relaxed);
+		return tid;
+	}
+
+	// the name might be changed later, it's used after the thread exits.
+	thread_stats[slot].tid = tid;
+	prctl(PR_GET_NAME, thread_stats[slot].comm);
+
+	// a new thread might reuse the tid of an exited thread.
+	tid_slots[tid].store(slot + 1, std::memory_order_release);
+	return tid;
+}
+
+static thread_stat_t *get_thread_stat(uint32_t tid, uint32_t *slot)
+{
+	uint32_t idx = 0;
+
+	if (tid < THREADMAP_MAX_TID)
+		idx = tid_slots[tid].load(std::memory_order_acquire);
+	*slot = idx ? idx - 1 : 0;
+	return &thread_stats[*slot];
+}
+
+uint32_t thread_account_alloc(uint32_t tid, uint64_t size, uint32_t count)
+{
+	uint32_t slot;
+
+	if (!thread_stats)
+		return 0;
+
+	thread_stat_t *ts = get_thread_stat(tid, &slot);
+	ts->total_size.fetch_add(size, std::memory_order_relaxed);
+	ts->count.fetch_add(count, std::memory_order_relaxed);
+	ts->nr_allocs.fetch_add(count, std::memory_order_relaxed);
+	return slot;
+}
+
+void thread_account_free(uint32_t slot, uint32_t tid, uint64_t size, uint32_t count)
+{
+	uint32_t freer;
+
+	if (!thread_stats)
+		return;
+
+	thread_stat_t *ts = &thread_stats[slot];
+	ts->total_size.fetch_sub(size, std::memory_order_relaxed);
+	ts->count.fetch_sub(count, std::memory_order_relaxed);
+	ts->nr_frees.fetch_add(count, std::memory_order_relaxed);
+
+	thread_stat_t *fs = get_thread_stat(tid, &freer);
+	if (freer != slot) {
+		ts->remote_frees.fetch_add(count, std::memory_order_relaxed);
+		fs->foreign_frees.fetch_add(count, std::memory_order_relaxed);
+	}
+}
+
+void thread_clear(void)
+{
+	uint32_t n = std::min<uint32_t>(nr_slots.load(), THREADMAP_MAX_SLOTS);
+
+	for (uint32_t i = 0; thread_stats && i < n; i++) {
+		thread_stat_t *ts = &thread_stats[i];
+
+		ts->total_size.store(0, std::memory_order_relaxed);
+		ts->count.store(0, std::memory_order_relaxed);
+		ts->nr_allocs.store(0, std::memory_order_relaxed);
+		ts->nr_frees.store(0, std::memory_order_relaxed);
+		ts->remote_frees.store(0, std::memory_order_relaxed);
+		ts->foreign_frees.store(0, std::memory_order_relaxed);
+	}
+}
+
+void collect_threads(std::vector<thread_dump_t> &threads)
+{
+	uint32_t n = std::min<uint32_t>(nr_slots.load(), THREADMAP_MAX_SLOTS);
+
+	for (uint32_t i = 0; thread_stats && i < n; i++) {
+		const thread_stat_t *ts = &thread_stats[i];
+		thread_dump_t td;
+
+		td.nr_allocs = ts->nr_allocs.load(std::memory_order_relaxed);
+		td.foreign_frees = ts->foreign_frees.load(std::memory_order_relaxed);
+		if (td.nr_allocs == 0 && td.foreign_frees == 0)
+			continue;
+
+		td.tid = ts->tid;
+		td.total_size = ts->total_size.load(std::memory_order_relaxed);
+		td.count = ts->count.load(std::memory_order_relaxed);
+		td.nr_frees = ts->nr_frees.load(std::memory_order_relaxed);
+		td.remote_frees = ts->remote_frees.load(std::memory_order_relaxed);
+		td.comm = ts->comm;
+		td.exited = true;
+
+		// the slot 0 is shared by many threads.
+		if (i == 0) {
+			td.comm = "(others)";
+			threads.push_back(td);
+			continue;
+		}
+
+		// the tid belongs to a new thread if it has another slot.
+		if (tid_slots[td.tid].load(std::memory_order_relaxed) == i + 1) {
+			std::string path = utils::asprintf("/proc/self/task/%u/comm", td.tid);
+			std::ifstream fs(path);
+			std::string comm;
+
+			if (std::getline(fs, comm)) {
+				td.comm = comm;
+				td.exited = false;
+			}
+		}
+		threads.push_back(td);
+	}
+}
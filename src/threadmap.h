@@ -0,0 +1,35 @@
+/* Copyright (c) 2022 LG Electronics Inc. */
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef HEAPTRACE_THREADMAP_H
+#define HEAPTRACE_THREADMAP_H
+
+#include <cstdint>
+
+#include <vector>
+
+// The live objects are also accounted to the thread that allocated them.
+// Each thread gets a slot when it first allocates, and a table indexed by
+// tid maps the tid to the slot without any lock as the tid is bounded by
+// PID_MAX_LIMIT.  The slots are never reused so that the objects of exited
+// threads are still accounted.  Slot 0 is shared by the threads beyond the
+// limit of the slots.
+
+bool threadmap_init(void);
+
+// Returns the tid of the current thread after giving it a slot.
+uint32_t thread_register(void);
+
+// Accounts an allocation to the thread of tid and returns its slot.
+uint32_t thread_account_alloc(uint32_t tid, uint64_t size, uint32_t count);
+
+// Accounts a free by the thread of tid of an object allocated by the thread
+// in the slot.
+void thread_account_free(uint32_t slot, uint32_t tid, uint64_t size, uint32_t count);
+
+void thread_clear(void);
+
+struct thread_dump_t;
+
+void collect_threads(std::vector<thread_dump_t> &threads);
+
+#endif /* HEAPTRACE_THREADMAP_H */
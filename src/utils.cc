@@ -3,6 +3,7 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <unistd.h>
 
 #include <fstream>
 #include <sstream>
@@ -35,7 +36,7 @@ std::string get_comm_name(void)
 	std::string comm;
 	std::stringstream ss;
 
-	ss << "/proc/" << utils::gettid() << "/comm";
+	ss << "/proc/" << getpid() << "/comm";
 
 	std::ifstream fs(ss.str());
 	fs >> comm;
@@ -70,41 +71,58 @@ static enum_table ht_mmap_flags[] = {
 	{ "MAP_HUGETLB", 0x40000 },
 };
 
-static std::string mmap_string(int val, const struct enum_table *et, int len)
+static const char *format_mmap_string(char *buf, int val, const struct enum_table *et, int len)
 {
-	std::string str;
+	size_t pos = 0;
+
+	buf[0] = '\0';
 
 	/* exact match */
 	for (int i = len - 1; i >= 0; i--) {
-		if (val == et[i].val)
-			return { et[i].str };
+		if (val == et[i].val) {
+			snprintf(buf, MMAP_STRING_SIZE, "%s", et[i].str);
+			return buf;
+		}
 	}
 
 	/* OR-ing bit flags */
-	for (int i = len - 1; i >= 0; i--) {
+	for (int i = len - 1; i >= 0 && pos < MMAP_STRING_SIZE; i--) {
 		if (et[i].val <= val) {
 			val -= et[i].val;
-			if (!str.empty())
-				str += "|";
-			str += et[i].str;
+			pos += snprintf(buf + pos, MMAP_STRING_SIZE - pos, "%s%s", pos ? "|" : "",
+					et[i].str);
 		}
 		if (val == 0)
 			break;
 	}
 
-	return str;
+	return buf;
 }
 
-std::string mmap_prot_string(int prot)
+const char *format_mmap_prot(char *buf, int prot)
 {
 	constexpr int size = sizeof(ht_mmap_prot) / sizeof(struct enum_table);
-	return mmap_string(prot, ht_mmap_prot, size);
+	return format_mmap_string(buf, prot, ht_mmap_prot, size);
 }
 
-std::string mmap_flags_string(int flags)
+const char *format_mmap_flags(char *buf, int flags)
 {
 	constexpr int size = sizeof(ht_mmap_flags) / sizeof(struct enum_table);
-	return mmap_string(flags, ht_mmap_flags, size);
+	return format_mmap_string(buf, flags, ht_mmap_flags, size);
+}
+
+std::string mmap_prot_string(int prot)
+{
+	char buf[MMAP_STRING_SIZE];
+
+	return format_mmap_prot(buf, prot);
+}
+
+std::string mmap_flags_string(int flags)
+{
+	char buf[MMAP_STRING_SIZE];
+
+	return format_mmap_flags(buf, flags);
 }
 
 } // namespace utils
@@ -4,7 +4,9 @@
 #define HEAPTRACE_UTILS_H
 
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <ctime>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -28,6 +30,26 @@ static long gettid(void)
 	return syscall(SYS_gettid);
 }
 
+// monotonic time in nsec, used to order events across threads.
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// finalizer of MurmurHash3 (fmix64)
+static inline uint64_t hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
 std::string asprintf(const char *fmt, ...);
 
 std::string get_comm_name(void);
@@ -42,6 +64,12 @@ struct enum_table {
 std::string mmap_prot_string(int prot);
 std::string mmap_flags_string(int flags);
 
+// Fixed size versions of the above for the dumps, they return buf.
+#define MMAP_STRING_SIZE 256
+
+const char *format_mmap_prot(char *buf, int prot);
+const char *format_mmap_flags(char *buf, int flags);
+
 } // namespace utils
 
 #endif /* HEAPTRACE_UTILS_H */